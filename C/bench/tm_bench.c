@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+// Benchmark harness for Project1: runs every machine of the corpus on every engine as a separate process
+// and reports steps per second, startup time, peak memory and tape growth as JSON, one result per line
+// Every run also records a hash of its final tape - engines that leave different tapes fail the benchmark
+
+#ifndef TM_BENCH_BINARY
+#define TM_BENCH_BINARY "./Project1"
+#endif
+#ifndef TM_BENCH_CORPUS
+#define TM_BENCH_CORPUS "bench/corpus"
+#endif
+
+#define MAX_MACHINES 256
+#define MAX_RESULTS 1024
+#define NAME_LENGTH 128
+#define DEFAULT_REPEAT 5
+#define DEFAULT_THRESHOLD 5.0   // percent a benchmark may slow down before it counts as a regression
+#define MIN_JUDGED_SECONDS 0.01 // shorter runs are mostly timer noise - reported, never judged
+
+// The macro machine is benchmarked as one more engine, on blocks of 8 cells
+static const char* engineNames[] = { "interpreter", "threaded", "jit", "macro" };
+static const char* engineOptions[][2] = {
+    { "--engine", "interpreter" }, { "--engine", "threaded" }, { "--engine", "jit" }, { "--macro", "8" }
+};
+#define NUM_ENGINES 4
+
+// Measurements of one machine on one engine, the best of the repeated runs
+struct BenchResult {
+    char machine[NAME_LENGTH];
+    char engine[NAME_LENGTH];
+    char reason[NAME_LENGTH];
+    long long steps;
+    long inputCells;        // tape length before the run
+    long cells;             // cells visited by the run
+    double loadSeconds;     // parse, build the table, compile for the jit
+    double runSeconds;
+    double cpuSeconds;      // user and system time of the whole process - steadier than runSeconds on a busy machine
+    double stepsPerSecond;
+    long peakRss;           // kilobytes
+    uint64_t tapeHash;      // FNV-1a of the final tape as written, 0 when a baseline does not have it
+};
+
+struct BenchOptions {
+    const char* binary;
+    const char* corpus;
+    const char* outputName;
+    const char* compareName;
+    const char* engine;     // only this engine, or all of them
+    int repeat;
+    double threshold;
+};
+
+// Function to compare two machine names for sorting
+static int compareNames(const void* a, const void* b) {
+    return strcmp((const char*)a, (const char*)b);
+}
+
+// Function to list the machine files of the corpus in name order
+static int listCorpus(const char* corpus, char names[][NAME_LENGTH]) {
+    DIR* dir = opendir(corpus);
+    if (dir == NULL) {
+        printf("Cannot open corpus %s. \n", corpus);
+        exit(1);
+    }
+    int count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && count < MAX_MACHINES) {
+        size_t length = strlen(entry->d_name);
+        if (length > 4 && length < NAME_LENGTH && strcmp(entry->d_name + length - 4, ".txt") == 0) {
+            strcpy(names[count++], entry->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(names, count, NAME_LENGTH, compareNames);
+    return count;
+}
+
+// Function to read the length of the machine's input tape - its first line, plus the start cell
+static long inputLength(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Cannot open machine %s. \n", path);
+        exit(1);
+    }
+    long length = 1;
+    int c;
+    while ((c = fgetc(file)) != EOF && c != '\n' && c != '\r') {
+        length++;
+    }
+    fclose(file);
+    return length;
+}
+
+// Function to hash the final tape a run wrote, and remove the file
+static uint64_t hashTape(const char* fileName) {
+    FILE* file = fopen(fileName, "rb");
+    if (file == NULL) {
+        printf("Cannot read the final tape %s. \n", fileName);
+        exit(1);
+    }
+    uint64_t hash = 14695981039346656037ULL;
+    char buffer[65536];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            hash = (hash ^ (unsigned char)buffer[i]) * 1099511628211ULL;
+        }
+    }
+    fclose(file);
+    unlink(fileName);
+    return hash;
+}
+
+// Run the binary once on a machine and fill in the result from its --stats lines, 0 when it did not report
+static int runOnce(const struct BenchOptions* options, const char* path, const char* engine, struct BenchResult* result) {
+    int out[2];
+    if (pipe(out) != 0) {
+        printf("Cannot create a pipe. \n");
+        exit(1);
+    }
+    // the final tape goes to a file, written after the run is timed, and is hashed once the run is over
+    const char* directory = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    char tapeName[4096];
+    snprintf(tapeName, sizeof(tapeName), "%s/tm_bench_XXXXXX", directory);
+    int tape = mkstemp(tapeName);
+    if (tape < 0) {
+        printf("Cannot create a file in %s. \n", directory);
+        exit(1);
+    }
+    close(tape);
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("Cannot start %s. \n", options->binary);
+        exit(1);
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(out[0]);
+        close(out[1]);
+        close(null);
+        int e = 0;
+        while (e < NUM_ENGINES - 1 && strcmp(engineNames[e], engine) != 0) {
+            e++;
+        }
+        execl(options->binary, options->binary, "--stats", engineOptions[e][0], engineOptions[e][1], "--output",
+              tapeName, path, (char*)NULL);
+        _exit(127);
+    }
+    close(out[1]);
+
+    FILE* output = fdopen(out[0], "r");
+    char line[1024];
+    int found = 0;
+    while (fgets(line, sizeof(line), output) != NULL) {
+        char reason[NAME_LENGTH];
+        int state;
+        long head, leftmost, rightmost, cells;
+        // "Stopped: <reason> in state ..." - the reason itself may contain spaces
+        char* in = strstr(line, " in state ");
+        if (strncmp(line, "Stopped: ", 9) == 0 && in != NULL && in - line - 9 < NAME_LENGTH) {
+            memcpy(reason, line + 9, in - line - 9);
+            reason[in - line - 9] = '\0';
+            if (sscanf(in, " in state %d after %lld steps, head at %ld, visited cells %ld to %ld (%ld cells)",
+                       &state, &result->steps, &head, &leftmost, &rightmost, &cells) == 6) {
+                strcpy(result->reason, reason);
+                result->cells = cells;
+                found |= 1;
+            }
+        } else if (sscanf(line, "Time: load %lf s, run %lf s", &result->loadSeconds, &result->runSeconds) == 2) {
+            found |= 2;
+        }
+    }
+    fclose(output);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        unlink(tapeName);
+        return 0;
+    }
+    result->tapeHash = hashTape(tapeName);
+    result->peakRss = usage.ru_maxrss;
+    result->cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    return found == 3;
+}
+
+// Run one machine on one engine several times and keep the fastest run
+static void benchMachine(const struct BenchOptions* options, const char* name, const char* engine,
+                         struct BenchResult* best) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", options->corpus, name);
+    for (int i = 0; i < options->repeat; i++) {
+        struct BenchResult result;
+        if (!runOnce(options, path, engine, &result)) {
+            printf("Benchmark %s on %s failed to run. \n", name, engine);
+            exit(1);
+        }
+        if (i > 0 && result.tapeHash != best->tapeHash) {
+            printf("Benchmark %s on %s left a different tape on a repeated run. \n", name, engine);
+            exit(1);
+        }
+        if (i == 0 || result.runSeconds < best->runSeconds) {
+            double cpuSeconds = i == 0 || result.cpuSeconds < best->cpuSeconds ? result.cpuSeconds : best->cpuSeconds;
+            *best = result;
+            best->cpuSeconds = cpuSeconds;
+        } else if (result.cpuSeconds < best->cpuSeconds) {
+            best->cpuSeconds = result.cpuSeconds;
+        }
+    }
+    snprintf(best->machine, NAME_LENGTH, "%.*s", (int)strlen(name) - 4, name);
+    strcpy(best->engine, engine);
+    best->inputCells = inputLength(path);
+    best->stepsPerSecond = best->runSeconds > 0 ? best->steps / best->runSeconds : 0.0;
+}
+
+// Function to write the results as JSON, one result object per line
+static void writeResults(FILE* file, const struct BenchOptions* options, const struct BenchResult* results,
+                         int numResults) {
+    fprintf(file, "{\n  \"binary\": \"%s\",\n  \"repeat\": %d,\n  \"results\": [\n", options->binary, options->repeat);
+    for (int i = 0; i < numResults; i++) {
+        const struct BenchResult* r = &results[i];
+        fprintf(file, "    {\"machine\": \"%s\", \"engine\": \"%s\", \"reason\": \"%s\", \"steps\": %lld, "
+                      "\"input_cells\": %ld, \"cells\": %ld, \"tape_growth\": %ld, \"load_seconds\": %.6f, "
+                      "\"run_seconds\": %.6f, \"cpu_seconds\": %.6f, \"steps_per_second\": %.0f, \"peak_rss_kb\": %ld, "
+                      "\"tape_hash\": \"%016llx\"}%s\n",
+                r->machine, r->engine, r->reason, r->steps, r->inputCells, r->cells, r->cells - r->inputCells,
+                r->loadSeconds, r->runSeconds, r->cpuSeconds, r->stepsPerSecond, r->peakRss,
+                (unsigned long long)r->tapeHash, i + 1 < numResults ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+// Function to find a field of a result line - returns a pointer just past "key": or NULL
+static const char* jsonField(const char* line, const char* key) {
+    char pattern[NAME_LENGTH + 4];
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    const char* field = strstr(line, pattern);
+    return field != NULL ? field + strlen(pattern) : NULL;
+}
+
+// Function to copy a string field of a result line
+static int jsonString(const char* line, const char* key, char* value) {
+    const char* field = jsonField(line, key);
+    if (field == NULL || *field != '"') {
+        return 0;
+    }
+    int length = 0;
+    for (field++; *field != '"' && *field != '\0' && length < NAME_LENGTH - 1; field++) {
+        value[length++] = *field;
+    }
+    value[length] = '\0';
+    return 1;
+}
+
+// Function to load the results of an earlier run - only reads the files this harness writes
+static int loadResults(const char* fileName, struct BenchResult* results) {
+    FILE* file = fopen(fileName, "r");
+    if (file == NULL) {
+        printf("Cannot open baseline %s. \n", fileName);
+        exit(1);
+    }
+    char line[2048];
+    int count = 0;
+    while (fgets(line, sizeof(line), file) != NULL && count < MAX_RESULTS) {
+        struct BenchResult* r = &results[count];
+        const char *steps = jsonField(line, "steps"), *run = jsonField(line, "run_seconds"),
+                   *cpu = jsonField(line, "cpu_seconds"),
+                   *load = jsonField(line, "load_seconds"), *speed = jsonField(line, "steps_per_second"),
+                   *rss = jsonField(line, "peak_rss_kb"), *cells = jsonField(line, "cells");
+        if (!jsonString(line, "machine", r->machine) || !jsonString(line, "engine", r->engine) ||
+            !jsonString(line, "reason", r->reason) || steps == NULL || run == NULL || cpu == NULL || load == NULL ||
+            speed == NULL || rss == NULL || cells == NULL) {
+            continue;
+        }
+        r->steps = atoll(steps);
+        r->runSeconds = atof(run);
+        r->cpuSeconds = atof(cpu);
+        r->loadSeconds = atof(load);
+        r->stepsPerSecond = atof(speed);
+        r->peakRss = atol(rss);
+        r->cells = atol(cells);
+        // baselines written before the tape hash was recorded are only checked on steps, cells and reason
+        char tapeHash[NAME_LENGTH];
+        r->tapeHash = jsonString(line, "tape_hash", tapeHash) ? strtoull(tapeHash, NULL, 16) : 0;
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+// Function to compare the results with a baseline - returns the number of regressions
+static int compareResults(const struct BenchOptions* options, const struct BenchResult* results, int numResults) {
+    static struct BenchResult baseline[MAX_RESULTS];
+    int numBaseline = loadResults(options->compareName, baseline);
+    int regressions = 0;
+    printf("%-24s %-12s %12s %12s %8s %8s %8s %8s\n", "machine", "engine", "base steps/s", "steps/s", "speed", "cpu",
+           "load", "rss");
+    for (int i = 0; i < numResults; i++) {
+        const struct BenchResult* r = &results[i];
+        const struct BenchResult* base = NULL;
+        for (int j = 0; j < numBaseline && base == NULL; j++) {
+            if (strcmp(baseline[j].machine, r->machine) == 0 && strcmp(baseline[j].engine, r->engine) == 0) {
+                base = &baseline[j];
+            }
+        }
+        if (base == NULL) {
+            printf("%-24s %-12s %12s %12.0f  (new)\n", r->machine, r->engine, "-", r->stepsPerSecond);
+            continue;
+        }
+        // a run that stops differently, or leaves a different tape, is a broken build, not a slow one
+        if (base->steps != r->steps || base->cells != r->cells || strcmp(base->reason, r->reason) != 0) {
+            printf("%-24s %-12s different result: %s after %lld steps, was %s after %lld steps\n", r->machine,
+                   r->engine, r->reason, r->steps, base->reason, base->steps);
+            regressions++;
+            continue;
+        }
+        if (base->tapeHash != 0 && base->tapeHash != r->tapeHash) {
+            printf("%-24s %-12s different final tape: hash %016llx, was %016llx\n", r->machine, r->engine,
+                   (unsigned long long)r->tapeHash, (unsigned long long)base->tapeHash);
+            regressions++;
+            continue;
+        }
+        double speed = base->runSeconds > 0 && r->runSeconds > 0 ? base->runSeconds / r->runSeconds : 1.0;
+        double cpu = base->cpuSeconds > 0 && r->cpuSeconds > 0 ? base->cpuSeconds / r->cpuSeconds : 1.0;
+        double load = base->loadSeconds > 0 && r->loadSeconds > 0 ? base->loadSeconds / r->loadSeconds : 1.0;
+        double rss = base->peakRss > 0 ? (double)r->peakRss / base->peakRss : 1.0;
+        // judged on processor time, which other processes on the machine disturb far less than the clock
+        int slower = base->cpuSeconds >= MIN_JUDGED_SECONDS &&
+                     r->cpuSeconds > base->cpuSeconds * (1 + options->threshold / 100);
+        printf("%-24s %-12s %12.0f %12.0f %7.2fx %7.2fx %7.2fx %7.2fx%s\n", r->machine, r->engine,
+               base->stepsPerSecond, r->stepsPerSecond, speed, cpu, load, rss, slower ? "  REGRESSION" : "");
+        regressions += slower;
+    }
+    printf("%d regressions beyond %.1f%%\n", regressions, options->threshold);
+    return regressions;
+}
+
+// Function to parse the command line - returns 0 on an invalid option
+static int parseBenchOptions(int argc, char** argv, struct BenchOptions* options) {
+    options->binary = TM_BENCH_BINARY;
+    options->corpus = TM_BENCH_CORPUS;
+    options->outputName = NULL;
+    options->compareName = NULL;
+    options->engine = NULL;
+    options->repeat = DEFAULT_REPEAT;
+    options->threshold = DEFAULT_THRESHOLD;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return 0;
+        }
+        if (strcmp(argv[i], "--binary") == 0) {
+            options->binary = argv[++i];
+        } else if (strcmp(argv[i], "--corpus") == 0) {
+            options->corpus = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            options->outputName = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0) {
+            options->compareName = argv[++i];
+        } else if (strcmp(argv[i], "--engine") == 0) {
+            options->engine = argv[++i];
+        } else if (strcmp(argv[i], "--repeat") == 0) {
+            options->repeat = atoi(argv[++i]);
+            if (options->repeat < 1) {
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--threshold") == 0) {
+            options->threshold = atof(argv[++i]);
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    struct BenchOptions options;
+    if (!parseBenchOptions(argc, argv, &options)) {
+        printf("Usage: %s [--binary <Project1>] [--corpus <dir>] [--engine <name>] [--repeat <n>]\n"
+               "       [--output <results.json>] [--compare <baseline.json> [--threshold <percent>]]\n", argv[0]);
+        return 1;
+    }
+
+    static char names[MAX_MACHINES][NAME_LENGTH];
+    static struct BenchResult results[MAX_RESULTS];
+    int numMachines = listCorpus(options.corpus, names);
+    int numResults = 0, numDifferent = 0;
+    for (int m = 0; m < numMachines; m++) {
+        const struct BenchResult* first = NULL;
+        for (int e = 0; e < NUM_ENGINES && numResults < MAX_RESULTS; e++) {
+            if (options.engine != NULL && strcmp(options.engine, engineNames[e]) != 0) {
+                continue;
+            }
+            struct BenchResult* r = &results[numResults++];
+            benchMachine(&options, names[m], engineNames[e], r);
+            // progress goes to stderr so the JSON can be piped
+            fprintf(stderr, "%-24s %-12s %12lld steps %10.6f s %14.0f steps/s %8ld KB\n", r->machine, r->engine,
+                    r->steps, r->runSeconds, r->stepsPerSecond, r->peakRss);
+            // every engine runs the same machine, so anything but the timings differing is a bug in one of them
+            if (first == NULL) {
+                first = r;
+            } else if (r->steps != first->steps || r->cells != first->cells || r->tapeHash != first->tapeHash ||
+                       strcmp(r->reason, first->reason) != 0) {
+                fprintf(stderr, "%-24s %-12s different result from %s: %s after %lld steps, tape hash %016llx, "
+                        "was %s after %lld steps, tape hash %016llx\n", r->machine, r->engine, first->engine,
+                        r->reason, r->steps, (unsigned long long)r->tapeHash, first->reason, first->steps,
+                        (unsigned long long)first->tapeHash);
+                numDifferent++;
+            }
+        }
+    }
+
+    FILE* output = stdout;
+    if (options.outputName != NULL) {
+        output = fopen(options.outputName, "w");
+        if (output == NULL) {
+            printf("Cannot write %s. \n", options.outputName);
+            return 1;
+        }
+    }
+    if (options.outputName != NULL || options.compareName == NULL) {
+        writeResults(output, &options, results, numResults);
+    }
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    int regressions = options.compareName != NULL ? compareResults(&options, results, numResults) : 0;
+    return regressions > 0 || numDifferent > 0;
+}
@@ -2,23 +2,228 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-// This is the item struct, it represents the name and price of a single item inside a 2D shelving unit (array)
-struct item {
-    char name[20];
-    float price;
+// This is the maximum length of an item's name, not counting the null terminator
+#define NAME_LENGTH 19
+
+// This is the shelving unit, a 2D grid of slots (shelves = rows, slots = columns) stored column by column
+// Instead of one struct per slot, every slot property lives in its own array, indexed by
+// (shelf - 1) * numOfSlots + (slot - 1), so a scan over one property only touches the bytes of that property
+// The three columns share ONE allocation, so even a warehouse with millions of slots is set up by a single calloc
+struct shelfStore {
+    int numOfShelves;
+    int numOfSlots;
+    uint64_t *occupied;         // occupancy bitmap, one bit per slot - a set bit means the slot holds an item
+    float *prices;              // price of each slot, 0 for an empty slot so shelf totals need no occupancy check
+    uint32_t *nameOffsets;      // offset of each occupied slot's name inside the names pool
+    char *names;                // names pool - every distinct name is stored once, null terminated
+    size_t namesSize;
+    size_t namesCapacity;
+    uint32_t *internTable;      // hash table of the names in the pool, holding offset + 1, 0 for an empty entry
+    size_t internCapacity;      // a power of two, kept at least twice the number of distinct names
+    size_t numOfNames;
 };
 
+// This is a function to find the index of a slot in the columns
+// Parameters are the store and two integers 'shelf' & 'slot', both counted from 1
+size_t slotIndex(const struct shelfStore *store, int shelf, int slot) {
+    return (size_t)(shelf - 1) * (size_t)store->numOfSlots + (size_t)(slot - 1);
+}
+
+// This is a function to set up an empty shelving unit - returns false when there is not enough memory
+bool createShelfStore(struct shelfStore *store, int numOfShelves, int numOfSlots) {
+    size_t numOfSlotsTotal = (size_t)numOfShelves * (size_t)numOfSlots;
+    // The bitmap is rounded up to whole 64-bit words, and goes first so every column stays aligned
+    size_t bitmapBytes = (numOfSlotsTotal + 63) / 64 * sizeof(uint64_t);
+    size_t priceBytes = numOfSlotsTotal * sizeof(float);
+    size_t offsetBytes = numOfSlotsTotal * sizeof(uint32_t);
+
+    memset(store, 0, sizeof(struct shelfStore));
+    store->numOfShelves = numOfShelves;
+    store->numOfSlots = numOfSlots;
+
+    // One zeroed allocation for all three columns - every slot starts empty with a price of 0
+    char *columns = (char *)calloc(1, bitmapBytes + priceBytes + offsetBytes);
+    store->internCapacity = 64;
+    store->internTable = (uint32_t *)calloc(store->internCapacity, sizeof(uint32_t));
+    if (columns == NULL || store->internTable == NULL) {
+        free(columns);
+        free(store->internTable);
+        return false;
+    }
+    store->occupied = (uint64_t *)columns;
+    store->prices = (float *)(columns + bitmapBytes);
+    store->nameOffsets = (uint32_t *)(columns + bitmapBytes + priceBytes);
+    return true;
+}
+
+// This is a function to free the memory of a shelving unit
+void freeShelfStore(struct shelfStore *store) {
+    // The occupancy bitmap is the start of the single allocation that holds all the columns
+    free(store->occupied);
+    free(store->names);
+    free(store->internTable);
+}
+
+// This is a hash function for names (FNV-1a)
+uint32_t hashName(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name != '\0') {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+// This is a function to double the intern table once it is half full - every name is put in again
+bool growInternTable(struct shelfStore *store) {
+    size_t newCapacity = store->internCapacity * 2;
+    uint32_t *table = (uint32_t *)calloc(newCapacity, sizeof(uint32_t));
+    if (table == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < store->internCapacity; i++) {
+        if (store->internTable[i] != 0) {
+            size_t entry = hashName(store->names + store->internTable[i] - 1) & (newCapacity - 1);
+            while (table[entry] != 0) {
+                entry = (entry + 1) & (newCapacity - 1);
+            }
+            table[entry] = store->internTable[i];
+        }
+    }
+    free(store->internTable);
+    store->internTable = table;
+    store->internCapacity = newCapacity;
+    return true;
+}
+
+// This is a function to intern a name - a name already in the pool is shared instead of stored again
+// Returns true and the name's offset in 'offset', or false when there is not enough memory
+bool internName(struct shelfStore *store, const char *name, uint32_t *offset) {
+    // Look the name up, probing the entries after its hash until an empty one
+    size_t entry = hashName(name) & (store->internCapacity - 1);
+    while (store->internTable[entry] != 0) {
+        if (strcmp(store->names + store->internTable[entry] - 1, name) == 0) {
+            *offset = store->internTable[entry] - 1;
+            return true;
+        }
+        entry = (entry + 1) & (store->internCapacity - 1);
+    }
+
+    // New name - keep the table at most half full, so lookups stay short and always reach an empty entry
+    // Growing moves every entry, so the empty entry is looked for again in the new table
+    if ((store->numOfNames + 1) * 2 > store->internCapacity) {
+        if (!growInternTable(store)) {
+            return false;
+        }
+        entry = hashName(name) & (store->internCapacity - 1);
+        while (store->internTable[entry] != 0) {
+            entry = (entry + 1) & (store->internCapacity - 1);
+        }
+    }
+
+    // Append it to the pool, doubling the pool when it is full
+    size_t length = strlen(name) + 1;
+    if (store->namesSize + length > store->namesCapacity) {
+        size_t newCapacity = store->namesCapacity > 0 ? store->namesCapacity * 2 : 256;
+        while (newCapacity < store->namesSize + length) {
+            newCapacity *= 2;
+        }
+        // Offsets are 32 bits, which is plenty for the distinct names of one warehouse
+        if (newCapacity > UINT32_MAX) {
+            return false;
+        }
+        char *names = (char *)realloc(store->names, newCapacity);
+        if (names == NULL) {
+            return false;
+        }
+        store->names = names;
+        store->namesCapacity = newCapacity;
+    }
+    memcpy(store->names + store->namesSize, name, length);
+    *offset = (uint32_t)store->namesSize;
+    store->namesSize += length;
+    store->internTable[entry] = *offset + 1;
+    store->numOfNames++;
+    return true;
+}
+
 // This is a boolean function to check if a slot is occupied
-// Parameters are a struct 'shelfArray', and two integers 'shelf' & 'slot' (row & columns)
-bool isSlotOccupied(struct item **shelfArray, int shelf, int slot) {
-    // Returns TRUE when a slot is filled - first character of the item's name is not the null terminator - where the string ends
-    // Returns FALSE when a slot is empty - first character of the item's name is the null terminator
-    return shelfArray[shelf - 1][slot - 1].name[0] != '\0';
+// Parameters are the shelving unit 'store', and two integers 'shelf' & 'slot' (row & columns)
+bool isSlotOccupied(const struct shelfStore *store, int shelf, int slot) {
+    // Returns TRUE when the slot's bit in the occupancy bitmap is set
+    // Returns FALSE when it is clear - the slot is empty
+    size_t index = slotIndex(store, shelf, slot);
+    return (store->occupied[index / 64] >> (index % 64)) & 1;
+}
+
+// This is a function to put an item into an empty slot - returns false when there is not enough memory
+bool placeItem(struct shelfStore *store, int shelf, int slot, const char *name, float price) {
+    size_t index = slotIndex(store, shelf, slot);
+    uint32_t offset;
+    if (!internName(store, name, &offset)) {
+        return false;
+    }
+    store->nameOffsets[index] = offset;
+    store->prices[index] = price;
+    store->occupied[index / 64] |= (uint64_t)1 << (index % 64);
+    return true;
+}
+
+// This is a function to add up the prices of every item on a shelf
+// Empty slots have a price of 0, so this is a plain sum over one row of the prices column
+// Eight running sums, one per lane, let the compiler add eight prices at a time
+double shelfValue(const struct shelfStore *store, int shelf) {
+    const float *prices = store->prices + slotIndex(store, shelf, 1);
+    double sums[8] = { 0 };
+    int slot = 0;
+    for (; slot + 8 <= store->numOfSlots; slot += 8) {
+        for (int lane = 0; lane < 8; lane++) {
+            sums[lane] += prices[slot + lane];
+        }
+    }
+    double total = 0;
+    for (; slot < store->numOfSlots; slot++) {
+        total += prices[slot];
+    }
+    for (int lane = 0; lane < 8; lane++) {
+        total += sums[lane];
+    }
+    return total;
+}
+
+// This is a function to count the empty slots of the whole shelving unit
+// It only reads the occupancy bitmap, 64 slots per word
+size_t countEmptySlots(const struct shelfStore *store) {
+    size_t numOfSlotsTotal = (size_t)store->numOfShelves * (size_t)store->numOfSlots;
+    size_t occupied = 0;
+    for (size_t word = 0; word < (numOfSlotsTotal + 63) / 64; word++) {
+        occupied += (size_t)__builtin_popcountll(store->occupied[word]);
+    }
+    return numOfSlotsTotal - occupied;
+}
+
+// This is a function to print the first 'limit' empty slots, skipping full words of the bitmap at once
+void printEmptySlots(const struct shelfStore *store, size_t limit) {
+    size_t numOfSlotsTotal = (size_t)store->numOfShelves * (size_t)store->numOfSlots;
+    size_t printed = 0;
+    for (size_t word = 0; word < (numOfSlotsTotal + 63) / 64 && printed < limit; word++) {
+        // The set bits of 'empty' are the empty slots of this word
+        uint64_t empty = ~store->occupied[word];
+        while (empty != 0 && printed < limit) {
+            size_t index = word * 64 + (size_t)__builtin_ctzll(empty);
+            if (index >= numOfSlotsTotal) {
+                break;  // The bits past the last slot are not slots
+            }
+            printf("Shelf %zu, slot %zu is empty\n", index / store->numOfSlots + 1, index % store->numOfSlots + 1);
+            printed++;
+            empty &= empty - 1;
+        }
+    }
 }
 
 // Function to get item details
-void itemDetails(struct item **shelfArray, int numOfShelves, int numOfSlots) {
+void itemDetails(struct shelfStore *store) {
     // This initializes an array of characters itemDetails to 100, it the holds description of entire item information
     char itemDetails[100];
 
@@ -44,7 +249,7 @@ void itemDetails(struct item **shelfArray, int numOfShelves, int numOfSlots) {
             break;
         }
 
-        char name[20];
+        char name[NAME_LENGTH + 1];
         float price;
         int shelf, slot;
 
@@ -54,13 +259,15 @@ void itemDetails(struct item **shelfArray, int numOfShelves, int numOfSlots) {
         // Read all four values
         if (sscanf(itemDetails, "%19[^,], %f, %d, %d", name, &price, &shelf, &slot) == 4) {
             // Check if the shelf and slot are valid
-            if (shelf >= 1 && shelf <= numOfShelves && slot >= 1 && slot <= numOfSlots) {
+            if (shelf >= 1 && shelf <= store->numOfShelves && slot >= 1 && slot <= store->numOfSlots) {
                 // Add an item to a slot if its empty, so negate the return value of the function
-                if (!isSlotOccupied(shelfArray, shelf, slot)) {
+                if (!isSlotOccupied(store, shelf, slot)) {
                     // Add the item to the specified shelf and slot
-                    strcpy(shelfArray[shelf - 1][slot - 1].name, name);
-                    shelfArray[shelf - 1][slot - 1].price = price;
-                    printf("Item added to shelf %d, slot %d\n", shelf, slot);
+                    if (placeItem(store, shelf, slot, name, price)) {
+                        printf("Item added to shelf %d, slot %d\n", shelf, slot);
+                    } else {
+                        printf("Not enough memory to add the item.\n");
+                    }
                 } else {
                     // Slot is occupied
                     printf("Shelf %d, slot %d is already occupied.\n", shelf, slot);
@@ -79,23 +286,24 @@ void itemDetails(struct item **shelfArray, int numOfShelves, int numOfSlots) {
 }
 
 // Function to look an item up
-void lookItemUp(struct item **shelfArray, int numOfShelves, int numOfSlots) {
+void lookItemUp(struct shelfStore *store) {
 
     do {
         int shelf, slot;
 
         // Allow user to enter shelf and slot coordinate pairs
-        printf("Enter shelf and slot coordinates to look up an item (i.e., 2,1): ");
+        printf("Enter shelf and slot coordinates to look up an item (i.e., 2,1), 'v' and a shelf for the total value"
+               " of a shelf (i.e., v 3) or 'e' to list empty slots: ");
 
         // Checki if the input contains two integer values, seperated by a comma
         if(scanf("%d,%d", &shelf, &slot) == 2) {
             // Check if the values are within valid ranges
-            if (shelf>= 1 && shelf <= numOfShelves && slot >= 1 && slot <= numOfSlots) {
+            if (shelf>= 1 && shelf <= store->numOfShelves && slot >= 1 && slot <= store->numOfSlots) {
                 // Check if the slot is occupied
-                if (isSlotOccupied(shelfArray, shelf, slot)) {
-                    // Retrieve the item information and display it to the user
-                    struct item item = shelfArray[shelf - 1][slot - 1];
-                    printf("Name: %s, Price: %.2f\n", item.name, item.price);
+                if (isSlotOccupied(store, shelf, slot)) {
+                    // Retrieve the item information from its columns and display it to the user
+                    size_t index = slotIndex(store, shelf, slot);
+                    printf("Name: %s, Price: %.2f\n", store->names + store->nameOffsets[index], store->prices[index]);
                 } else {
                     // Slot is empty
                     printf("Empty slot! Try again. \n");
@@ -104,10 +312,21 @@ void lookItemUp(struct item **shelfArray, int numOfShelves, int numOfSlots) {
                 // Invalid values
                 printf("Invalid shelf or slot. Please enter valid values.\n");
             }
-        } else if (getchar() == 'q') {
-            break; // Exit loop when q is entered
         } else {
-            printf("Invalid input. Please enter value that follow the 'shelf,slot' format.\n");
+            int command = getchar();
+            if (command == 'q') {
+                break; // Exit loop when q is entered
+            } else if (command == 'v' && scanf("%d", &shelf) == 1 && shelf >= 1 && shelf <= store->numOfShelves) {
+                // Total value of a shelf
+                printf("Total value of shelf %d: %.2f\n", shelf, shelfValue(store, shelf));
+            } else if (command == 'e') {
+                // Empty slots, the first 20 of them listed
+                size_t numOfEmptySlots = countEmptySlots(store);
+                printf("%zu empty slots\n", numOfEmptySlots);
+                printEmptySlots(store, 20);
+            } else {
+                printf("Invalid input. Please enter value that follow the 'shelf,slot' format.\n");
+            }
         }
         // Clear the input buffer
         while (getchar() != '\n');
@@ -127,32 +346,26 @@ int main() {
     printf("Enter number of slots available on each shelf: ");
     scanf("%d", &numOfSlots);
 
-
-    // This dynamically allocates memory for a two-dimensional array of struct item pointers from user-entered values
-    // and declares a pointer to a pointer to a struct item
-    // Each pointer in 'shelfArray' represents a shelf that will point to an array of
-    // struct item elements
-    struct item **shelfArray = (struct item **)malloc(numOfShelves * sizeof(struct item *));
-
-    // Loop through each shelf in the shelfArray and initiate each shelf
-    // Create one shelf per iteration
-    for (int i = 0; i < numOfShelves; i++) {
-        // This allocates memory for a single shelf, which is an array of item elements
-        shelfArray[i] = (struct item *) malloc(numOfSlots * sizeof(struct item));
+    // Both dimensions have to be positive
+    if (numOfShelves < 1 || numOfSlots < 1) {
+        printf("Invalid number of shelves or slots.\n");
+        return 1;
     }
 
-    // Set up item details based on shelfArray, numOfShelves, and numOfSlots
-    itemDetails(shelfArray, numOfShelves, numOfSlots);
-    // Look an item up based on shelfArray, numOfShelves, and numOfSlots
-    lookItemUp(shelfArray, numOfShelves, numOfSlots);
-
-    // Free dynamically allocated memory for each shelf
-    for (int i = 0; i < numOfShelves; i++) {
-        free(shelfArray[i]);
+    // This sets up the whole shelving unit - the columns of every slot on every shelf - in a single allocation
+    struct shelfStore store;
+    if (!createShelfStore(&store, numOfShelves, numOfSlots)) {
+        printf("Not enough memory for %d shelves of %d slots.\n", numOfShelves, numOfSlots);
+        return 1;
     }
 
-    // Free dynamically allocated memory for the shelfArray itself
-    free(shelfArray);
+    // Set up item details based on the shelving unit
+    itemDetails(&store);
+    // Look an item up based on the shelving unit
+    lookItemUp(&store);
+
+    // Free dynamically allocated memory for the shelving unit
+    freeShelfStore(&store);
 
     return 0;
 }
@@ -1,230 +1,6768 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "tm.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// The scans over the tape take 32 cells at a time with AVX2 on processors that have it, picked at run time
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+// The native code engine generates x86-64 code into mmap'd memory
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define HAVE_JIT 1
+#endif
+
+// The evaluation server waits for its clients with epoll
+#ifdef __linux__
+#define HAVE_SERVE 1
+#endif
 
 // Define global variables
-#define MAX_STATES 50
-#define MAX_TAPE_LENGTH 100
-#define ASCII_RANGE 128
+#define MAX_STATES 65536    // next states are stored in 16 bits
+#define SYMBOL_RANGE 256
+
+// Move codes stored in a packed instruction
+#define MOVE_NONE 0     // no rule for this state and symbol - halt without writing
+#define MOVE_LEFT (-1)
+#define MOVE_RIGHT 1
+#define MOVE_HALT 2     // rule with a direction other than L or R - write, then halt
+#define MOVE_SWEEP_LEFT 3   // self loop that writes back the symbol it reads - skip the whole run at once
+#define MOVE_SWEEP_RIGHT 4
+
+// Reasons a run stops
+#define RUN_HALTED 0            // reached the end state
+#define RUN_UNDEFINED 1         // no rule for the current state and symbol
+#define RUN_NO_MOVE 2           // rule with a direction other than L or R
+#define RUN_STEP_LIMIT 3        // step budget used up
+#define RUN_TIME_LIMIT 4        // time budget used up
+#define RUN_NON_HALTING 5       // loop detection found a cycle the machine can never leave
+#define RUN_OUT_OF_MEMORY 6     // the tape, or the engine's own data, could not grow
+
+// Execution engines
+#define ENGINE_INTERPRETER 0    // reference interpreter over the flat transition table
+#define ENGINE_THREADED 1       // threaded code with the move and next state baked into each handler
+#define ENGINE_JIT 2            // native x86-64 code, one block per state
+
+// With a time budget the clock is only read once per this many steps
+#define TIME_CHECK_INTERVAL (1 << 22)
+
+// Output options for the final tape
+#define OUTPUT_TRIM 1           // leave out the blank cells at both ends
+#define OUTPUT_RAW 2            // write the cells only, without the newline
+
+// Cells are kept in one contiguous buffer that grows in both directions
+#define TAPE_CHUNK 4096
+#define BLANK 'B'
 
-// Define the tape cell structure - this tape represents our linked data structure of cells
-struct Cell {
-    char value;
-    struct Cell* next;
-    struct Cell* prev;
+// Define the tape structure - the tape is a contiguous buffer of cells indexed by the head position
+// Cells outside the visited region are kept blank so the head only has to grow the buffer at its edges
+struct Tape {
+    char* cells;    // buffer holding every cell of the tape
+    long capacity;  // number of cells in the buffer
+    long origin;    // index of the first cell of the tape (the 'A' cell)
+    long left;      // index of the leftmost cell visited by the head
+    long right;     // index of the rightmost cell visited by the head
+    int failed;     // set when the buffer could not grow, the run then stops with RUN_OUT_OF_MEMORY
 };
 
-// Instruction structure
+// Instruction structure - packed into 4 bytes so a whole table row fits in a few cache lines
 struct Instruction {
-    char write;
+    char write;                 // symbol to write
+    signed char move;           // one of the MOVE_ codes
+    unsigned short nextState;   // state to switch to
+};
+
+// Transition table - one contiguous array of instructions indexed by state * alphabetSize + symbol index
+// Only symbols read by some rule get their own column, every other symbol maps to the shared column 0 (no rule)
+struct TransitionTable {
+    int numStates;      // number of rows
+    int alphabetSize;   // number of columns
+    unsigned char symbolIndex[SYMBOL_RANGE];   // dense column index of each tape symbol
+    char symbols[SYMBOL_RANGE];                // tape symbol of each column
+    struct Instruction* instructions;
+};
+
+// Rule as parsed from the input file, before it is packed into the transition table
+// line and column locate the rule for error messages
+struct Rule {
+    int fromState;
+    char readVal;
+    char writeVal;
     char moveDirection;
-    int nextState;
+    int toState;
+    int line;
+    int column;
+};
+
+// Machine file parser - works on the whole file in memory, one character at a time
+// The first error stops the parser and is kept, with its message, for the caller to report
+#define LOAD_MESSAGE_SIZE 512
+
+// Options of a machine load
+#define LOAD_ALL_RULES 1    // keep every rule of a machine file, for the nondeterministic explorer
+#define LOAD_VERIFY 2       // check the data checksum of an image too - costs a pass over the whole file
+
+struct Parser {
+    const char* fileName;
+    const char* data;       // file contents
+    size_t size;
+    size_t pos;             // position of the next character
+    int line;               // line of the next character, from 1
+    size_t lineStart;       // position of the first character of the line
+    int error;              // one of the TM_ERROR_ codes once parsing failed, TM_OK until then
+    int flags;              // LOAD_ options of the load
+    char* message;          // receives the message of the error, NULL to drop it
+    size_t messageSize;
+};
+
+// Builder for the flat transition table - symbols get their columns as rules are added, so the rows start
+// out with spare columns and are spread out whenever the alphabet outgrows them
+struct TableBuilder {
+    struct TransitionTable table;
+    int stride;             // columns allocated per row
+};
+
+// k-tape machines - every rule reads and writes a tuple of symbols, one per tape, and moves each head on its own
+// A file starting with the TAPES_DIRECTIVE line "#tapes k" holds one tape line per tape
+#define MAX_TAPES 4
+#define TAPES_DIRECTIVE "#tapes "
+#define MAX_MULTI_ENTRIES (1 << 24)     // limit on states times symbol combinations
+#define MOVE_STAY 0                     // per-tape move of a k-tape rule: the head stays
+
+// Instruction of a k-tape machine - action is MOVE_NONE for no rule, MOVE_RIGHT to apply the writes and moves,
+// or MOVE_HALT when a rule has a direction other than L, R or S: write, then halt
+struct MultiInstruction {
+    unsigned short nextState;
+    signed char action;
+    char write[MAX_TAPES];
+    signed char move[MAX_TAPES];    // MOVE_LEFT, MOVE_RIGHT or MOVE_STAY per tape
+};
+
+// Rule of a k-tape machine as parsed from the input file
+struct MultiRule {
+    int fromState;
+    char readVal[MAX_TAPES];
+    char writeVal[MAX_TAPES];
+    char moveDirection[MAX_TAPES];
+    int toState;
+    int line;
+    int column;
+};
+
+// Extra tapes and transition table of a k-tape machine - the table has one column per combination of
+// symbols under the heads, so the symbols are looked up in one go: the column is the sum of one
+// columnOffset entry per tape, each being the symbol's index within its tape multiplied by that tape's stride
+struct MultiTape {
+    int numTapes;
+    int numColumns;                                 // product of the alphabet sizes of all tapes
+    int columnOffset[MAX_TAPES][SYMBOL_RANGE];      // 0 for symbols no rule reads on that tape
+    struct MultiInstruction* instructions;          // numStates * numColumns, row by row
+    struct Tape tapes[MAX_TAPES - 1];               // tapes 2 to numTapes, tape 1 is the machine's own tape
+};
+
+// Transition table of a nondeterministic machine - every rule for a state and symbol is kept as one choice
+// The choices of entry e = state * alphabetSize + symbol index are choices[first[e]] to choices[first[e + 1] - 1]
+struct NdTable {
+    int numStates;
+    int alphabetSize;
+    unsigned char symbolIndex[SYMBOL_RANGE];   // column of each tape symbol, 0 for symbols no rule reads
+    int* first;
+    struct Instruction* choices;
+};
+
+// Result of a run - positions are cell offsets from the 'A' cell
+struct RunResult {
+    int reason;             // one of the RUN_ codes
+    int finalState;         // state the machine stopped in
+    long long steps;        // steps executed
+    long head;              // final head position
+    long leftmost;          // leftmost cell visited
+    long rightmost;         // rightmost cell visited
+    long cellsTouched;      // number of cells visited
+};
+
+// Threaded code operations - what a handler does once the symbol under the head has been read
+#define OP_END 0            // the machine is in the end state
+#define OP_UNDEFINED 1
+#define OP_NO_MOVE 2
+#define OP_LEFT 3
+#define OP_RIGHT 4
+#define OP_SWEEP_LEFT 5
+#define OP_SWEEP_RIGHT 6
+#define NUM_OPS 7
+
+// One compiled (state, symbol) entry - the address of its handler plus the row of the state it switches to,
+// so running a step is one indexed load and one indirect jump with no state number arithmetic
+struct ThreadedOp {
+    const void* handler;                // label of the handler in threadedEngine
+    const struct ThreadedOp* next;      // row of the next state
+    char write;                         // symbol to write
+    unsigned char code;                 // one of the OP_ codes
 };
 
+// Transition table compiled to threaded code - numStates rows of alphabetSize operations plus a last row,
+// every operation of which is OP_END, that stands for the end state
+struct ThreadedProgram {
+    struct ThreadedOp* rows;
+    int numStates;
+    int alphabetSize;
+};
+
+// Precompiled machine image - the header is followed by the flat transition table and the initial tape,
+// so a machine can be run straight from a read-only mapping of the file
+// Images are written in the byte order of the machine that compiles them
+#define IMAGE_MAGIC "TMIMAGE"
+#define IMAGE_VERSION 1
+#define IMAGE_ALIGNMENT 64
+
+struct ImageHeader {
+    char magic[8];              // IMAGE_MAGIC
+    uint32_t version;           // IMAGE_VERSION
+    uint32_t byteOrder;         // 0x01020304 as written by the compiling machine
+    int32_t numStates;
+    int32_t startState;
+    int32_t endState;
+    int32_t alphabetSize;
+    uint64_t tableOffset;       // offset of the instructions, a multiple of IMAGE_ALIGNMENT
+    uint64_t tapeOffset;        // offset of the initial tape content, without the 'A' cell
+    uint64_t tapeLength;
+    uint64_t dataChecksum;      // hash of everything after the header
+    unsigned char symbolIndex[SYMBOL_RANGE];
+    char symbols[SYMBOL_RANGE];
+    uint64_t headerChecksum;    // hash of the header up to this field
+};
+
+struct JitProgram;
+struct Profile;
+struct MacroMachine;
+
 struct TuringMachine {
-    struct Cell* tape; // Pointer to the tape
+    struct Tape tape; // The tape
     int startState; // Start state
     int endState;   // End state
-    struct Instruction** transitions;   // 2D array to represent instructions
+    struct TransitionTable transitions;   // flat table of instructions
+    struct MultiTape* multi;            // extra tapes and tuple table of a k-tape machine, NULL for one tape
+    struct NdTable* nondet;             // all rules of a machine loaded as nondeterministic, NULL otherwise
+    struct SparseTape* sparse;          // tape of a run on a sparse tape, which replaces tape, NULL otherwise
+    struct MacroMachine* macro;         // memoized block steps of a macro machine run, NULL otherwise
+    int engine;                         // one of the ENGINE_ codes
+    struct ThreadedProgram* threaded;   // compiled transitions for ENGINE_THREADED, NULL until compiled
+    struct JitProgram* jit;             // native code for ENGINE_JIT, NULL until compiled
+    void* image;                        // mapping the transition table lives in when loaded from an image
+    size_t imageSize;
+    long startHead;             // cell the head starts on, relative to the 'A' cell - not 0 when resuming
+    long long startSteps;       // steps already run before the start, when resuming
+    long long maxSteps;         // step budget of a run, 0 for none, counting startSteps
+    double maxSeconds;          // time budget of a run, 0 for none
+    int detectLoops;            // run with loop detection, on the interpreter
+    struct Profile* profile;    // counters of a profiled run, on the interpreter, NULL for an uninstrumented run
+    int* originalStates;        // machine file number of each state of an optimized table, NULL if not optimized
+    const char* checkpointName;         // file to checkpoint the run to, NULL for none
+    long long checkpointInterval;       // steps between checkpoints, 0 for CHECKPOINT_INTERVAL
+    struct RunResult result;    // result of the last run
+    struct ResultCache* cache;  // cache the runs go through, NULL for none - not owned by the machine
+    uint64_t cacheMachine;      // hash of the machine in the cache keys, see attachCache
+};
+
+#ifndef TM_LIBRARY
+static const char* runReasons[] = {
+    "halted", "undefined transition", "no move", "step limit exceeded", "time limit exceeded", "non-halting",
+    "out of memory"
 };
+#endif
 
-// Function to create a new tape cell with the given value as a parameter
-struct Cell* createCell(char value) {
-    struct Cell* newCell = (struct Cell*)malloc(sizeof(struct Cell));
-    newCell->value = value;
-    newCell->prev = NULL;
-    newCell->next = NULL;
-    return newCell;
+// Function to load new content into a tape, reusing its buffer when it is big enough
+// The tape gets the 'A' cell followed by content, exactly like a tape read from a file
+// Returns -1, and leaves the tape without a buffer, when there is no memory for it
+static int fillTape(struct Tape* tape, const char* content, long length) {
+    long needed = length + 1 + 2 * TAPE_CHUNK;
+    long origin = TAPE_CHUNK;
+    if (tape->cells == NULL || tape->capacity < needed) {
+        free(tape->cells);
+        tape->capacity = needed;
+        tape->cells = (char*)malloc(tape->capacity);
+        if (tape->cells == NULL) {
+            tape->capacity = 0;
+            return -1;
+        }
+        // the content is copied in below, only the cells around it are blanked
+        memset(tape->cells, BLANK, TAPE_CHUNK);
+        memset(tape->cells + TAPE_CHUNK + 1 + length, BLANK, tape->capacity - (TAPE_CHUNK + 1 + length));
+    } else {
+        // only the cells visited by the previous run can be non blank
+        memset(tape->cells + tape->left, BLANK, tape->right - tape->left + 1);
+        // the 'A' cell stays where the previous run left it when the content fits, so a machine that runs off
+        // to the left does not grow the buffer again on every input
+        if (tape->origin > origin && tape->origin + 1 + length + TAPE_CHUNK <= tape->capacity) {
+            origin = tape->origin;
+        }
+    }
+    tape->origin = origin;
+    tape->cells[tape->origin] = 'A';
+    memcpy(tape->cells + tape->origin + 1, content, length);
+    tape->left = tape->origin;
+    tape->right = tape->origin + length;
+    tape->failed = 0;
+    return 0;
 }
 
-// Function to move the tape head one cell to the left
-struct Cell* moveLeft(struct Cell* tapeHead) {
-    if (tapeHead == NULL) {
-        return NULL;
-    } else if (tapeHead->prev == NULL) {
-        struct Cell* newCell = createCell('B'); // Extend the tape with a blank cell
-        tapeHead->prev = newCell;
-        newCell->next = tapeHead;
+#ifndef TM_LIBRARY
+// Function to load new content into a tape, quitting when there is no memory for it
+static void resetTape(struct Tape* tape, const char* content, long length) {
+    if (fillTape(tape, content, length) != 0) {
+        printf("Out of memory for tape. \n");
+        exit(1);
     }
-    return tapeHead->prev;
 }
+#endif
 
-// Function to move the tape head one cell to the right
-struct Cell* moveRight(struct Cell* tapeHead) {
-    if (tapeHead == NULL) {
-        return NULL;
-    } else if (tapeHead->next == NULL) {
-        struct Cell* newCell = createCell('B'); // Extend the tape with a blank cell
-        tapeHead->next = newCell;
-        newCell->prev = tapeHead;
+// Function to double the tape buffer - the new blank space goes on the left or the right of the old cells
+// Returns how far existing cells were shifted, so the caller can adjust its head index
+// Returns -1, and marks the tape as failed, when there is no memory for it - the old cells are kept
+static long growTape(struct Tape* tape, int towardsLeft) {
+    long oldCapacity = tape->capacity;
+    long newCapacity = oldCapacity * 2;
+    char* cells = (char*)realloc(tape->cells, newCapacity);
+    if (cells == NULL) {
+        tape->failed = 1;
+        return -1;
+    }
+    long shift = 0;
+    if (towardsLeft) {
+        // Move the old cells to the upper half and blank the lower half
+        shift = newCapacity - oldCapacity;
+        memmove(cells + shift, cells, oldCapacity);
+        memset(cells, BLANK, shift);
+    } else {
+        memset(cells + oldCapacity, BLANK, newCapacity - oldCapacity);
     }
-    return tapeHead->next;
+    tape->cells = cells;
+    tape->capacity = newCapacity;
+    tape->origin += shift;
+    tape->left += shift;
+    tape->right += shift;
+    return shift;
 }
 
-// Function to print the content of the tape
-void printTape(struct Cell* tapeHead) {
-    struct Cell* current = tapeHead;
-    while (current != NULL) {
-        printf("%c", current->value);
-        current = current->next;
+// Function to move the tape head one cell to the left - the buffer only grows when the head runs off its edge
+// When it cannot grow the head stays on the edge and sliceEnd is cleared, so the caller's loop ends at once
+static inline long moveLeft(struct Tape* tape, long head, long long* sliceEnd) {
+    head--;
+    if (head < tape->left) {
+        if (head < 0) {
+            long shift = growTape(tape, 1);
+            if (shift < 0) {
+                *sliceEnd = LLONG_MIN;
+                return 0;
+            }
+            head += shift;
+        }
+        tape->left = head;
     }
-    printf("\n");
+    return head;
 }
 
-// Get and store all values from the input file - print initial tape contents, return TM struct
-struct TuringMachine createTM (const char* fileName) {
-    FILE* file;
+// Function to move the tape head one cell to the right - the buffer only grows when the head runs off its edge
+static inline long moveRight(struct Tape* tape, long head, long long* sliceEnd) {
+    head++;
+    if (head > tape->right) {
+        if (head >= tape->capacity && growTape(tape, 0) < 0) {
+            *sliceEnd = LLONG_MIN;
+            return tape->capacity - 1;
+        }
+        tape->right = head;
+    }
+    return head;
+}
 
-    file = fopen(fileName, "r");
+#ifdef HAVE_AVX2
+// Whether the processor has AVX2 - checked on every long scan, which costs a load and a test
+#define hasAvx2() __builtin_cpu_supports("avx2")
 
-    if (!file) {
-        printf("Enter valid file. \n");
-        exit(1);
+// AVX2 part of scanRight - stops at the first cell that does not hold symbol, or with less than 32 cells left
+__attribute__((target("avx2"))) static long scanRightAvx2(const char* cells, long i, long to, char symbol) {
+    __m256i pattern = _mm256_set1_epi8(symbol);
+    while (i + 32 <= to + 1) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(cells + i)), pattern));
+        if (mask != 0xFFFFFFFFu) {
+            return i + __builtin_ctz(~mask);
+        }
+        i += 32;
     }
+    return i;
+}
 
-    struct TuringMachine tm;
+// AVX2 part of scanLeft
+__attribute__((target("avx2"))) static long scanLeftAvx2(const char* cells, long i, long to, char symbol) {
+    __m256i pattern = _mm256_set1_epi8(symbol);
+    while (i - 31 >= to) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(cells + i - 31)), pattern));
+        if (mask != 0xFFFFFFFFu) {
+            return i - 31 + (31 - __builtin_clz(~mask));
+        }
+        i -= 32;
+    }
+    return i;
+}
 
-    // holds initial tape content
-    char initialTape[MAX_TAPE_LENGTH];
-    fgets(initialTape, sizeof(initialTape), file);
-    initialTape[strlen(initialTape) - 1] = '\0'; // Remove newline character
+// AVX2 part of findMismatch - stops at the first difference, or with less than 32 cells left
+__attribute__((target("avx2"))) static long findMismatchAvx2(const char* a, const char* b, long i, long length) {
+    while (i + 32 <= length) {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i))));
+        if (mask != 0xFFFFFFFFu) {
+            return i + __builtin_ctz(~mask);
+        }
+        i += 32;
+    }
+    return i;
+}
+#endif
+
+// Function to find the end of a run of symbol starting at from and going right, without passing to
+// Returns the index of the first cell that does not hold symbol, or to + 1 when the whole range does
+static long scanRight(const char* cells, long from, long to, char symbol) {
+    long i = from;
+#ifdef HAVE_AVX2
+    if (to - i >= 64 && hasAvx2()) {
+        i = scanRightAvx2(cells, i, to, symbol);
+    }
+#endif
+#ifdef __SSE2__
+    __m128i pattern = _mm_set1_epi8(symbol);
+    while (i + 16 <= to + 1) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(cells + i)), pattern));
+        if (mask != 0xFFFF) {
+            return i + __builtin_ctz(~mask & 0xFFFF);
+        }
+        i += 16;
+    }
+#endif
+    while (i <= to && cells[i] == symbol) {
+        i++;
+    }
+    return i;
+}
+
+// Function to find the end of a run of symbol starting at from and going left, without passing to
+// Returns the index of the first cell that does not hold symbol, or to - 1 when the whole range does
+static long scanLeft(const char* cells, long from, long to, char symbol) {
+    long i = from;
+#ifdef HAVE_AVX2
+    if (i - to >= 64 && hasAvx2()) {
+        i = scanLeftAvx2(cells, i, to, symbol);
+    }
+#endif
+#ifdef __SSE2__
+    __m128i pattern = _mm_set1_epi8(symbol);
+    while (i - 15 >= to) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(cells + i - 15)), pattern));
+        if (mask != 0xFFFF) {
+            return i - 15 + (31 - __builtin_clz(~mask & 0xFFFF));
+        }
+        i -= 16;
+    }
+#endif
+    while (i >= to && cells[i] == symbol) {
+        i--;
+    }
+    return i;
+}
 
-    // Allocate memory for a new struct cell and store  in tapeStart
-    struct Cell* tapeStart = (struct Cell*)malloc(sizeof(struct Cell));
-    tapeStart->value = 'A';
-    tapeStart->next = NULL;
-    tapeStart->prev = NULL;
+// Function to find the first cell where two runs of length cells differ - returns length when they do not
+// Unlike memcmp it says where, which is what a comparison with an expected tape reports
+static long findMismatch(const char* a, const char* b, long length) {
+    long i = 0;
+#ifdef HAVE_AVX2
+    if (length >= 64 && hasAvx2()) {
+        i = findMismatchAvx2(a, b, i, length);
+    }
+#endif
+#ifdef __SSE2__
+    while (i + 16 <= length) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                                    _mm_loadu_si128((const __m128i*)(b + i))));
+        if (mask != 0xFFFF) {
+            return i + __builtin_ctz(~mask & 0xFFFF);
+        }
+        i += 16;
+    }
+#endif
+    while (i < length && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
 
-    struct Cell* head = tapeStart;
+// Function to find the cells of the tape to output - every cell visited by the head, without the blank
+// cells at both ends when trimming; last is first - 1 when nothing is left
+static void tapeBounds(const struct Tape* tape, int flags, long* first, long* last) {
+    *first = tape->left;
+    *last = tape->right;
+    if (flags & OUTPUT_TRIM) {
+        *first = scanRight(tape->cells, *first, *last, BLANK);
+        *last = scanLeft(tape->cells, *last, *first, BLANK);
+    }
+}
 
-    // Read and parse the input file
-    int numStates, startState, endState;
-    fscanf(file, "%d", &numStates);
-    fscanf(file, "%d", &startState);
-    fscanf(file, "%d", &endState);
+// Function to compare the output cells of the tape, as tapeBounds finds them, with the expected tape
+// Returns -1 when they are the same, otherwise the offset of the first difference from the first output cell
+static long compareTape(const struct Tape* tape, int flags, const char* expected, long length) {
+    long first, last;
+    tapeBounds(tape, flags, &first, &last);
+    long cells = last - first + 1;
+    long common = cells < length ? cells : length;
+    long mismatch = findMismatch(tape->cells + first, expected, common);
+    return mismatch < common || cells != length ? mismatch : -1;
+}
 
-    // Allocate memory for the TM transitions 2D array
-    // rows are instructions, columns are ASCII characters
-    // array of row pointers to rows of instructions
-    tm.transitions = (struct Instruction**) malloc(MAX_STATES * sizeof(struct Instruction*));
-    // Allocate memory for each row of instructions in the 2d array
-    for (int i = 0; i < MAX_STATES; i++) {
-        tm.transitions[i] = (struct Instruction*)malloc(ASCII_RANGE * sizeof(struct Instruction));
+#ifndef TM_LIBRARY
+// Function to write all the parts to a file descriptor, going on after partial writes
+static int writeParts(int fd, struct iovec* parts, int numParts) {
+    int part = 0;
+    while (part < numParts) {
+        ssize_t written = writev(fd, parts + part, numParts - part);
+        if (written < 0) {
+            return -1;
+        }
+        // skip what was written, which may end in the middle of a part
+        while (part < numParts && (size_t)written >= parts[part].iov_len) {
+            written -= parts[part].iov_len;
+            part++;
+        }
+        if (part < numParts) {
+            parts[part].iov_base = (char*)parts[part].iov_base + written;
+            parts[part].iov_len -= written;
+        }
     }
+    return 0;
+}
 
+// Function to write the tape to a file descriptor - the cells go out straight from the tape buffer,
+// together with the newline, in one system call for all but huge tapes
+static int writeTape(const struct Tape* tape, int fd, int flags) {
+    long first, last;
+    tapeBounds(tape, flags, &first, &last);
+    struct iovec parts[2];
+    parts[0].iov_base = tape->cells + first;
+    parts[0].iov_len = (size_t)(last - first + 1);
+    parts[1].iov_base = "\n";
+    parts[1].iov_len = (flags & OUTPUT_RAW) ? 0 : 1;
+    return writeParts(fd, parts, 2);
+}
 
-    char line[100];
-    while (fgets(line, sizeof(line), file)) {
-        int fromState, toState;
-        char readVal, writeVal, moveDirection;
+// Function to print the content of the tape - every cell visited by the head
+static void printTape(const struct Tape* tape) {
+    fflush(stdout);
+    writeTape(tape, STDOUT_FILENO, 0);
+}
+#endif
 
-        if (sscanf(line, "(%d,%c)->(%c,%c,%d)", &fromState, &readVal, &writeVal, &moveDirection, &toState) != 5) {
-            continue;
+// Function to keep the first error of a load and stop the parser - every loop of the parser ends at the end
+// of the data, so parsing winds down without looking at the rest of it
+static void failLoad(struct Parser* parser, int error, const char* message) {
+    if (parser->error == TM_OK) {
+        parser->error = error;
+        if (parser->message != NULL && parser->messageSize > 0) {
+            snprintf(parser->message, parser->messageSize, "%s", message);
         }
+    }
+    parser->pos = parser->size;
+}
+
+// Function to report a parse error at the parser's position
+static void parseError(struct Parser* parser, const char* message) {
+    char located[LOAD_MESSAGE_SIZE];
+    snprintf(located, sizeof(located), "%s:%d:%d: %s", parser->fileName, parser->line,
+             (int)(parser->pos - parser->lineStart) + 1, message);
+    failLoad(parser, TM_ERROR_PARSE, located);
+}
+
+// Function to report an error in an already parsed rule, at the line and column the rule starts
+static void ruleError(struct Parser* parser, int line, int column, const char* message) {
+    char located[LOAD_MESSAGE_SIZE];
+    snprintf(located, sizeof(located), "%s:%d:%d: %s", parser->fileName, line, column, message);
+    failLoad(parser, TM_ERROR_PARSE, located);
+}
+
+static int atEnd(const struct Parser* parser) {
+    return parser->pos >= parser->size;
+}
 
-        // Store the transition in the 2D array
-        tm.transitions[fromState][(int)readVal].write = writeVal;
-        tm.transitions[fromState][(int)readVal].moveDirection = moveDirection;
-        tm.transitions[fromState][(int)readVal].nextState = toState;
+static int peek(const struct Parser* parser) {
+    return atEnd(parser) ? -1 : (unsigned char)parser->data[parser->pos];
+}
 
+// Consume one character, keeping track of lines
+static int next(struct Parser* parser) {
+    int c = peek(parser);
+    if (c >= 0) {
+        parser->pos++;
+        if (c == '\n') {
+            parser->line++;
+            parser->lineStart = parser->pos;
+        }
     }
+    return c;
+}
 
-    fclose(file);
+// Consume the expected character or report what was missing
+static void expect(struct Parser* parser, char expected) {
+    if (peek(parser) != (unsigned char)expected) {
+        char message[32];
+        snprintf(message, sizeof(message), "expected '%c'", expected);
+        parseError(parser, message);
+    }
+    next(parser);
+}
 
-    // iterate through each character in initial tape
-    for (int i = 0; initialTape[i] != '\0'; i++) {
-        // malloc to dynamically allocate memory for each cell of initial tape
-        struct Cell* newCell = (struct Cell*)malloc(sizeof(struct Cell));
-        newCell->value = initialTape[i];
-        newCell->next = NULL;
-        newCell->prev = head;
-        head->next = newCell;
-        head = newCell;
+// Consume spaces and tabs, and newlines too when acrossLines is set
+static void skipBlanks(struct Parser* parser, int acrossLines) {
+    int c = peek(parser);
+    while (c == ' ' || c == '\t' || c == '\r' || (acrossLines && c == '\n')) {
+        next(parser);
+        c = peek(parser);
     }
+}
 
+// Parse a decimal integer, optionally signed and preceded by blanks
+static int parseInt(struct Parser* parser, int acrossLines) {
+    skipBlanks(parser, acrossLines);
+    int negative = 0;
+    if (peek(parser) == '-' || peek(parser) == '+') {
+        negative = next(parser) == '-';
+    }
+    if (peek(parser) < '0' || peek(parser) > '9') {
+        parseError(parser, "expected a number");
+    }
+    long long value = 0;
+    while (peek(parser) >= '0' && peek(parser) <= '9') {
+        value = value * 10 + (next(parser) - '0');
+        if (value > INT_MAX) {
+            parseError(parser, "number out of range");
+        }
+    }
+    return negative ? (int)-value : (int)value;
+}
 
-    printf("Initial tape contents: ");
-    printTape(tapeStart);
+// Parse a tape symbol - any character but a line break
+static char parseSymbol(struct Parser* parser) {
+    if (atEnd(parser) || peek(parser) == '\n') {
+        parseError(parser, "expected a symbol");
+    }
+    return (char)next(parser);
+}
 
-    // fill our turing machine tape, startState and endState values
-    tm.tape = tapeStart;
-    tm.startState = startState;
-    tm.endState = endState;
+// Parse one rule, (fromState,readVal)->(writeVal,moveDirection,toState)
+// Returns 0 for a blank line, which is skipped
+static int parseRule(struct Parser* parser, struct Rule* rule) {
+    skipBlanks(parser, 0);
+    if (atEnd(parser) || peek(parser) == '\n') {
+        next(parser);
+        return 0;
+    }
+    rule->line = parser->line;
+    rule->column = (int)(parser->pos - parser->lineStart) + 1;
+    expect(parser, '(');
+    rule->fromState = parseInt(parser, 0);
+    expect(parser, ',');
+    rule->readVal = parseSymbol(parser);
+    expect(parser, ')');
+    expect(parser, '-');
+    expect(parser, '>');
+    expect(parser, '(');
+    rule->writeVal = parseSymbol(parser);
+    expect(parser, ',');
+    rule->moveDirection = parseSymbol(parser);
+    expect(parser, ',');
+    rule->toState = parseInt(parser, 0);
+    expect(parser, ')');
+    skipBlanks(parser, 0);
+    if (!atEnd(parser) && peek(parser) != '\n') {
+        parseError(parser, "unexpected text after rule");
+    }
+    next(parser);
+    return 1;
+}
 
-    return tm;
+// Parse a tuple of one symbol per tape, written without separators
+static void parseSymbols(struct Parser* parser, char* symbols, int numTapes) {
+    for (int i = 0; i < numTapes; i++) {
+        symbols[i] = parseSymbol(parser);
+    }
+}
 
+// Parse one k-tape rule, (fromState,readVals)->(writeVals,moveDirections,toState) with a tuple of one
+// symbol and one direction per tape, for example (0,1B)->(11,RS,1)
+// Returns 0 for a blank line, which is skipped
+static int parseMultiRule(struct Parser* parser, struct MultiRule* rule, int numTapes) {
+    skipBlanks(parser, 0);
+    if (atEnd(parser) || peek(parser) == '\n') {
+        next(parser);
+        return 0;
+    }
+    rule->line = parser->line;
+    rule->column = (int)(parser->pos - parser->lineStart) + 1;
+    expect(parser, '(');
+    rule->fromState = parseInt(parser, 0);
+    expect(parser, ',');
+    parseSymbols(parser, rule->readVal, numTapes);
+    expect(parser, ')');
+    expect(parser, '-');
+    expect(parser, '>');
+    expect(parser, '(');
+    parseSymbols(parser, rule->writeVal, numTapes);
+    expect(parser, ',');
+    parseSymbols(parser, rule->moveDirection, numTapes);
+    expect(parser, ',');
+    rule->toState = parseInt(parser, 0);
+    expect(parser, ')');
+    skipBlanks(parser, 0);
+    if (!atEnd(parser) && peek(parser) != '\n') {
+        parseError(parser, "unexpected text after rule");
+    }
+    next(parser);
+    return 1;
 }
 
-void runTM(struct TuringMachine* tm) {
-    // initialize tape head to beginning of the tape
-    struct Cell* head = tm->tape;
-    // Get currentState & endState from TM
-    int currentState = tm->startState;
-    int endState = tm->endState;
-    // initialize instructions - reference the transitions table
-    struct Instruction** transitions = tm->transitions;
+// Function to start a transition table with every instruction MOVE_NONE, so missing rules halt the machine
+static void startTable(struct TableBuilder* builder, int numStates, struct Parser* parser) {
+    struct TransitionTable* table = &builder->table;
+    table->numStates = numStates;
+    // column 0 is shared by every symbol that no rule reads
+    memset(table->symbolIndex, 0, sizeof(table->symbolIndex));
+    memset(table->symbols, 0, sizeof(table->symbols));
+    table->alphabetSize = 1;
+    builder->stride = 8;
+    table->instructions = (struct Instruction*)calloc((size_t)numStates * builder->stride, sizeof(struct Instruction));
+    if (table->instructions == NULL) {
+        failLoad(parser, TM_ERROR_MEMORY, "Out of memory for transition table.");
+    }
+}
+
+// Function to give a symbol its own column, doubling the columns of every row when they are all in use
+// Returns -1 when there is no memory for the columns
+static int symbolColumn(struct TableBuilder* builder, char symbol, struct Parser* parser) {
+    struct TransitionTable* table = &builder->table;
+    unsigned char index = table->symbolIndex[(unsigned char)symbol];
+    if (index != 0) {
+        return index;
+    }
+    if (table->alphabetSize == builder->stride) {
+        int stride = builder->stride * 2;
+        struct Instruction* instructions = (struct Instruction*)realloc(table->instructions,
+                                                   (size_t)table->numStates * stride * sizeof(struct Instruction));
+        if (instructions == NULL) {
+            failLoad(parser, TM_ERROR_MEMORY, "Out of memory for transition table.");
+            return -1;
+        }
+        // spread the rows out from the last one down, so no row is overwritten before it has moved
+        for (long row = table->numStates - 1; row >= 0; row--) {
+            memmove(instructions + row * stride, instructions + row * builder->stride,
+                    builder->stride * sizeof(struct Instruction));
+            memset(instructions + row * stride + builder->stride, 0, (stride - builder->stride) * sizeof(struct Instruction));
+        }
+        table->instructions = instructions;
+        builder->stride = stride;
+    }
+    table->symbolIndex[(unsigned char)symbol] = (unsigned char)table->alphabetSize;
+    table->symbols[table->alphabetSize] = symbol;
+    return table->alphabetSize++;
+}
+
+// Function to pack one rule into the table - a second rule for the same state and symbol is an error,
+// unless it is an exact duplicate
+static void addRule(struct TableBuilder* builder, const struct Rule* rule, struct Parser* parser) {
+    int column = symbolColumn(builder, rule->readVal, parser);
+    if (column < 0) {
+        return;
+    }
+    struct Instruction* instruction = &builder->table.instructions[(long)rule->fromState * builder->stride + column];
 
+    struct Instruction packed;
+    packed.write = rule->writeVal;
+    if (rule->moveDirection == 'L') {
+        packed.move = MOVE_LEFT;
+    } else if (rule->moveDirection == 'R') {
+        packed.move = MOVE_RIGHT;
+    } else {
+        packed.move = MOVE_HALT;
+    }
+    packed.nextState = (unsigned short)rule->toState;
+
+    if (instruction->move != MOVE_NONE) {
+        if (instruction->write == packed.write && instruction->move == packed.move
+            && instruction->nextState == packed.nextState) {
+            return;
+        }
+        ruleError(parser, rule->line, rule->column, "conflicting rule for the same state and symbol");
+        return;
+    }
+    *instruction = packed;
+}
 
-    // This is the main loop for the Turing Machine
-    while (currentState != endState && head != NULL) {
-        // readSymbol determines the symbol read from the tape, which is used to look up instructions in the transition table
-        char readSymbol = head->value;
+// Function to mark self loops that write back the symbol they read - the head keeps sweeping over a run of that
+// symbol in the same state, so runTM can skip the whole run in one scan
+static void markSweeps(struct TransitionTable* table) {
+    int alphabetSize = table->alphabetSize;
+    for (long row = 0; row < table->numStates; row++) {
+        for (int column = 1; column < alphabetSize; column++) {
+            struct Instruction* instruction = &table->instructions[row * alphabetSize + column];
+            if (instruction->nextState == row && instruction->write == table->symbols[column]) {
+                if (instruction->move == MOVE_LEFT) {
+                    instruction->move = MOVE_SWEEP_LEFT;
+                } else if (instruction->move == MOVE_RIGHT) {
+                    instruction->move = MOVE_SWEEP_RIGHT;
+                }
+            }
+        }
+    }
+}
 
-        // Grab the instruction for the current state and read symbol from the transition table
-        struct Instruction instruction = transitions[currentState][(int)readSymbol];
+// Function to finish the table - pack the rows down to exactly one column per symbol and mark sweeps
+static struct TransitionTable finishTable(struct TableBuilder* builder) {
+    struct TransitionTable* table = &builder->table;
+    int alphabetSize = table->alphabetSize;
+    for (long row = 0; row < table->numStates; row++) {
+        memmove(table->instructions + row * alphabetSize, table->instructions + row * builder->stride,
+                alphabetSize * sizeof(struct Instruction));
+    }
+    struct Instruction* instructions = (struct Instruction*)realloc(table->instructions,
+                                               (size_t)table->numStates * alphabetSize * sizeof(struct Instruction));
+    if (instructions != NULL) {
+        table->instructions = instructions;
+    }
+    builder->stride = alphabetSize;
+    markSweeps(table);
+    return *table;
+}
 
-        // update the tape cell with the symbol to write
-        head->value = instruction.write;
+// Function to parse the rules of a k-tape machine and build its table - the rules are collected first,
+// since the columns depend on the alphabets of all tapes
+static void loadMultiRules(struct Parser* parser, struct MultiTape* multi, int numStates, int endState) {
+    int numTapes = multi->numTapes;
+    size_t numRules = 0;
+    size_t capacity = 64;
+    struct MultiRule* rules = (struct MultiRule*)malloc(capacity * sizeof(struct MultiRule));
+    if (rules == NULL) {
+        failLoad(parser, TM_ERROR_MEMORY, "Out of memory for transition table.");
+        return;
+    }
+    int alphabetSize[MAX_TAPES];
+    for (int t = 0; t < numTapes; t++) {
+        alphabetSize[t] = 1;
+    }
 
-        //Move tape left  or right based on instruction
-        if (instruction.moveDirection == 'L') {
-            head = moveLeft(head);
-        } else if (instruction.moveDirection == 'R') {
-            head = moveRight(head);
+    // give every symbol read on a tape its index within that tape, 0 is left for symbols no rule reads
+    memset(multi->columnOffset, 0, sizeof(multi->columnOffset));
+    while (!atEnd(parser)) {
+        if (numRules == capacity) {
+            struct MultiRule* grown = (struct MultiRule*)realloc(rules, 2 * capacity * sizeof(struct MultiRule));
+            if (grown == NULL) {
+                failLoad(parser, TM_ERROR_MEMORY, "Out of memory for transition table.");
+                break;
+            }
+            rules = grown;
+            capacity *= 2;
+        }
+        struct MultiRule* rule = &rules[numRules];
+        if (!parseMultiRule(parser, rule, numTapes) || parser->error != TM_OK) {
+            continue;
+        }
+        if (rule->fromState < 0 || rule->fromState >= numStates
+            || ((rule->toState < 0 || rule->toState >= numStates) && rule->toState != endState)) {
+            ruleError(parser, rule->line, rule->column, "state out of range");
+            continue;
         }
-        else {
-            break; // Halt TM when no valid transition is found
+        for (int t = 0; t < numTapes; t++) {
+            int* index = &multi->columnOffset[t][(unsigned char)rule->readVal[t]];
+            if (*index == 0) {
+                *index = alphabetSize[t]++;
+            }
         }
+        numRules++;
+    }
 
-        // update current state to the next state
-        currentState = instruction.nextState;
+    // scale the indices by the stride of their tape, so the offsets of the heads' symbols add up to the column
+    long numColumns = 1;
+    for (int t = 0; t < numTapes; t++) {
+        for (int symbol = 0; symbol < SYMBOL_RANGE; symbol++) {
+            multi->columnOffset[t][symbol] *= (int)numColumns;
+        }
+        numColumns *= alphabetSize[t];
+        if (numColumns * numStates > MAX_MULTI_ENTRIES && parser->error == TM_OK) {
+            char message[LOAD_MESSAGE_SIZE];
+            snprintf(message, sizeof(message), "%s: too many combinations of states and symbols", parser->fileName);
+            failLoad(parser, TM_ERROR_PARSE, message);
+        }
+    }
+    if (parser->error != TM_OK) {
+        free(rules);
+        return;
+    }
+    multi->numColumns = (int)numColumns;
+    multi->instructions = (struct MultiInstruction*)calloc((size_t)numStates * numColumns, sizeof(struct MultiInstruction));
+    if (multi->instructions == NULL) {
+        failLoad(parser, TM_ERROR_MEMORY, "Out of memory for transition table.");
+        free(rules);
+        return;
     }
 
-    // print tape
-    struct Cell* printHead = tm->tape;
+    for (size_t i = 0; i < numRules; i++) {
+        const struct MultiRule* rule = &rules[i];
+        long column = 0;
+        struct MultiInstruction packed;
+        memset(&packed, 0, sizeof(packed));
+        packed.action = MOVE_RIGHT;
+        packed.nextState = (unsigned short)rule->toState;
+        for (int t = 0; t < numTapes; t++) {
+            column += multi->columnOffset[t][(unsigned char)rule->readVal[t]];
+            packed.write[t] = rule->writeVal[t];
+            if (rule->moveDirection[t] == 'L') {
+                packed.move[t] = MOVE_LEFT;
+            } else if (rule->moveDirection[t] == 'R') {
+                packed.move[t] = MOVE_RIGHT;
+            } else if (rule->moveDirection[t] == 'S') {
+                packed.move[t] = MOVE_STAY;
+            } else {
+                packed.action = MOVE_HALT;
+            }
+        }
+        if (packed.action == MOVE_HALT) {
+            memset(packed.move, MOVE_STAY, sizeof(packed.move));
+        }
 
-    printf("Final tape contents: ");
-    printTape(printHead);
+        // a second rule for the same state and symbols is an error, unless it is an exact duplicate
+        struct MultiInstruction* instruction = &multi->instructions[(long)rule->fromState * numColumns + column];
+        if (instruction->action != MOVE_NONE) {
+            if (memcmp(instruction, &packed, sizeof(packed)) == 0) {
+                continue;
+            }
+            ruleError(parser, rule->line, rule->column, "conflicting rule for the same state and symbols");
+            break;
+        }
+        *instruction = packed;
+    }
+    free(rules);
 }
 
-void cleanUp(struct TuringMachine* tm) {
+static void freeNdTable(struct NdTable* table) {
+    free(table->first);
+    free(table->choices);
+    free(table);
+}
+
+// Function to parse the rules of a nondeterministic machine - several rules for the same state and symbol are
+// all kept, exact duplicates only once
+// Returns NULL when the load fails
+static struct NdTable* loadNdRules(struct Parser* parser, int numStates, int endState) {
+    size_t numRules = 0;
+    size_t capacity = 64;
+    struct Rule* rules = (struct Rule*)malloc(capacity * sizeof(struct Rule));
+    struct NdTable* table = (struct NdTable*)calloc(1, sizeof(struct NdTable));
+    if (rules == NULL || table == NULL) {
+        failLoad(parser, TM_ERROR_MEMORY, "Out of memory for transition table.");
+        free(rules);
+        free(table);
+        return NULL;
+    }
+    table->numStates = numStates;
+    table->alphabetSize = 1;
+    while (!atEnd(parser)) {
+        if (numRules == capacity) {
+            struct Rule* grown = (struct Rule*)realloc(rules, 2 * capacity * sizeof(struct Rule));
+            if (grown == NULL) {
+                failLoad(parser, TM_ERROR_MEMORY, "Out of memory for transition table.");
+                break;
+            }
+            rules = grown;
+            capacity *= 2;
+        }
+        struct Rule* rule = &rules[numRules];
+        if (!parseRule(parser, rule) || parser->error != TM_OK) {
+            continue;
+        }
+        if (rule->fromState < 0 || rule->fromState >= numStates
+            || ((rule->toState < 0 || rule->toState >= numStates) && rule->toState != endState)) {
+            ruleError(parser, rule->line, rule->column, "state out of range");
+            continue;
+        }
+        unsigned char* index = &table->symbolIndex[(unsigned char)rule->readVal];
+        if (*index == 0) {
+            *index = (unsigned char)table->alphabetSize++;
+        }
+        numRules++;
+    }
+
+    // count the choices of every entry, then place the rules behind the running totals
+    long numEntries = (long)numStates * table->alphabetSize;
+    int* filled = NULL;
+    if (parser->error == TM_OK) {
+        table->first = (int*)calloc((size_t)numEntries + 1, sizeof(int));
+        table->choices = (struct Instruction*)malloc((numRules + 1) * sizeof(struct Instruction));
+        filled = (int*)calloc((size_t)numEntries, sizeof(int));
+        if (table->first == NULL || table->choices == NULL || filled == NULL) {
+            failLoad(parser, TM_ERROR_MEMORY, "Out of memory for transition table.");
+        }
+    }
+    if (parser->error != TM_OK) {
+        free(filled);
+        freeNdTable(table);
+        free(rules);
+        return NULL;
+    }
+    for (size_t i = 0; i < numRules; i++) {
+        table->first[(long)rules[i].fromState * table->alphabetSize + table->symbolIndex[(unsigned char)rules[i].readVal] + 1]++;
+    }
+    for (long entry = 0; entry < numEntries; entry++) {
+        table->first[entry + 1] += table->first[entry];
+    }
+    for (size_t i = 0; i < numRules; i++) {
+        const struct Rule* rule = &rules[i];
+        long entry = (long)rule->fromState * table->alphabetSize + table->symbolIndex[(unsigned char)rule->readVal];
+        struct Instruction choice;
+        choice.write = rule->writeVal;
+        choice.move = rule->moveDirection == 'L' ? MOVE_LEFT : rule->moveDirection == 'R' ? MOVE_RIGHT : MOVE_HALT;
+        choice.nextState = (unsigned short)rule->toState;
+        struct Instruction* choices = table->choices + table->first[entry];
+        int duplicate = 0;
+        for (int k = 0; k < filled[entry]; k++) {
+            duplicate |= choices[k].write == choice.write && choices[k].move == choice.move
+                         && choices[k].nextState == choice.nextState;
+        }
+        if (!duplicate) {
+            choices[filled[entry]++] = choice;
+        }
+    }
 
-    // get reference to the start of the tape
-    struct Cell* tapeStart = tm->tape;
-    while (tapeStart != NULL) {
-        struct Cell* temp = tapeStart;
-        tapeStart = tapeStart->next;
-        free(temp); // free memory occupied by current cell
+    // close the gaps left by the duplicates
+    int numChoices = 0;
+    for (long entry = 0; entry < numEntries; entry++) {
+        memmove(table->choices + numChoices, table->choices + table->first[entry], filled[entry] * sizeof(struct Instruction));
+        table->first[entry] = numChoices;
+        numChoices += filled[entry];
     }
+    table->first[numEntries] = numChoices;
+    free(filled);
+    free(rules);
+    return table;
+}
 
-    // Free the allocated memory for the transitions 2D array
-    for (int i = 0; i < MAX_STATES; i++) {
-        free(tm->transitions[i]);
+// Function to load a tape from the line at the parser's position - the whole line is the tape content
+static void parseTapeLine(struct Parser* parser, struct Tape* tape) {
+    const char* tapeContent = parser->data + parser->pos;
+    const char* lineEnd = (const char*)memchr(tapeContent, '\n', parser->size - parser->pos);
+    size_t tapeLength = lineEnd != NULL ? (size_t)(lineEnd - tapeContent) : parser->size - parser->pos;
+    parser->pos += tapeLength;
+    next(parser);
+    if (tapeLength > 0 && tapeContent[tapeLength - 1] == '\r') {
+        tapeLength--;
+    }
+    memset(tape, 0, sizeof(struct Tape));
+    if (fillTape(tape, tapeContent, (long)tapeLength) != 0) {
+        failLoad(parser, TM_ERROR_MEMORY, "Out of memory for tape.");
     }
-    free(tm->transitions);
 }
 
-int main() {
-    char fileName[100];
+static int mapImage(const char* fileName, int verify, struct TuringMachine* tm, char* message, size_t messageSize);
+static void cleanUp(struct TuringMachine* tm);
 
-    printf("Enter filename: ");
-    scanf("%s", fileName);
+// Function to put the message of a load error where the caller wants it - format holds at most one %s, for name
+static int loadError(char* message, size_t messageSize, int error, const char* format, const char* name) {
+    if (message != NULL && messageSize > 0) {
+        snprintf(message, messageSize, format, name);
+    }
+    return error;
+}
 
-    struct TuringMachine tm = createTM(fileName);
+// Function to parse a whole machine from the parser's data in a single pass, straight into the table
+// Returns TM_OK, or the parser's error - the machine is freed again then
+static int parseMachine(struct Parser* parser, struct TuringMachine* tm) {
+    memset(tm, 0, sizeof(struct TuringMachine));
 
-    runTM(&tm);
+    // A k-tape machine starts with the number of tapes
+    int numTapes = 0;
+    if (parser->size >= strlen(TAPES_DIRECTIVE) && memcmp(parser->data, TAPES_DIRECTIVE, strlen(TAPES_DIRECTIVE)) == 0) {
+        parser->pos = strlen(TAPES_DIRECTIVE);
+        numTapes = parseInt(parser, 0);
+        if (numTapes < 1 || numTapes > MAX_TAPES) {
+            parseError(parser, "number of tapes out of range");
+            numTapes = 0;
+        }
+        skipBlanks(parser, 0);
+        if (!atEnd(parser) && peek(parser) != '\n') {
+            parseError(parser, "unexpected text after number of tapes");
+        }
+        next(parser);
+    }
 
-    cleanUp(&tm);
+    // Each tape starts with the 'A' cell followed by the initial tape content - the whole line
+    parseTapeLine(parser, &tm->tape);
+    tm->multi = NULL;
+    if (numTapes > 0 && (parser->flags & LOAD_ALL_RULES)) {
+        parseError(parser, "nondeterministic multi-tape machines are not supported");
+    }
+    tm->nondet = NULL;
+    tm->sparse = NULL;
+    tm->macro = NULL;
+    tm->profile = NULL;
+    tm->originalStates = NULL;
+    if (numTapes > 0 && parser->error == TM_OK) {
+        tm->multi = (struct MultiTape*)calloc(1, sizeof(struct MultiTape));
+        if (tm->multi == NULL) {
+            failLoad(parser, TM_ERROR_MEMORY, "Out of memory for tape.");
+        } else {
+            tm->multi->numTapes = numTapes;
+            for (int t = 0; t < numTapes - 1; t++) {
+                parseTapeLine(parser, &tm->multi->tapes[t]);
+            }
+        }
+    }
 
-    return 0;
-}
\ No newline at end of file
+    // Read and parse the number of states, the start state and the end state
+    int numStates = parseInt(parser, 1);
+    if (numStates < 1 || numStates > MAX_STATES) {
+        parseError(parser, "number of states out of range");
+    }
+    int startState = parseInt(parser, 1);
+    if (startState < 0 || startState >= numStates) {
+        parseError(parser, "start state out of range");
+    }
+    int endState = parseInt(parser, 1);
+    if (endState < 0 || endState >= MAX_STATES) {
+        parseError(parser, "end state out of range");
+    }
+    // the rest of the end state's line is ignored
+    while (!atEnd(parser) && next(parser) != '\n') {
+    }
+    if (parser->error != TM_OK) {
+        cleanUp(tm);
+        return parser->error;
+    }
+
+    // Parse the rules straight into the flat transition table
+    if (tm->multi != NULL) {
+        loadMultiRules(parser, tm->multi, numStates, endState);
+    } else if (parser->flags & LOAD_ALL_RULES) {
+        tm->nondet = loadNdRules(parser, numStates, endState);
+    } else {
+        struct TableBuilder builder;
+        startTable(&builder, numStates, parser);
+        struct Rule rule;
+        while (!atEnd(parser)) {
+            if (!parseRule(parser, &rule) || parser->error != TM_OK) {
+                continue;
+            }
+
+            // Rules may only leave existing states, and only enter existing states or the end state
+            if (rule.fromState < 0 || rule.fromState >= numStates
+                || ((rule.toState < 0 || rule.toState >= numStates) && rule.toState != endState)) {
+                ruleError(parser, rule.line, rule.column, "state out of range");
+                continue;
+            }
+            addRule(&builder, &rule, parser);
+        }
+        if (builder.table.instructions != NULL) {
+            tm->transitions = finishTable(&builder);
+        }
+    }
+    if (parser->error != TM_OK) {
+        cleanUp(tm);
+        return parser->error;
+    }
+
+    // fill our turing machine startState and endState values
+    tm->startState = startState;
+    tm->endState = endState;
+    tm->engine = ENGINE_INTERPRETER;
+    tm->threaded = NULL;
+    tm->jit = NULL;
+    tm->image = NULL;
+    tm->imageSize = 0;
+    tm->startHead = 0;
+    tm->startSteps = 0;
+    tm->maxSteps = 0;
+    tm->maxSeconds = 0;
+    tm->detectLoops = 0;
+    tm->checkpointName = NULL;
+    tm->checkpointInterval = 0;
+    tm->cache = NULL;
+    memset(&tm->result, 0, sizeof(tm->result));
+    return TM_OK;
+}
+
+// Function to load a machine file, or a precompiled image, into tm with the LOAD_ options in flags - returns one
+// of the TM_ codes, and on failure the message of the error
+// The file is mapped (or read, when it cannot be mapped) and parsed in a single pass straight into the table
+static int readMachine(const char* fileName, int flags, struct TuringMachine* tm, char* message,
+                       size_t messageSize) {
+    FILE* file;
+
+    file = fopen(fileName, "r");
+
+    if (!file) {
+        return loadError(message, messageSize, TM_ERROR_FILE, "Enter valid file.", fileName);
+    }
+
+    // Precompiled images are recognized by their magic and mapped instead of parsed
+    char magic[sizeof(IMAGE_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0) {
+        fclose(file);
+        return mapImage(fileName, flags & LOAD_VERIFY, tm, message, messageSize);
+    }
+    rewind(file);
+
+    // Map the file, or read it into memory when it cannot be mapped (an empty file or a pipe)
+    struct stat status;
+    size_t size = 0;
+    char* data = NULL;
+    int mapped = 0;
+    if (fstat(fileno(file), &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+        size = (size_t)status.st_size;
+        void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (mapping != MAP_FAILED) {
+            data = (char*)mapping;
+            mapped = 1;
+        }
+    }
+    if (!mapped) {
+        size_t capacity = 65536;
+        data = (char*)malloc(capacity);
+        size_t count;
+        while (data != NULL && (count = fread(data + size, 1, capacity - size, file)) > 0) {
+            size += count;
+            if (size == capacity) {
+                capacity *= 2;
+                char* grown = (char*)realloc(data, capacity);
+                if (grown == NULL) {
+                    free(data);
+                }
+                data = grown;
+            }
+        }
+    }
+    fclose(file);
+    if (data == NULL) {
+        return loadError(message, messageSize, TM_ERROR_MEMORY, "Out of memory for %s.", fileName);
+    }
+
+    struct Parser parser;
+    parser.fileName = fileName;
+    parser.data = data;
+    parser.size = size;
+    parser.pos = 0;
+    parser.line = 1;
+    parser.lineStart = 0;
+    parser.error = TM_OK;
+    parser.flags = flags;
+    parser.message = message;
+    parser.messageSize = messageSize;
+    int error = parseMachine(&parser, tm);
+
+    if (mapped) {
+        munmap(data, size);
+    } else {
+        free(data);
+    }
+    return error;
+}
+
+#ifndef TM_LIBRARY
+// Get and store all values from the input file, return TM struct - quits with the message of any error
+static struct TuringMachine loadTM(const char* fileName, int flags) {
+    struct TuringMachine tm;
+    char message[LOAD_MESSAGE_SIZE];
+    if (readMachine(fileName, flags, &tm, message, sizeof(message)) != TM_OK) {
+        printf("%s\n", message);
+        exit(1);
+    }
+    return tm;
+}
+
+// Get and store all values from the input file - print initial tape contents, return TM struct
+static struct TuringMachine createTM (const char* fileName, int flags) {
+    struct TuringMachine tm = loadTM(fileName, flags);
+
+    printf("Initial tape contents: ");
+    printTape(&tm.tape);
+    if (tm.multi != NULL) {
+        for (int t = 0; t < tm.multi->numTapes - 1; t++) {
+            printf("Initial tape %d contents: ", t + 2);
+            printTape(&tm.multi->tapes[t]);
+        }
+    }
+
+    return tm;
+}
+#endif
+
+// FNV-1a hash of a block of bytes
+static uint64_t hashBytes(const void* bytes, size_t length, uint64_t hash) {
+    const unsigned char* data = (const unsigned char*)bytes;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+// Finalizer of MurmurHash3, spreads a value over all 64 bits
+static uint64_t mixHash(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    return value ^ (value >> 33);
+}
+
+#ifndef TM_LIBRARY
+// Function to write a loaded machine as a precompiled image
+static int compileImage(const struct TuringMachine* tm, const char* imageName) {
+    if (tm->multi != NULL || tm->nondet != NULL) {
+        printf("Images of multi-tape and nondeterministic machines are not supported. \n");
+        return 1;
+    }
+    const struct TransitionTable* table = &tm->transitions;
+    const struct Tape* tape = &tm->tape;
+    size_t tableSize = (size_t)table->numStates * table->alphabetSize * sizeof(struct Instruction);
+    const char* tapeContent = tape->cells + tape->origin + 1;
+    size_t tapeLength = (size_t)(tape->right - tape->origin);
+
+    struct ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.byteOrder = 0x01020304;
+    header.numStates = table->numStates;
+    header.startState = tm->startState;
+    header.endState = tm->endState;
+    header.alphabetSize = table->alphabetSize;
+    header.tableOffset = (sizeof(header) + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+    header.tapeOffset = header.tableOffset + tableSize;
+    header.tapeLength = tapeLength;
+    memcpy(header.symbolIndex, table->symbolIndex, sizeof(header.symbolIndex));
+    memcpy(header.symbols, table->symbols, sizeof(header.symbols));
+
+    char padding[IMAGE_ALIGNMENT] = { 0 };
+    size_t paddingSize = header.tableOffset - sizeof(header);
+    uint64_t checksum = hashBytes(padding, paddingSize, HASH_SEED);
+    checksum = hashBytes(table->instructions, tableSize, checksum);
+    header.dataChecksum = hashBytes(tapeContent, tapeLength, checksum);
+    header.headerChecksum = hashBytes(&header, offsetof(struct ImageHeader, headerChecksum), HASH_SEED);
+
+    FILE* image = fopen(imageName, "wb");
+    if (!image) {
+        printf("Cannot write image file %s. \n", imageName);
+        return 1;
+    }
+    int written = fwrite(&header, sizeof(header), 1, image) == 1
+                  && fwrite(padding, 1, paddingSize, image) == paddingSize
+                  && fwrite(table->instructions, 1, tableSize, image) == tableSize
+                  && fwrite(tapeContent, 1, tapeLength, image) == tapeLength;
+    if (fclose(image) != 0 || !written) {
+        printf("Cannot write image file %s. \n", imageName);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+// Check the header of an image against the size of its file - cheap, so it is always done
+static int validImageHeader(const struct ImageHeader* header, size_t fileSize) {
+    if (fileSize < sizeof(struct ImageHeader)
+        || memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0
+        || header->version != IMAGE_VERSION
+        || header->byteOrder != 0x01020304
+        || header->headerChecksum != hashBytes(header, offsetof(struct ImageHeader, headerChecksum), HASH_SEED)) {
+        return 0;
+    }
+    uint64_t tableSize = (uint64_t)header->numStates * header->alphabetSize * sizeof(struct Instruction);
+    return header->numStates >= 1 && header->numStates <= MAX_STATES
+           && header->alphabetSize >= 1 && header->alphabetSize <= SYMBOL_RANGE
+           && header->startState >= 0 && header->startState < header->numStates
+           && header->endState >= 0 && header->endState < MAX_STATES
+           && header->tableOffset % IMAGE_ALIGNMENT == 0 && header->tableOffset >= sizeof(struct ImageHeader)
+           && header->tapeOffset == header->tableOffset + tableSize
+           && header->tapeOffset + header->tapeLength == fileSize;
+}
+
+// Function to check the transition table of an image - the engines index rows with next states and columns with
+// the symbol index, and trust sweeps to be self loops, so nothing else may be in the table
+// The checksums only catch damage, anyone can write an image with valid ones, so this runs on every load; it is
+// one pass over the table, which keeps loading an image far cheaper than parsing the machine
+static int validImageTable(const struct ImageHeader* header, const struct Instruction* instructions) {
+    int numStates = header->numStates, alphabetSize = header->alphabetSize;
+    for (int symbol = 0; symbol < SYMBOL_RANGE; symbol++) {
+        if (header->symbolIndex[symbol] >= alphabetSize) {
+            return 0;
+        }
+    }
+    for (long row = 0; row < numStates; row++) {
+        for (int column = 0; column < alphabetSize; column++) {
+            struct Instruction instruction = instructions[row * alphabetSize + column];
+            if (instruction.move == MOVE_NONE) {
+                continue;
+            }
+            // column 0 is the column of the symbols no rule reads
+            if (column == 0 || instruction.move < MOVE_LEFT || instruction.move > MOVE_SWEEP_RIGHT
+                || (instruction.nextState >= numStates && instruction.nextState != header->endState)) {
+                return 0;
+            }
+            if ((instruction.move == MOVE_SWEEP_LEFT || instruction.move == MOVE_SWEEP_RIGHT)
+                && (instruction.nextState != row || instruction.write != header->symbols[column])) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Function to check an image in memory and fill in the machine it holds - the transition table is left where it
+// is in the image, only the initial tape is copied, into the tape buffer
+static int openImage(const char* data, size_t size, const char* name, int verify, struct TuringMachine* tm,
+                     char* message, size_t messageSize) {
+    const struct ImageHeader* header = (const struct ImageHeader*)data;
+    if (!validImageHeader(header, size)) {
+        return loadError(message, messageSize, TM_ERROR_IMAGE, "Invalid machine image %s.", name);
+    }
+    if (verify && hashBytes(data + sizeof(struct ImageHeader), size - sizeof(struct ImageHeader), HASH_SEED)
+                  != header->dataChecksum) {
+        return loadError(message, messageSize, TM_ERROR_IMAGE, "Corrupt machine image %s.", name);
+    }
+    if (!validImageTable(header, (const struct Instruction*)(data + header->tableOffset))) {
+        return loadError(message, messageSize, TM_ERROR_IMAGE, "Invalid transition table in machine image %s.", name);
+    }
+
+    memset(tm, 0, sizeof(struct TuringMachine));
+    tm->startState = header->startState;
+    tm->endState = header->endState;
+    tm->transitions.numStates = header->numStates;
+    tm->transitions.alphabetSize = header->alphabetSize;
+    memcpy(tm->transitions.symbolIndex, header->symbolIndex, sizeof(header->symbolIndex));
+    memcpy(tm->transitions.symbols, header->symbols, sizeof(header->symbols));
+    // read-only - nothing writes to the table once it is built
+    tm->transitions.instructions = (struct Instruction*)(data + header->tableOffset);
+    if (fillTape(&tm->tape, data + header->tapeOffset, (long)header->tapeLength) != 0) {
+        return loadError(message, messageSize, TM_ERROR_MEMORY, "Out of memory for tape.", name);
+    }
+    tm->engine = ENGINE_INTERPRETER;
+    tm->multi = NULL;
+    tm->nondet = NULL;
+    tm->sparse = NULL;
+    tm->macro = NULL;
+    tm->profile = NULL;
+    tm->originalStates = NULL;
+    tm->cache = NULL;
+    return TM_OK;
+}
+
+// Function to load a precompiled image - the file is mapped read-only and the machine runs straight from
+// the mapping
+static int mapImage(const char* fileName, int verify, struct TuringMachine* tm, char* message, size_t messageSize) {
+    int fd = open(fileName, O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return loadError(message, messageSize, TM_ERROR_FILE, "Enter valid file.", fileName);
+    }
+    size_t size = (size_t)status.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return loadError(message, messageSize, TM_ERROR_IMAGE, "Invalid machine image %s.", fileName);
+    }
+    int error = openImage((const char*)mapping, size, fileName, verify, tm, message, messageSize);
+    if (error != TM_OK) {
+        munmap(mapping, size);
+        return error;
+    }
+    tm->image = mapping;
+    tm->imageSize = size;
+    return TM_OK;
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Function to fill in the result of a run
+static void finishRun(struct TuringMachine* tm, int reason, int state, long long steps, long head) {
+    const struct Tape* tape = &tm->tape;
+    struct RunResult* result = &tm->result;
+    result->reason = reason;
+    result->finalState = state;
+    result->steps = steps;
+    result->head = head - tape->origin;
+    result->leftmost = tape->left - tape->origin;
+    result->rightmost = tape->right - tape->origin;
+    result->cellsTouched = tape->right - tape->left + 1;
+}
+
+// Function to translate a state of a run to the machine's own numbering, which an optimized table changes
+static int originalState(const struct TuringMachine* tm, int state) {
+    return tm->originalStates != NULL ? tm->originalStates[state] : state;
+}
+
+// Reference interpreter - looks every step up in the flat transition table
+static void interpretTM(struct TuringMachine* tm) {
+    // initialize tape head to beginning of the tape
+    struct Tape* tape = &tm->tape;
+    long head = tape->origin + tm->startHead;
+    // Get currentState & endState from TM
+    int currentState = tm->startState;
+    int endState = tm->endState;
+    // initialize instructions - reference the flat transitions table and its symbol columns
+    const struct Instruction* instructions = tm->transitions.instructions;
+    const unsigned char* symbolIndex = tm->transitions.symbolIndex;
+    int alphabetSize = tm->transitions.alphabetSize;
+    long long steps = tm->startSteps;
+    long long maxSteps = tm->maxSteps > 0 ? tm->maxSteps : LLONG_MAX;
+    double start = tm->maxSeconds > 0 ? now() : 0;
+    int reason = -1;
+
+    // The run is split into slices so the time budget is checked outside the hot loop
+    while (reason < 0) {
+        long long sliceEnd = maxSteps;
+        if (tm->maxSeconds > 0 && maxSteps - steps > TIME_CHECK_INTERVAL) {
+            sliceEnd = steps + TIME_CHECK_INTERVAL;
+        }
+
+        // This is the main loop for the Turing Machine
+        while (steps < sliceEnd) {
+            if (currentState == endState) {
+                reason = RUN_HALTED;
+                break;
+            }
+
+            // readSymbol determines the symbol read from the tape, which is used to look up instructions in the transition table
+            unsigned char readSymbol = (unsigned char)tape->cells[head];
+
+            // Grab the instruction for the current state and read symbol from the transition table
+            struct Instruction instruction = instructions[currentState * alphabetSize + symbolIndex[readSymbol]];
+
+            if (instruction.move == MOVE_NONE) {
+                reason = RUN_UNDEFINED; // Halt TM when no valid transition is found
+                break;
+            }
+            steps++;
+
+            // update the tape cell with the symbol to write
+            tape->cells[head] = instruction.write;
+
+            //Move tape left  or right based on instruction
+            if (instruction.move == MOVE_LEFT) {
+                head = moveLeft(tape, head, &sliceEnd);
+            } else if (instruction.move == MOVE_RIGHT) {
+                head = moveRight(tape, head, &sliceEnd);
+            } else if (instruction.move == MOVE_SWEEP_RIGHT) {
+                // skip to the last cell of the run inside the visited region - every cell of the run is one step,
+                // so the scan stops early when the run is longer than what is left of the slice
+                long to = tape->right;
+                if (to - head > sliceEnd - steps) {
+                    to = head + (long)(sliceEnd - steps);
+                }
+                long end = scanRight(tape->cells, head, to, instruction.write);
+                steps += end - 1 - head;
+                head = moveRight(tape, end - 1, &sliceEnd);
+            } else if (instruction.move == MOVE_SWEEP_LEFT) {
+                long to = tape->left;
+                if (head - to > sliceEnd - steps) {
+                    to = head - (long)(sliceEnd - steps);
+                }
+                long end = scanLeft(tape->cells, head, to, instruction.write);
+                steps += head - (end + 1);
+                head = moveLeft(tape, end + 1, &sliceEnd);
+            }
+            else {
+                reason = RUN_NO_MOVE; // Halt TM after a rule that does not move the head
+                break;
+            }
+
+            // update current state to the next state
+            currentState = instruction.nextState;
+        }
+
+        if (tape->failed) {
+            reason = RUN_OUT_OF_MEMORY;
+        } else if (reason < 0 && currentState == endState) {
+            reason = RUN_HALTED;
+        } else if (reason < 0 && steps >= maxSteps) {
+            reason = RUN_STEP_LIMIT;
+        } else if (reason < 0 && now() - start >= tm->maxSeconds) {
+            reason = RUN_TIME_LIMIT;
+        }
+    }
+
+    finishRun(tm, reason, currentState, steps, head);
+}
+
+// Interpreter for k-tape machines - the symbols under all heads are combined into one column of the tuple table,
+// then every tape is written and its head moved
+static void multiTM(struct TuringMachine* tm) {
+    struct MultiTape* multi = tm->multi;
+    int numTapes = multi->numTapes;
+    struct Tape* tapes[MAX_TAPES];
+    long heads[MAX_TAPES];
+    tapes[0] = &tm->tape;
+    for (int t = 1; t < numTapes; t++) {
+        tapes[t] = &multi->tapes[t - 1];
+    }
+    for (int t = 0; t < numTapes; t++) {
+        heads[t] = tapes[t]->origin;
+    }
+    int currentState = tm->startState;
+    int endState = tm->endState;
+    const struct MultiInstruction* instructions = multi->instructions;
+    long numColumns = multi->numColumns;
+    long long steps = 0;
+    long long maxSteps = tm->maxSteps > 0 ? tm->maxSteps : LLONG_MAX;
+    double start = tm->maxSeconds > 0 ? now() : 0;
+    int reason = -1;
+
+    while (reason < 0) {
+        long long sliceEnd = maxSteps;
+        if (tm->maxSeconds > 0 && maxSteps - steps > TIME_CHECK_INTERVAL) {
+            sliceEnd = steps + TIME_CHECK_INTERVAL;
+        }
+
+        while (steps < sliceEnd) {
+            if (currentState == endState) {
+                reason = RUN_HALTED;
+                break;
+            }
+
+            long column = 0;
+            for (int t = 0; t < numTapes; t++) {
+                column += multi->columnOffset[t][(unsigned char)tapes[t]->cells[heads[t]]];
+            }
+            const struct MultiInstruction* instruction = &instructions[currentState * numColumns + column];
+
+            if (instruction->action == MOVE_NONE) {
+                reason = RUN_UNDEFINED;
+                break;
+            }
+            steps++;
+
+            for (int t = 0; t < numTapes; t++) {
+                tapes[t]->cells[heads[t]] = instruction->write[t];
+                if (instruction->move[t] == MOVE_LEFT) {
+                    heads[t] = moveLeft(tapes[t], heads[t], &sliceEnd);
+                } else if (instruction->move[t] == MOVE_RIGHT) {
+                    heads[t] = moveRight(tapes[t], heads[t], &sliceEnd);
+                }
+            }
+            if (instruction->action == MOVE_HALT) {
+                reason = RUN_NO_MOVE;
+                break;
+            }
+            currentState = instruction->nextState;
+        }
+
+        for (int t = 0; t < numTapes; t++) {
+            if (tapes[t]->failed) {
+                reason = RUN_OUT_OF_MEMORY;
+            }
+        }
+        if (reason < 0 && currentState == endState) {
+            reason = RUN_HALTED;
+        } else if (reason < 0 && steps >= maxSteps) {
+            reason = RUN_STEP_LIMIT;
+        } else if (reason < 0 && now() - start >= tm->maxSeconds) {
+            reason = RUN_TIME_LIMIT;
+        }
+    }
+
+    finishRun(tm, reason, currentState, steps, heads[0]);
+}
+
+// Loop detection - stops machines that provably never halt with RUN_NON_HALTING
+// Exact cycles are found with Brent's method: the configuration is saved whenever the step count reaches a
+// power of two, and every later configuration is compared with it, by a fingerprint of the state, the head and
+// a hash of the tape first and cell by cell when the fingerprint matches
+// Translated cycles are found at the head's records, when it steps onto a cell right (left) of every cell visited
+// before: if it does so in the same state as at a saved record, and the cells it has been over since then match
+// the saved ones shifted by the distance between the records, it repeats the same moves shifted along the tape forever
+struct LoopSnapshot {
+    char* cells;        // saved cells
+    long capacity;
+    long first;         // position of cells[0]
+    long length;
+    int state;
+    long head;          // positions are relative to the 'A' cell
+    uint64_t hash;
+    long extreme;       // records: farthest the head went back from the saved record since
+    int active;
+};
+
+// Share of one cell in the tape hash - nothing for blank cells, so the hash does not depend on the visited region
+static uint64_t cellHash(long position, char symbol) {
+    return symbol == BLANK ? 0 : mixHash(((uint64_t)position << 8) ^ (unsigned char)symbol);
+}
+
+// Function to save the cells from first to last (positions) with the state and head
+// Returns -1 when there is no memory for the cells
+static int saveSnapshot(struct LoopSnapshot* snapshot, const struct Tape* tape, long first, long last,
+                        int state, long head, uint64_t hash) {
+    long length = last - first + 1;
+    if (length > snapshot->capacity) {
+        char* cells = (char*)realloc(snapshot->cells, length * 2);
+        if (cells == NULL) {
+            return -1;
+        }
+        snapshot->cells = cells;
+        snapshot->capacity = length * 2;
+    }
+    memcpy(snapshot->cells, tape->cells + tape->origin + first, length);
+    snapshot->first = first;
+    snapshot->length = length;
+    snapshot->state = state;
+    snapshot->head = head;
+    snapshot->hash = hash;
+    snapshot->extreme = head;
+    snapshot->active = 1;
+    return 0;
+}
+
+// Saved cell at a position, blank outside the saved cells
+static char savedCell(const struct LoopSnapshot* snapshot, long position) {
+    long index = position - snapshot->first;
+    return index >= 0 && index < snapshot->length ? snapshot->cells[index] : BLANK;
+}
+
+// Function to check the tape against an exact snapshot - every visited cell the snapshot does not hold is blank
+static int sameTape(const struct LoopSnapshot* snapshot, const struct Tape* tape) {
+    for (long i = tape->left; i <= tape->right; i++) {
+        if (tape->cells[i] != savedCell(snapshot, i - tape->origin)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to handle a record of the head in direction (MOVE_LEFT or MOVE_RIGHT) - saves it when the record
+// snapshot is not active, and returns 1 when it completes a translated cycle, -1 when there is no memory to save it
+static int checkRecord(struct LoopSnapshot* record, const struct Tape* tape, int state, long head, int direction) {
+    if (!record->active) {
+        if (direction == MOVE_RIGHT) {
+            return saveSnapshot(record, tape, tape->left - tape->origin, head, state, head, 0);
+        }
+        return saveSnapshot(record, tape, head, tape->right - tape->origin, state, head, 0);
+    }
+    if (state != record->state) {
+        return 0;
+    }
+    long shift = head - record->head;
+    long from = direction == MOVE_RIGHT ? record->extreme : record->head;
+    long to = direction == MOVE_RIGHT ? record->head : record->extreme;
+    for (long position = from; position <= to; position++) {
+        if (tape->cells[tape->origin + position + shift] != savedCell(record, position)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Interpreter with loop detection - runs every step on its own, sweeps included, to keep the fingerprints exact
+static void loopCheckTM(struct TuringMachine* tm) {
+    struct Tape* tape = &tm->tape;
+    long head = tape->origin + tm->startHead;
+    int currentState = tm->startState;
+    int endState = tm->endState;
+    const struct Instruction* instructions = tm->transitions.instructions;
+    const unsigned char* symbolIndex = tm->transitions.symbolIndex;
+    int alphabetSize = tm->transitions.alphabetSize;
+    long long steps = tm->startSteps;
+    long long maxSteps = tm->maxSteps > 0 ? tm->maxSteps : LLONG_MAX;
+    double start = tm->maxSeconds > 0 ? now() : 0;
+    int reason = -1;
+
+    uint64_t hash = 0;
+    for (long i = tape->left; i <= tape->right; i++) {
+        hash += cellHash(i - tape->origin, tape->cells[i]);
+    }
+    struct LoopSnapshot exact, rightRecord, leftRecord;
+    memset(&exact, 0, sizeof(exact));
+    memset(&rightRecord, 0, sizeof(rightRecord));
+    memset(&leftRecord, 0, sizeof(leftRecord));
+    long long nextSnapshot = steps;
+
+    while (reason < 0) {
+        long long sliceEnd = maxSteps;
+        if (tm->maxSeconds > 0 && maxSteps - steps > TIME_CHECK_INTERVAL) {
+            sliceEnd = steps + TIME_CHECK_INTERVAL;
+        }
+
+        while (steps < sliceEnd) {
+            if (currentState == endState) {
+                reason = RUN_HALTED;
+                break;
+            }
+            char read = tape->cells[head];
+            struct Instruction instruction = instructions[currentState * alphabetSize + symbolIndex[(unsigned char)read]];
+            if (instruction.move == MOVE_NONE) {
+                reason = RUN_UNDEFINED;
+                break;
+            }
+
+            // save the configuration at every power of two, and start looking for new records
+            if (steps == nextSnapshot) {
+                if (saveSnapshot(&exact, tape, tape->left - tape->origin, tape->right - tape->origin,
+                                 currentState, head - tape->origin, hash) != 0) {
+                    reason = RUN_OUT_OF_MEMORY;
+                    break;
+                }
+                nextSnapshot = steps + (steps - tm->startSteps) + 1;
+                rightRecord.active = 0;
+                leftRecord.active = 0;
+            }
+            steps++;
+
+            hash += cellHash(head - tape->origin, instruction.write) - cellHash(head - tape->origin, read);
+            tape->cells[head] = instruction.write;
+            int record = 0;
+            if (instruction.move == MOVE_LEFT || instruction.move == MOVE_SWEEP_LEFT) {
+                record = head == tape->left ? MOVE_LEFT : 0;
+                head = moveLeft(tape, head, &sliceEnd);
+            } else if (instruction.move == MOVE_RIGHT || instruction.move == MOVE_SWEEP_RIGHT) {
+                record = head == tape->right ? MOVE_RIGHT : 0;
+                head = moveRight(tape, head, &sliceEnd);
+            } else {
+                reason = RUN_NO_MOVE;
+                break;
+            }
+            currentState = instruction.nextState;
+
+            long position = head - tape->origin;
+            if (position < rightRecord.extreme) {
+                rightRecord.extreme = position;
+            }
+            if (position > leftRecord.extreme) {
+                leftRecord.extreme = position;
+            }
+            if (record != 0 && currentState != endState) {
+                int found = checkRecord(record == MOVE_RIGHT ? &rightRecord : &leftRecord, tape, currentState,
+                                        position, record);
+                if (found != 0) {
+                    reason = found > 0 ? RUN_NON_HALTING : RUN_OUT_OF_MEMORY;
+                    break;
+                }
+            }
+            if (currentState == exact.state && position == exact.head && hash == exact.hash && sameTape(&exact, tape)) {
+                reason = RUN_NON_HALTING;
+                break;
+            }
+        }
+
+        if (tape->failed) {
+            reason = RUN_OUT_OF_MEMORY;
+        } else if (reason < 0 && currentState == endState) {
+            reason = RUN_HALTED;
+        } else if (reason < 0 && steps >= maxSteps) {
+            reason = RUN_STEP_LIMIT;
+        } else if (reason < 0 && now() - start >= tm->maxSeconds) {
+            reason = RUN_TIME_LIMIT;
+        }
+    }
+
+    free(exact.cells);
+    free(rightRecord.cells);
+    free(leftRecord.cells);
+    finishRun(tm, reason, currentState, steps, head);
+}
+
+// Profiler - a separate, instrumented copy of the interpreter, so the engines themselves carry no instrumentation
+// and only a profiled run pays for it; it counts the executions of every (state, symbol) entry and the steps taken
+// on every cell, records each time the tape buffer grows, and can write a sampled trace of the steps
+// The trace is a TRACE_MAGIC header, a version byte and the sample interval, then one record per sample: the steps
+// and the head move since the previous sample, the state and the symbol read, as LEB128 varints (zigzag encoded
+// for the head move), so the file does not depend on byte order and a sample of every step takes about 4 bytes
+#define TRACE_MAGIC "TMTRACE"
+#define TRACE_VERSION 1
+#define PROFILE_TOP 50          // transitions listed in the report, hottest first
+#define PROFILE_BUCKETS 32      // buckets of the head position histogram
+
+// Growth of the tape buffer during a profiled run
+struct GrowthEvent {
+    long long step;
+    long capacity;          // cells in the buffer after growing
+    int towardsLeft;
+};
+
+struct Profile {
+    const char* reportName;     // file to write the report to, NULL for none
+    const char* traceName;      // file to write the sampled trace to, NULL for none
+    long long traceEvery;       // steps between trace samples
+    FILE* trace;
+    long long tracedStep;       // step and head position of the last sample, 0 before the first
+    long tracedHead;
+    long long* counts;          // executions of each table entry, state * alphabetSize + column
+    long long* visits;          // steps taken on each cell, indexed like the tape buffer
+    long visitsCapacity;        // equal to the tape capacity between steps
+    long long newCells[2];      // cells visited for the first time, on the left and on the right
+    struct GrowthEvent* events;
+    int numEvents;
+    int eventsCapacity;
+};
+
+// Function to write an unsigned LEB128 varint to the trace
+static void traceVarint(FILE* trace, uint64_t value) {
+    while (value >= 0x80) {
+        putc((int)(value & 0x7f) | 0x80, trace);
+        value >>= 7;
+    }
+    putc((int)value, trace);
+}
+
+#ifndef TM_LIBRARY
+// Function to read an unsigned LEB128 varint - returns 0 at the end of the file
+static int readVarint(FILE* trace, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = getc(trace);
+        if (byte == EOF) {
+            return 0;
+        }
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to create the profile of a run of tm, opening its trace file - returns NULL, with error set to
+// TM_ERROR_MEMORY or TM_ERROR_FILE, when there is no memory for it or the trace cannot be written
+static struct Profile* startProfile(const struct TuringMachine* tm, const char* reportName,
+                                    const char* traceName, long long traceEvery, int* error) {
+    struct Profile* profile = (struct Profile*)calloc(1, sizeof(struct Profile));
+    *error = TM_ERROR_MEMORY;
+    if (profile == NULL) {
+        return NULL;
+    }
+    const struct TransitionTable* table = &tm->transitions;
+    profile->counts = (long long*)calloc((size_t)table->numStates * table->alphabetSize, sizeof(long long));
+    profile->visitsCapacity = tm->tape.capacity;
+    profile->visits = (long long*)calloc(profile->visitsCapacity, sizeof(long long));
+    if (profile->counts == NULL || profile->visits == NULL) {
+        free(profile->counts);
+        free(profile->visits);
+        free(profile);
+        return NULL;
+    }
+    profile->reportName = reportName;
+    profile->traceName = traceName;
+    profile->traceEvery = traceEvery > 0 ? traceEvery : 1;
+    if (traceName != NULL) {
+        profile->trace = fopen(traceName, "wb");
+        if (profile->trace == NULL) {
+            free(profile->counts);
+            free(profile->visits);
+            free(profile);
+            *error = TM_ERROR_FILE;
+            return NULL;
+        }
+        setvbuf(profile->trace, NULL, _IOFBF, 1 << 20);
+        fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), profile->trace);
+        putc(TRACE_VERSION, profile->trace);
+        traceVarint(profile->trace, (uint64_t)profile->traceEvery);
+    }
+    *error = TM_OK;
+    return profile;
+}
+#endif
+
+// Function to follow a growth of the tape buffer - the visit counts move with the cells they belong to
+// Returns -1 when there is no memory for them
+static int profileGrowth(struct Profile* profile, const struct Tape* tape, long shift, long long step) {
+    long oldCapacity = profile->visitsCapacity;
+    long long* visits = (long long*)realloc(profile->visits, tape->capacity * sizeof(long long));
+    if (visits == NULL) {
+        return -1;
+    }
+    memmove(visits + shift, visits, oldCapacity * sizeof(long long));
+    if (shift > 0) {
+        memset(visits, 0, shift * sizeof(long long));
+    } else {
+        memset(visits + oldCapacity, 0, (tape->capacity - oldCapacity) * sizeof(long long));
+    }
+    profile->visits = visits;
+    profile->visitsCapacity = tape->capacity;
+
+    if (profile->numEvents == profile->eventsCapacity) {
+        int capacity = profile->eventsCapacity > 0 ? profile->eventsCapacity * 2 : 16;
+        struct GrowthEvent* events = (struct GrowthEvent*)realloc(profile->events,
+                                                                  capacity * sizeof(struct GrowthEvent));
+        if (events == NULL) {
+            return -1;
+        }
+        profile->events = events;
+        profile->eventsCapacity = capacity;
+    }
+    struct GrowthEvent* event = &profile->events[profile->numEvents++];
+    event->step = step;
+    event->capacity = tape->capacity;
+    event->towardsLeft = shift > 0;
+    return 0;
+}
+
+// Profiling interpreter - runs every step on its own, sweeps included, so every step is counted
+static void profileTM(struct TuringMachine* tm) {
+    struct Profile* profile = tm->profile;
+    struct Tape* tape = &tm->tape;
+    long head = tape->origin + tm->startHead;
+    int currentState = tm->startState;
+    int endState = tm->endState;
+    const struct Instruction* instructions = tm->transitions.instructions;
+    const unsigned char* symbolIndex = tm->transitions.symbolIndex;
+    int alphabetSize = tm->transitions.alphabetSize;
+    long long steps = tm->startSteps;
+    long long maxSteps = tm->maxSteps > 0 ? tm->maxSteps : LLONG_MAX;
+    double start = tm->maxSeconds > 0 ? now() : 0;
+    int reason = -1;
+
+    while (reason < 0) {
+        long long sliceEnd = maxSteps;
+        if (tm->maxSeconds > 0 && maxSteps - steps > TIME_CHECK_INTERVAL) {
+            sliceEnd = steps + TIME_CHECK_INTERVAL;
+        }
+
+        while (steps < sliceEnd) {
+            if (currentState == endState) {
+                reason = RUN_HALTED;
+                break;
+            }
+            unsigned char read = (unsigned char)tape->cells[head];
+            int entry = currentState * alphabetSize + symbolIndex[read];
+            struct Instruction instruction = instructions[entry];
+            if (instruction.move == MOVE_NONE) {
+                reason = RUN_UNDEFINED;
+                break;
+            }
+            if (profile->trace != NULL && steps % profile->traceEvery == 0) {
+                long position = head - tape->origin;
+                traceVarint(profile->trace, (uint64_t)(steps - profile->tracedStep));
+                long move = position - profile->tracedHead;
+                traceVarint(profile->trace, move < 0 ? ((uint64_t)-(move + 1) << 1) | 1 : (uint64_t)move << 1);
+                traceVarint(profile->trace, (uint64_t)originalState(tm, currentState));
+                putc(read, profile->trace);
+                profile->tracedStep = steps;
+                profile->tracedHead = position;
+            }
+            profile->counts[entry]++;
+            profile->visits[head]++;
+            steps++;
+
+            tape->cells[head] = instruction.write;
+            long origin = tape->origin, left = tape->left, right = tape->right, capacity = tape->capacity;
+            if (instruction.move == MOVE_LEFT || instruction.move == MOVE_SWEEP_LEFT) {
+                head = moveLeft(tape, head, &sliceEnd);
+            } else if (instruction.move == MOVE_RIGHT || instruction.move == MOVE_SWEEP_RIGHT) {
+                head = moveRight(tape, head, &sliceEnd);
+            } else {
+                reason = RUN_NO_MOVE;
+                break;
+            }
+            currentState = instruction.nextState;
+            if (tape->capacity != capacity && profileGrowth(profile, tape, tape->origin - origin, steps) != 0) {
+                reason = RUN_OUT_OF_MEMORY;
+                break;
+            }
+            if (tape->left - tape->origin != left - origin || tape->right - tape->origin != right - origin) {
+                profile->newCells[tape->right - tape->origin != right - origin]++;
+            }
+        }
+
+        if (tape->failed) {
+            reason = RUN_OUT_OF_MEMORY;
+        } else if (reason < 0 && currentState == endState) {
+            reason = RUN_HALTED;
+        } else if (reason < 0 && steps >= maxSteps) {
+            reason = RUN_STEP_LIMIT;
+        } else if (reason < 0 && now() - start >= tm->maxSeconds) {
+            reason = RUN_TIME_LIMIT;
+        }
+    }
+
+    finishRun(tm, reason, currentState, steps, head);
+}
+
+#ifndef TM_LIBRARY
+// Executions of one table entry, sorted with the entry so the comparator needs nothing else
+struct EntryCount {
+    long long count;
+    int entry;
+};
+
+// Function to sort table entries by executions, most first
+static int compareCounts(const void* a, const void* b) {
+    const struct EntryCount* countA = (const struct EntryCount*)a;
+    const struct EntryCount* countB = (const struct EntryCount*)b;
+    if (countA->count != countB->count) {
+        return countA->count < countB->count ? 1 : -1;
+    }
+    return countA->entry - countB->entry;
+}
+
+// Function to write the report of a profiled run - hottest transitions, head position histogram and tape growth
+static void writeProfile(FILE* file, const struct TuringMachine* tm, const struct Profile* profile) {
+    const struct TransitionTable* table = &tm->transitions;
+    const struct RunResult* result = &tm->result;
+    const struct Tape* tape = &tm->tape;
+    long long steps = result->steps - tm->startSteps;
+    fprintf(file, "Profile: %s in state %d after %lld steps", runReasons[result->reason], result->finalState,
+            result->steps);
+    if (tm->startSteps > 0) {
+        fprintf(file, ", %lld of them profiled", steps);
+    }
+    fprintf(file, "\n");
+
+    // transitions, hottest first
+    int numEntries = table->numStates * table->alphabetSize, numRules = 0, numExecuted = 0;
+    struct EntryCount* order = (struct EntryCount*)malloc((numEntries > 0 ? numEntries : 1) * sizeof(struct EntryCount));
+    if (order == NULL) {
+        printf("Out of memory for the profile. \n");
+        exit(1);
+    }
+    for (int entry = 0; entry < numEntries; entry++) {
+        if (table->instructions[entry].move != MOVE_NONE) {
+            numRules++;
+            if (profile->counts[entry] > 0) {
+                order[numExecuted].count = profile->counts[entry];
+                order[numExecuted++].entry = entry;
+            }
+        }
+    }
+    qsort(order, numExecuted, sizeof(struct EntryCount), compareCounts);
+    fprintf(file, "Transitions: %d of %d rules executed, hottest first\n", numExecuted, numRules);
+    for (int i = 0; i < numExecuted && i < PROFILE_TOP; i++) {
+        int entry = order[i].entry;
+        struct Instruction instruction = table->instructions[entry];
+        char move = instruction.move == MOVE_LEFT || instruction.move == MOVE_SWEEP_LEFT ? 'L'
+                    : instruction.move == MOVE_RIGHT || instruction.move == MOVE_SWEEP_RIGHT ? 'R' : '-';
+        fprintf(file, "  (%d,%c)->(%c,%c,%d) %16lld %7.2f%%\n", originalState(tm, entry / table->alphabetSize),
+                table->symbols[entry % table->alphabetSize], instruction.write, move,
+                originalState(tm, instruction.nextState),
+                profile->counts[entry], steps > 0 ? 100.0 * profile->counts[entry] / steps : 0.0);
+    }
+    if (numExecuted > PROFILE_TOP) {
+        fprintf(file, "  ... %d more\n", numExecuted - PROFILE_TOP);
+    }
+    free(order);
+
+    // steps taken on each part of the visited cells
+    long cells = tape->right - tape->left + 1;
+    long width = (cells + PROFILE_BUCKETS - 1) / PROFILE_BUCKETS;
+    long hottest = tape->left;
+    for (long i = tape->left; i <= tape->right; i++) {
+        if (profile->visits[i] > profile->visits[hottest]) {
+            hottest = i;
+        }
+    }
+    fprintf(file, "Head positions: cells %ld to %ld in buckets of %ld, hottest cell %ld with %lld steps\n",
+            tape->left - tape->origin, tape->right - tape->origin, width, hottest - tape->origin,
+            profile->visits[hottest]);
+    for (long first = tape->left; first <= tape->right; first += width) {
+        long last = first + width - 1 < tape->right ? first + width - 1 : tape->right;
+        long long count = 0;
+        for (long i = first; i <= last; i++) {
+            count += profile->visits[i];
+        }
+        double share = steps > 0 ? 100.0 * count / steps : 0.0;
+        fprintf(file, "  %12ld to %-12ld %16lld %7.2f%% ", first - tape->origin, last - tape->origin, count, share);
+        for (int bar = 0; bar < (int)(share / 2 + 0.5); bar++) {
+            putc('#', file);
+        }
+        putc('\n', file);
+    }
+
+    // tape growth
+    fprintf(file, "Tape growth: %lld new cells on the left, %lld on the right, buffer grown %d times\n",
+            profile->newCells[0], profile->newCells[1], profile->numEvents);
+    for (int i = 0; i < profile->numEvents; i++) {
+        const struct GrowthEvent* event = &profile->events[i];
+        fprintf(file, "  step %lld: buffer grown to %ld cells on the %s\n", event->step, event->capacity,
+                event->towardsLeft ? "left" : "right");
+    }
+}
+
+// Function to finish a profile - writes the report and closes the trace, returns 0 on success
+static int finishProfile(struct TuringMachine* tm) {
+    struct Profile* profile = tm->profile;
+    int status = 0;
+    if (profile->trace != NULL && fclose(profile->trace) != 0) {
+        printf("Cannot write trace file %s. \n", profile->traceName);
+        status = -1;
+    }
+    if (profile->reportName != NULL) {
+        FILE* file = strcmp(profile->reportName, "-") == 0 ? stdout : fopen(profile->reportName, "w");
+        if (file == NULL) {
+            printf("Cannot write profile %s. \n", profile->reportName);
+            status = -1;
+        } else {
+            writeProfile(file, tm, profile);
+            if (file != stdout && fclose(file) != 0) {
+                printf("Cannot write profile %s. \n", profile->reportName);
+                status = -1;
+            }
+        }
+    }
+    free(profile->counts);
+    free(profile->visits);
+    free(profile->events);
+    free(profile);
+    tm->profile = NULL;
+    return status;
+}
+
+// Function to print a trace file as text, one sample per line - returns 0 on success
+static int printTrace(const char* fileName) {
+    FILE* trace = fopen(fileName, "rb");
+    char magic[sizeof(TRACE_MAGIC)];
+    uint64_t every;
+    if (trace == NULL || fread(magic, 1, sizeof(magic), trace) != sizeof(magic)
+        || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 || getc(trace) != TRACE_VERSION
+        || !readVarint(trace, &every)) {
+        printf("Enter valid trace file. \n");
+        if (trace != NULL) {
+            fclose(trace);
+        }
+        return 1;
+    }
+    printf("Trace of every %llu steps\n", (unsigned long long)every);
+    long long step = 0;
+    long head = 0;
+    uint64_t delta, move, state;
+    int read;
+    while (readVarint(trace, &delta) && readVarint(trace, &move) && readVarint(trace, &state)
+           && (read = getc(trace)) != EOF) {
+        step += (long long)delta;
+        head += move & 1 ? -(long)(move >> 1) - 1 : (long)(move >> 1);
+        printf("Step %lld: state %llu reads %c at cell %ld\n", step, (unsigned long long)state, read, head);
+    }
+    fclose(trace);
+    return 0;
+}
+
+// Table optimizer - shrinks the transition table of a single-tape machine before it runs
+// Unreachable states are dropped, equivalent states are merged by Moore's partition refinement (two states are
+// equivalent when every column writes and moves alike and goes to equivalent states), and the states left are
+// renumbered hottest first, by their executions in a short sample run, so the rows used most share cache lines
+// The end state becomes the state after the last row; reported states are translated back to the machine's numbers,
+// a merged state to the lowest numbered state of its class, which the run cannot tell apart from the others
+#define OPTIMIZE_SAMPLE_STEPS (1 << 16)
+#define END_CLASS (-1)          // class of the end state, never merged with another state
+
+// What the optimizer did to a table
+struct OptimizeStats {
+    int states;         // states of the table before
+    int unreachable;    // states dropped because no run can reach them
+    int merged;         // states merged into an equivalent state
+};
+
+// State of a refinement, handed to the sort comparator - optimizeTM runs on several server workers at once, so
+// nothing of it lives in file-scope variables
+struct Refinement {
+    const struct TransitionTable* table;
+    const int* classes;         // class of every state
+    int end;
+};
+
+// Function to sort count numbers in the order compare gives for the context, by merging runs through scratch
+// Unlike qsort, the comparator gets the context, and unlike qsort_r this is the same on every platform
+static void sortNumbers(int* numbers, int* scratch, int count, int (*compare)(const void*, int, int),
+                        const void* context) {
+    for (int width = 1; width < count; width *= 2) {
+        for (int start = 0; start < count; start += 2 * width) {
+            int middle = start + width < count ? start + width : count;
+            int end = start + 2 * width < count ? start + 2 * width : count;
+            int a = start, b = middle, out = start;
+            while (a < middle && b < end) {
+                scratch[out++] = compare(context, numbers[b], numbers[a]) < 0 ? numbers[b++] : numbers[a++];
+            }
+            while (a < middle) {
+                scratch[out++] = numbers[a++];
+            }
+            while (b < end) {
+                scratch[out++] = numbers[b++];
+            }
+        }
+        memcpy(numbers, scratch, count * sizeof(int));
+    }
+}
+
+// Function to get the move of an instruction with sweeps counted as plain moves
+static int plainMove(struct Instruction instruction) {
+    return instruction.move == MOVE_SWEEP_LEFT ? MOVE_LEFT
+           : instruction.move == MOVE_SWEEP_RIGHT ? MOVE_RIGHT : instruction.move;
+}
+
+// Function to get the class an instruction leads to - halting and missing rules lead nowhere
+static int nextClass(const struct Refinement* refinement, struct Instruction instruction) {
+    if (instruction.move == MOVE_NONE || instruction.move == MOVE_HALT) {
+        return 0;
+    }
+    return instruction.nextState == refinement->end ? END_CLASS : refinement->classes[instruction.nextState];
+}
+
+// Function to order two states by their class, then by each column's write, move and class of the next state
+// Returns 0 when the states stay in the same class
+static int compareRows(const struct Refinement* refinement, int stateA, int stateB) {
+    const int* classes = refinement->classes;
+    if (classes[stateA] != classes[stateB]) {
+        return classes[stateA] < classes[stateB] ? -1 : 1;
+    }
+    int alphabetSize = refinement->table->alphabetSize;
+    const struct Instruction* rowA = refinement->table->instructions + (long)stateA * alphabetSize;
+    const struct Instruction* rowB = refinement->table->instructions + (long)stateB * alphabetSize;
+    for (int column = 0; column < alphabetSize; column++) {
+        int moveA = plainMove(rowA[column]), moveB = plainMove(rowB[column]);
+        if (moveA != moveB) {
+            return moveA < moveB ? -1 : 1;
+        }
+        if (moveA != MOVE_NONE && rowA[column].write != rowB[column].write) {
+            return (unsigned char)rowA[column].write < (unsigned char)rowB[column].write ? -1 : 1;
+        }
+        int classA = nextClass(refinement, rowA[column]), classB = nextClass(refinement, rowB[column]);
+        if (classA != classB) {
+            return classA < classB ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static int compareRefined(const void* context, int stateA, int stateB) {
+    int order = compareRows((const struct Refinement*)context, stateA, stateB);
+    return order != 0 ? order : stateA - stateB;
+}
+
+// State order of the renumbering, hottest first and in breadth first order from the start state otherwise
+struct Ranking {
+    const long long* heat;      // executions of every class in the sample run
+    const int* order;           // breadth first position of every class
+};
+
+static int compareHeat(const void* context, int classA, int classB) {
+    const struct Ranking* ranking = (const struct Ranking*)context;
+    if (ranking->heat[classA] != ranking->heat[classB]) {
+        return ranking->heat[classA] > ranking->heat[classB] ? -1 : 1;
+    }
+    return ranking->order[classA] - ranking->order[classB];
+}
+
+// Function to count the executions of each state in a short run of the machine on a copy of its tape
+static long long* sampleStates(const struct TuringMachine* tm) {
+    struct TuringMachine sample = *tm;
+    sample.tape.cells = (char*)malloc(tm->tape.capacity);
+    if (sample.tape.cells == NULL) {
+        return NULL;
+    }
+    memcpy(sample.tape.cells, tm->tape.cells, tm->tape.capacity);
+    sample.maxSteps = sample.startSteps + OPTIMIZE_SAMPLE_STEPS;
+    sample.maxSeconds = 0;
+    int error;
+    sample.profile = startProfile(&sample, NULL, NULL, 0, &error);
+    if (sample.profile == NULL) {
+        free(sample.tape.cells);
+        return NULL;
+    }
+    profileTM(&sample);
+
+    int numStates = tm->transitions.numStates, alphabetSize = tm->transitions.alphabetSize;
+    long long* executions = (long long*)calloc(numStates, sizeof(long long));
+    for (long entry = 0; executions != NULL && entry < (long)numStates * alphabetSize; entry++) {
+        executions[entry / alphabetSize] += sample.profile->counts[entry];
+    }
+    finishProfile(&sample);
+    free(sample.tape.cells);
+    return executions;
+}
+
+// Optimize the transition table of a machine - the new table replaces the old one, and originalStates maps the
+// new state numbers back to the machine's own; multi-tape and nondeterministic machines are left alone, and so is
+// any table the optimizer has no memory for
+static struct OptimizeStats optimizeTM(struct TuringMachine* tm) {
+    struct TransitionTable* table = &tm->transitions;
+    int numStates = table->numStates, alphabetSize = table->alphabetSize;
+    struct OptimizeStats stats = { numStates, 0, 0 };
+    // the end state is numbered after the last row, which has to fit the 16 bits of a next state
+    if (tm->multi != NULL || tm->nondet != NULL || tm->startState == tm->endState || numStates >= MAX_STATES) {
+        return stats;
+    }
+
+    // there are never more reachable states or classes than states, so every working array fits numStates
+    int* buffers = (int*)malloc((size_t)numStates * 9 * sizeof(int));
+    long long* heat = (long long*)calloc(numStates, sizeof(long long));
+    if (buffers == NULL || heat == NULL) {
+        free(buffers);
+        free(heat);
+        return stats;
+    }
+    int* order = buffers;
+    int* classes = buffers + numStates;
+    int* sorted = buffers + 2 * numStates;
+    int* refined = buffers + 3 * numStates;
+    int* scratch = buffers + 4 * numStates;
+    int* position = buffers + 5 * numStates;
+    int* representative = buffers + 6 * numStates;
+    int* ranked = buffers + 7 * numStates;
+    int* newNumber = buffers + 8 * numStates;
+
+    // reachable states in breadth first order from the start state - the end state and halting rules lead nowhere
+    for (int state = 0; state < numStates; state++) {
+        classes[state] = -1;
+    }
+    int numReachable = 0;
+    order[numReachable++] = tm->startState;
+    classes[tm->startState] = 0;
+    for (int i = 0; i < numReachable; i++) {
+        const struct Instruction* row = table->instructions + (long)order[i] * alphabetSize;
+        for (int column = 0; column < alphabetSize; column++) {
+            int next = row[column].nextState;
+            if (row[column].move != MOVE_NONE && row[column].move != MOVE_HALT && next != tm->endState
+                && classes[next] < 0) {
+                classes[next] = 0;
+                order[numReachable++] = next;
+            }
+        }
+    }
+    // the end state's row, if it has one, is never run
+    stats.unreachable = numStates - numReachable - (tm->endState < numStates);
+
+    // refine the partition of the reachable states, all in one class at first, until no class splits - every
+    // round sorts the states by their class and row, and gives each run of equal states its own class
+    memcpy(sorted, order, numReachable * sizeof(int));
+    struct Refinement refinement = { table, classes, tm->endState };
+    int numClasses = 1;
+    while (1) {
+        sortNumbers(sorted, scratch, numReachable, compareRefined, &refinement);
+        int count = 0;
+        for (int i = 0; i < numReachable; i++) {
+            if (i == 0 || compareRows(&refinement, sorted[i - 1], sorted[i]) != 0) {
+                count++;
+            }
+            refined[sorted[i]] = count - 1;
+        }
+        for (int i = 0; i < numReachable; i++) {
+            classes[sorted[i]] = refined[sorted[i]];
+        }
+        if (count == numClasses) {
+            break;
+        }
+        numClasses = count;
+    }
+    stats.merged = numReachable - numClasses;
+
+    // renumber the classes, hottest first - order holds the states breadth first, so the first state of a
+    // class in order gives its breadth first position, and the lowest numbered state of a class is its
+    // representative, whose original number reports the merged state
+    long long* executions = sampleStates(tm);
+    struct Instruction* instructions = (struct Instruction*)calloc((size_t)numClasses * alphabetSize,
+                                                                   sizeof(struct Instruction));
+    int* originalStates = (int*)malloc(((size_t)numClasses + 1) * sizeof(int));
+    if (executions == NULL || instructions == NULL || originalStates == NULL) {
+        free(executions);
+        free(instructions);
+        free(originalStates);
+        free(buffers);
+        free(heat);
+        stats.unreachable = 0;
+        stats.merged = 0;
+        return stats;
+    }
+    for (int c = 0; c < numClasses; c++) {
+        position[c] = -1;
+        representative[c] = numStates;
+    }
+    for (int i = 0; i < numReachable; i++) {
+        int state = order[i], c = classes[state];
+        heat[c] += executions[state];
+        if (position[c] < 0) {
+            position[c] = i;
+        }
+        if (state < representative[c]) {
+            representative[c] = state;
+        }
+    }
+    for (int c = 0; c < numClasses; c++) {
+        ranked[c] = c;
+    }
+    struct Ranking ranking = { heat, position };
+    sortNumbers(ranked, scratch, numClasses, compareHeat, &ranking);
+    for (int i = 0; i < numClasses; i++) {
+        newNumber[ranked[i]] = i;
+    }
+
+    // build the new table from the representative of each class, the end state numbered after the last row
+    for (int i = 0; i < numClasses; i++) {
+        int state = representative[ranked[i]];
+        originalStates[i] = tm->originalStates != NULL ? tm->originalStates[state] : state;
+        for (int column = 0; column < alphabetSize; column++) {
+            struct Instruction instruction = table->instructions[(long)state * alphabetSize + column];
+            instruction.move = (signed char)plainMove(instruction);
+            if (instruction.move == MOVE_NONE) {
+                instruction.write = 0;
+                instruction.nextState = 0;
+            } else if (instruction.move == MOVE_HALT) {
+                instruction.nextState = (unsigned short)i;
+            } else {
+                instruction.nextState = (unsigned short)(instruction.nextState == tm->endState ? numClasses
+                                                         : newNumber[classes[instruction.nextState]]);
+            }
+            instructions[(long)i * alphabetSize + column] = instruction;
+        }
+    }
+    originalStates[numClasses] = tm->originalStates != NULL ? tm->originalStates[tm->endState] : tm->endState;
+
+    if (tm->image != NULL) {
+        // the old table lived in the image, which holds nothing else the run needs
+        munmap(tm->image, tm->imageSize);
+        tm->image = NULL;
+    } else {
+        free(table->instructions);
+    }
+    free(tm->originalStates);
+    table->instructions = instructions;
+    table->numStates = numClasses;
+    markSweeps(table);
+    tm->startState = newNumber[classes[tm->startState]];
+    tm->endState = numClasses;
+    tm->originalStates = originalStates;
+
+    free(buffers);
+    free(executions);
+    free(heat);
+    return stats;
+}
+#endif
+
+// Sparse tape - the tape is split into pages, and only pages holding some symbol other than a blank are kept,
+// in a page table keyed by page number; a page is freed once its last non blank cell is blanked again and the
+// head has left it, so a head wandering far over blank cells costs no memory beyond the visited range it reports
+#define SPARSE_PAGE_BITS 12
+#define SPARSE_PAGE_SIZE (1L << SPARSE_PAGE_BITS)
+
+struct SparsePage {
+    long number;                // page of the cells from number * SPARSE_PAGE_SIZE on
+    long used;                  // cells that are not blank
+    struct SparsePage* next;    // chain of its bucket in the page table
+    char cells[SPARSE_PAGE_SIZE];
+};
+
+struct SparseTape {
+    struct SparsePage** buckets;    // page table, a hash table of the kept pages
+    long numBuckets;                // power of two
+    long numPages;                  // pages kept
+    long peakPages;                 // most pages kept at once
+    struct SparsePage* spare;       // blank page kept for reuse, so a page that is emptied and refilled costs no allocation
+    long left;                      // leftmost cell visited, positions are relative to the 'A' cell
+    long right;                     // rightmost cell visited
+};
+
+// Page number of a position, rounding down for negative positions
+static inline long pageOf(long position) {
+    return position >= 0 ? position / SPARSE_PAGE_SIZE : -((-position - 1) / SPARSE_PAGE_SIZE) - 1;
+}
+
+static struct SparsePage* findPage(const struct SparseTape* sparse, long number) {
+    struct SparsePage* page = sparse->buckets[mixHash((uint64_t)number) & (sparse->numBuckets - 1)];
+    while (page != NULL && page->number != number) {
+        page = page->next;
+    }
+    return page;
+}
+
+// Function to add a blank page to the page table, doubling the buckets when there are more pages than buckets
+// Returns NULL when there is no memory for the page - without memory for more buckets the chains just get longer
+static struct SparsePage* addPage(struct SparseTape* sparse, long number) {
+    struct SparsePage* page = sparse->spare;
+    if (page != NULL) {
+        sparse->spare = NULL;
+    } else {
+        page = (struct SparsePage*)malloc(sizeof(struct SparsePage));
+        if (page == NULL) {
+            return NULL;
+        }
+        memset(page->cells, BLANK, SPARSE_PAGE_SIZE);
+    }
+    page->number = number;
+    page->used = 0;
+    struct SparsePage** buckets = NULL;
+    if (++sparse->numPages > sparse->numBuckets) {
+        buckets = (struct SparsePage**)calloc(sparse->numBuckets * 2, sizeof(struct SparsePage*));
+    }
+    if (buckets != NULL) {
+        long numBuckets = sparse->numBuckets * 2;
+        for (long i = 0; i < sparse->numBuckets; i++) {
+            struct SparsePage* chain = sparse->buckets[i];
+            while (chain != NULL) {
+                struct SparsePage* following = chain->next;
+                long bucket = (long)(mixHash((uint64_t)chain->number) & (numBuckets - 1));
+                chain->next = buckets[bucket];
+                buckets[bucket] = chain;
+                chain = following;
+            }
+        }
+        free(sparse->buckets);
+        sparse->buckets = buckets;
+        sparse->numBuckets = numBuckets;
+    }
+    struct SparsePage** bucket = &sparse->buckets[mixHash((uint64_t)number) & (sparse->numBuckets - 1)];
+    page->next = *bucket;
+    *bucket = page;
+    if (sparse->numPages > sparse->peakPages) {
+        sparse->peakPages = sparse->numPages;
+    }
+    return page;
+}
+
+static void removePage(struct SparseTape* sparse, struct SparsePage* page) {
+    struct SparsePage** link = &sparse->buckets[mixHash((uint64_t)page->number) & (sparse->numBuckets - 1)];
+    while (*link != page) {
+        link = &(*link)->next;
+    }
+    *link = page->next;
+    sparse->numPages--;
+    // the page is all blanks, ready for reuse
+    if (sparse->spare == NULL) {
+        sparse->spare = page;
+    } else {
+        free(page);
+    }
+}
+
+static void freeSparseTape(struct SparseTape* sparse) {
+    for (long i = 0; i < sparse->numBuckets; i++) {
+        struct SparsePage* page = sparse->buckets[i];
+        while (page != NULL) {
+            struct SparsePage* following = page->next;
+            free(page);
+            page = following;
+        }
+    }
+    free(sparse->spare);
+    free(sparse->buckets);
+    free(sparse);
+}
+
+#ifndef TM_LIBRARY
+// Function to make a sparse tape holding the cells of a tape - returns NULL when there is no memory for it
+static struct SparseTape* makeSparseTape(const struct Tape* tape) {
+    struct SparseTape* sparse = (struct SparseTape*)calloc(1, sizeof(struct SparseTape));
+    if (sparse == NULL) {
+        return NULL;
+    }
+    sparse->numBuckets = 64;
+    sparse->buckets = (struct SparsePage**)calloc(sparse->numBuckets, sizeof(struct SparsePage*));
+    if (sparse->buckets == NULL) {
+        free(sparse);
+        return NULL;
+    }
+    sparse->left = tape->left - tape->origin;
+    sparse->right = tape->right - tape->origin;
+    struct SparsePage* page = NULL;
+    for (long position = sparse->left; position <= sparse->right; position++) {
+        char symbol = tape->cells[tape->origin + position];
+        if (symbol == BLANK) {
+            continue;
+        }
+        if (page == NULL || page->number != pageOf(position)) {
+            page = findPage(sparse, pageOf(position));
+            if (page == NULL) {
+                page = addPage(sparse, pageOf(position));
+            }
+            if (page == NULL) {
+                freeSparseTape(sparse);
+                return NULL;
+            }
+        }
+        page->cells[position - page->number * SPARSE_PAGE_SIZE] = symbol;
+        page->used++;
+    }
+    return sparse;
+}
+#endif
+
+// Function to find the end of a run of symbol starting at from and going in direction, without passing to
+// Pages that are not kept hold blanks, so a run of blanks skips them whole
+static long sparseRun(const struct SparseTape* sparse, long from, long to, char symbol, int direction) {
+    long position = from;
+    while (direction == MOVE_RIGHT ? position <= to : position >= to) {
+        long number = pageOf(position);
+        long pageStart = number * SPARSE_PAGE_SIZE;
+        const struct SparsePage* page = findPage(sparse, number);
+        long end;
+        if (direction == MOVE_RIGHT) {
+            long last = pageStart + SPARSE_PAGE_SIZE - 1 < to ? pageStart + SPARSE_PAGE_SIZE - 1 : to;
+            if (page != NULL) {
+                end = pageStart + scanRight(page->cells, position - pageStart, last - pageStart, symbol);
+            } else {
+                end = symbol == BLANK ? last + 1 : position;
+            }
+            if (end <= last) {
+                return end;
+            }
+        } else {
+            long last = pageStart > to ? pageStart : to;
+            if (page != NULL) {
+                end = pageStart + scanLeft(page->cells, position - pageStart, last - pageStart, symbol);
+            } else {
+                end = symbol == BLANK ? last - 1 : position;
+            }
+            if (end >= last) {
+                return end;
+            }
+        }
+        position = end;
+    }
+    return position;
+}
+
+// Interpreter over a sparse tape - same steps as interpretTM, with the page of the head looked up whenever the
+// head leaves it; writing a symbol other than a blank is what makes a page kept
+static void sparseTM(struct TuringMachine* tm) {
+    struct SparseTape* sparse = tm->sparse;
+    long position = tm->startHead;
+    long pageStart = pageOf(position) * SPARSE_PAGE_SIZE;
+    struct SparsePage* page = findPage(sparse, pageOf(position));
+    int currentState = tm->startState;
+    int endState = tm->endState;
+    const struct Instruction* instructions = tm->transitions.instructions;
+    const unsigned char* symbolIndex = tm->transitions.symbolIndex;
+    int alphabetSize = tm->transitions.alphabetSize;
+    long long steps = tm->startSteps;
+    long long maxSteps = tm->maxSteps > 0 ? tm->maxSteps : LLONG_MAX;
+    double start = tm->maxSeconds > 0 ? now() : 0;
+    int reason = -1;
+
+    while (reason < 0) {
+        long long sliceEnd = maxSteps;
+        if (tm->maxSeconds > 0 && maxSteps - steps > TIME_CHECK_INTERVAL) {
+            sliceEnd = steps + TIME_CHECK_INTERVAL;
+        }
+
+        while (steps < sliceEnd) {
+            if (currentState == endState) {
+                reason = RUN_HALTED;
+                break;
+            }
+            long offset = position - pageStart;
+            char read = page != NULL ? page->cells[offset] : BLANK;
+            struct Instruction instruction = instructions[currentState * alphabetSize + symbolIndex[(unsigned char)read]];
+            if (instruction.move == MOVE_NONE) {
+                reason = RUN_UNDEFINED;
+                break;
+            }
+            steps++;
+
+            // keep the count of non blank cells of the page, it goes when the head leaves it empty
+            if (instruction.write != read) {
+                if (page == NULL && (page = addPage(sparse, pageOf(position))) == NULL) {
+                    reason = RUN_OUT_OF_MEMORY;
+                    break;
+                }
+                page->cells[offset] = instruction.write;
+                if (read == BLANK) {
+                    page->used++;
+                } else if (instruction.write == BLANK) {
+                    page->used--;
+                }
+            }
+
+            if (instruction.move == MOVE_LEFT) {
+                position--;
+            } else if (instruction.move == MOVE_RIGHT) {
+                position++;
+            } else if (instruction.move == MOVE_SWEEP_RIGHT) {
+                // skip to the last cell of the run inside the visited region, as interpretTM does
+                long to = sparse->right;
+                if (to - position > sliceEnd - steps) {
+                    to = position + (long)(sliceEnd - steps);
+                }
+                long end = sparseRun(sparse, position, to, instruction.write, MOVE_RIGHT);
+                steps += end - 1 - position;
+                position = end;
+            } else if (instruction.move == MOVE_SWEEP_LEFT) {
+                long to = sparse->left;
+                if (position - to > sliceEnd - steps) {
+                    to = position - (long)(sliceEnd - steps);
+                }
+                long end = sparseRun(sparse, position, to, instruction.write, MOVE_LEFT);
+                steps += position - (end + 1);
+                position = end;
+            } else {
+                reason = RUN_NO_MOVE;
+                break;
+            }
+            if (position < sparse->left) {
+                sparse->left = position;
+            } else if (position > sparse->right) {
+                sparse->right = position;
+            }
+            if (position < pageStart || position >= pageStart + SPARSE_PAGE_SIZE) {
+                if (page != NULL && page->used == 0) {
+                    removePage(sparse, page);
+                }
+                pageStart = pageOf(position) * SPARSE_PAGE_SIZE;
+                page = findPage(sparse, pageOf(position));
+            }
+            currentState = instruction.nextState;
+        }
+
+        if (reason < 0 && currentState == endState) {
+            reason = RUN_HALTED;
+        } else if (reason < 0 && steps >= maxSteps) {
+            reason = RUN_STEP_LIMIT;
+        } else if (reason < 0 && now() - start >= tm->maxSeconds) {
+            reason = RUN_TIME_LIMIT;
+        }
+    }
+
+    if (page != NULL && page->used == 0) {
+        removePage(sparse, page);
+    }
+
+    struct RunResult* result = &tm->result;
+    result->reason = reason;
+    result->finalState = currentState;
+    result->steps = steps;
+    result->head = position;
+    result->leftmost = sparse->left;
+    result->rightmost = sparse->right;
+    result->cellsTouched = sparse->right - sparse->left + 1;
+}
+
+#ifndef TM_LIBRARY
+// Function to find the cells of the sparse tape to output, like tapeBounds - when trimming, the first and last
+// non blank cells are on kept pages
+static void sparseBounds(const struct SparseTape* sparse, int flags, long* first, long* last) {
+    *first = sparse->left;
+    *last = sparse->right;
+    if (flags & OUTPUT_TRIM) {
+        long lowest = LONG_MAX, highest = LONG_MIN;
+        for (long i = 0; i < sparse->numBuckets; i++) {
+            for (const struct SparsePage* page = sparse->buckets[i]; page != NULL; page = page->next) {
+                long cell = scanRight(page->cells, 0, SPARSE_PAGE_SIZE - 1, BLANK);
+                if (cell < SPARSE_PAGE_SIZE) {
+                    long position = page->number * SPARSE_PAGE_SIZE;
+                    lowest = position + cell < lowest ? position + cell : lowest;
+                    cell = scanLeft(page->cells, SPARSE_PAGE_SIZE - 1, cell, BLANK);
+                    highest = position + cell > highest ? position + cell : highest;
+                }
+            }
+        }
+        *first = lowest > *first ? lowest : *first;
+        *last = highest < *last ? highest : *last;
+        if (*first > *last) {
+            *last = *first - 1;
+        }
+    }
+}
+
+// Function to compare the output cells of the sparse tape with the expected tape, like compareTape - a page
+// at a time, the pages that were never kept compare as blank cells
+static long compareSparseTape(const struct SparseTape* sparse, int flags, const char* expected, long length) {
+    long first, last;
+    sparseBounds(sparse, flags, &first, &last);
+    char blanks[SPARSE_PAGE_SIZE];
+    memset(blanks, BLANK, SPARSE_PAGE_SIZE);
+    long cells = last - first + 1;
+    long common = cells < length ? cells : length;
+    for (long offset = 0; offset < common; ) {
+        long position = first + offset;
+        long pageStart = pageOf(position) * SPARSE_PAGE_SIZE;
+        long count = pageStart + SPARSE_PAGE_SIZE - position < common - offset
+                     ? pageStart + SPARSE_PAGE_SIZE - position : common - offset;
+        const struct SparsePage* page = findPage(sparse, pageOf(position));
+        long mismatch = findMismatch(page != NULL ? page->cells + (position - pageStart) : blanks,
+                                     expected + offset, count);
+        if (mismatch < count) {
+            return offset + mismatch;
+        }
+        offset += count;
+    }
+    return cells != length ? common : -1;
+}
+
+// Function to write a sparse tape like writeTape - pages that are not kept go out as blanks
+static int writeSparseTape(const struct SparseTape* sparse, int fd, int flags) {
+    long first, last;
+    sparseBounds(sparse, flags, &first, &last);
+
+    char blanks[SPARSE_PAGE_SIZE];
+    memset(blanks, BLANK, SPARSE_PAGE_SIZE);
+    struct iovec parts[65];
+    int numParts = 0;
+    long position = first;
+    while (position <= last) {
+        long pageStart = pageOf(position) * SPARSE_PAGE_SIZE;
+        long end = pageStart + SPARSE_PAGE_SIZE - 1 < last ? pageStart + SPARSE_PAGE_SIZE - 1 : last;
+        const struct SparsePage* page = findPage(sparse, pageOf(position));
+        parts[numParts].iov_base = (char*)(page != NULL ? page->cells + (position - pageStart) : blanks);
+        parts[numParts].iov_len = (size_t)(end - position + 1);
+        numParts++;
+        position = end + 1;
+        if (numParts == 64 || position > last) {
+            if (position > last && !(flags & OUTPUT_RAW)) {
+                parts[numParts].iov_base = "\n";
+                parts[numParts].iov_len = 1;
+                numParts++;
+            }
+            if (writeParts(fd, parts, numParts) != 0) {
+                return -1;
+            }
+            numParts = 0;
+        }
+    }
+    if (first > last && !(flags & OUTPUT_RAW)) {
+        return write(fd, "\n", 1) == 1 ? 0 : -1;
+    }
+    return 0;
+}
+#endif
+
+// Macro machine - the tape is read as blocks of blockSize cells, and the machine as one whose steps take the head
+// across a whole block: from the state and the cell the head enters a block on, and the block's cells, the base
+// machine is run inside the block until the head leaves it, the run stops or MACRO_STEP_LIMIT steps pass
+// The outcome of each such macro step is computed the first time it is needed and kept in a hash table, so a
+// machine that crosses the same blocks in the same states over and over advances a block per table lookup
+// Base steps are still counted exactly, and a macro step that would overrun the step budget is run base step by step
+#define MAX_MACRO_BLOCK 8                   // cells per block - a block is packed into 64 bits
+#define MACRO_STEP_LIMIT 65536              // base steps one macro step runs inside a block at most
+#define MACRO_MAX_ENTRIES (1 << 22)         // the table is emptied when it reaches this many entries
+#define MACRO_LEFT 0                        // how a macro step ends: the head left the block on the left
+#define MACRO_RIGHT 1                       // or on the right
+#define MACRO_INSIDE 2                      // MACRO_STEP_LIMIT steps ran without the head leaving the block
+#define MACRO_STOPPED 3                     // the run stopped inside the block, reason holds why
+
+// Outcome of a macro step from a state, a cell and the contents of a block
+struct MacroEntry {
+    uint64_t block;         // block the step starts on
+    uint64_t written;       // block the step leaves behind
+    uint32_t key;           // state and cell the step starts from, 0 for a free entry
+    uint32_t steps;         // base steps taken
+    uint16_t state;         // state at the end of the step
+    signed char offset;     // cell of the head at the end, -1 or blockSize when it left the block
+    unsigned char exit;     // one of the MACRO_ codes
+    unsigned char reason;   // RUN_ code of a MACRO_STOPPED step
+    unsigned char lowest;   // leftmost and rightmost cell of the block the head was on
+    unsigned char highest;
+};
+
+struct MacroMachine {
+    int blockSize;
+    struct MacroEntry* entries;     // open addressing, capacity a power of two
+    long capacity;
+    long count;
+    long long macroSteps;           // macro steps taken by the run
+    long long computed;             // macro steps computed rather than looked up
+};
+
+#ifndef TM_LIBRARY
+// Function to create the macro machine for blocks of blockSize cells - returns NULL when there is no memory for it
+static struct MacroMachine* makeMacroMachine(int blockSize) {
+    struct MacroMachine* macro = (struct MacroMachine*)calloc(1, sizeof(struct MacroMachine));
+    if (macro == NULL) {
+        return NULL;
+    }
+    macro->blockSize = blockSize;
+    macro->capacity = 1024;
+    macro->entries = (struct MacroEntry*)calloc(macro->capacity, sizeof(struct MacroEntry));
+    if (macro->entries == NULL) {
+        free(macro);
+        return NULL;
+    }
+    return macro;
+}
+#endif
+
+static void freeMacroMachine(struct MacroMachine* macro) {
+    free(macro->entries);
+    free(macro);
+}
+
+static long macroSlot(const struct MacroMachine* macro, uint64_t block, uint32_t key) {
+    return (long)(mixHash(block ^ ((uint64_t)key << 40 | key)) & (uint64_t)(macro->capacity - 1));
+}
+
+// Function to run the base machine inside one block, for at most limit steps
+static void macroRun(const struct TuringMachine* tm, int blockSize, int state, int offset, uint64_t block,
+                     long long limit, struct MacroEntry* entry) {
+    const struct Instruction* instructions = tm->transitions.instructions;
+    const unsigned char* symbolIndex = tm->transitions.symbolIndex;
+    int alphabetSize = tm->transitions.alphabetSize;
+    char cells[MAX_MACRO_BLOCK];
+    memcpy(cells, &block, sizeof(cells));
+    long long steps = 0;
+    int lowest = offset, highest = offset;
+    entry->exit = MACRO_INSIDE;
+    while (1) {
+        if (state == tm->endState) {
+            entry->exit = MACRO_STOPPED;
+            entry->reason = RUN_HALTED;
+            break;
+        }
+        if (steps == limit) {
+            break;
+        }
+        struct Instruction instruction = instructions[state * alphabetSize + symbolIndex[(unsigned char)cells[offset]]];
+        if (instruction.move == MOVE_NONE) {
+            entry->exit = MACRO_STOPPED;
+            entry->reason = RUN_UNDEFINED;
+            break;
+        }
+        steps++;
+        cells[offset] = instruction.write;
+        if (instruction.move == MOVE_LEFT || instruction.move == MOVE_SWEEP_LEFT) {
+            offset--;
+        } else if (instruction.move == MOVE_RIGHT || instruction.move == MOVE_SWEEP_RIGHT) {
+            offset++;
+        } else {
+            entry->exit = MACRO_STOPPED;
+            entry->reason = RUN_NO_MOVE;
+            break;
+        }
+        state = instruction.nextState;
+        if (offset < 0 || offset >= blockSize) {
+            entry->exit = offset < 0 ? MACRO_LEFT : MACRO_RIGHT;
+            break;
+        }
+        lowest = offset < lowest ? offset : lowest;
+        highest = offset > highest ? offset : highest;
+    }
+    memcpy(&entry->written, cells, sizeof(cells));
+    entry->steps = (uint32_t)steps;
+    entry->state = (uint16_t)state;
+    entry->offset = (signed char)offset;
+    entry->lowest = (unsigned char)lowest;
+    entry->highest = (unsigned char)highest;
+}
+
+// Function to find the macro step from a state, a cell and a block, computing it the first time
+static const struct MacroEntry* macroStep(struct MacroMachine* macro, const struct TuringMachine* tm, int state,
+                                          int offset, uint64_t block) {
+    // keys start from 1 so that 0 marks a free entry
+    uint32_t key = ((uint32_t)state << 3 | (uint32_t)offset) + 1;
+    long slot = macroSlot(macro, block, key);
+    while (macro->entries[slot].key != 0) {
+        if (macro->entries[slot].key == key && macro->entries[slot].block == block) {
+            return &macro->entries[slot];
+        }
+        slot = (slot + 1) & (macro->capacity - 1);
+    }
+
+    if (macro->count * 2 >= macro->capacity) {
+        struct MacroEntry* entries = NULL;
+        if (macro->capacity < MACRO_MAX_ENTRIES) {
+            entries = (struct MacroEntry*)calloc(macro->capacity * 2, sizeof(struct MacroEntry));
+        }
+        if (entries == NULL) {
+            // full, or no memory to grow - start over, the steps still needed come back quickly
+            memset(macro->entries, 0, macro->capacity * sizeof(struct MacroEntry));
+            macro->count = 0;
+        } else {
+            struct MacroEntry* old = macro->entries;
+            long oldCapacity = macro->capacity;
+            macro->capacity *= 2;
+            macro->entries = entries;
+            for (long i = 0; i < oldCapacity; i++) {
+                if (old[i].key != 0) {
+                    long moved = macroSlot(macro, old[i].block, old[i].key);
+                    while (macro->entries[moved].key != 0) {
+                        moved = (moved + 1) & (macro->capacity - 1);
+                    }
+                    macro->entries[moved] = old[i];
+                }
+            }
+            free(old);
+        }
+        slot = macroSlot(macro, block, key);
+        while (macro->entries[slot].key != 0) {
+            slot = (slot + 1) & (macro->capacity - 1);
+        }
+    }
+
+    struct MacroEntry* entry = &macro->entries[slot];
+    macroRun(tm, macro->blockSize, state, offset, block, MACRO_STEP_LIMIT, entry);
+    entry->block = block;
+    entry->key = key;
+    macro->count++;
+    macro->computed++;
+    return entry;
+}
+
+// Function to grow the tape buffer until it holds the cells from first to last (positions)
+// Returns -1 when there is no memory for them
+static int macroCover(struct Tape* tape, long first, long last) {
+    while (tape->origin + first < 0) {
+        if (growTape(tape, 1) < 0) {
+            return -1;
+        }
+    }
+    while (tape->origin + last >= tape->capacity) {
+        if (growTape(tape, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to count the copies of the block at cells that follow it on the right, up to limit copies
+static long long macroCopiesRight(const char* cells, int blockSize, long long limit) {
+    return findMismatch(cells + blockSize, cells, (long)limit * blockSize) / blockSize;
+}
+
+// Function to count the copies of the block at cells that precede it on the left, up to limit copies
+// A block of a single symbol is a run of it, found like the sweeps of the interpreter
+static long long macroCopiesLeft(const char* cells, int blockSize, long long limit) {
+    if (scanRight(cells, 1, blockSize - 1, cells[0]) == blockSize) {
+        return (-1 - scanLeft(cells, -1, -(long)limit * blockSize, cells[0])) / blockSize;
+    }
+    long long copies = 0;
+    while (copies < limit && memcmp(cells - (copies + 1) * blockSize, cells, blockSize) == 0) {
+        copies++;
+    }
+    return copies;
+}
+
+// Macro machine engine - runs the machine a block at a time on its dense tape
+static void macroTM(struct TuringMachine* tm) {
+    struct MacroMachine* macro = tm->macro;
+    struct Tape* tape = &tm->tape;
+    int blockSize = macro->blockSize;
+    long position = tm->startHead;      // head position, relative to the 'A' cell
+    int currentState = tm->startState;
+    long long steps = tm->startSteps;
+    long long maxSteps = tm->maxSteps > 0 ? tm->maxSteps : LLONG_MAX;
+    double start = tm->maxSeconds > 0 ? now() : 0;
+    int reason = -1;
+
+    while (reason < 0) {
+        long long sliceEnd = maxSteps;
+        if (tm->maxSeconds > 0 && maxSteps - steps > TIME_CHECK_INTERVAL) {
+            sliceEnd = steps + TIME_CHECK_INTERVAL;
+        }
+
+        while (steps < sliceEnd) {
+            if (currentState == tm->endState) {
+                reason = RUN_HALTED;
+                break;
+            }
+            // blocks are aligned on the 'A' cell
+            long blockStart = (position >= 0 ? position / blockSize : -((-position - 1) / blockSize) - 1) * blockSize;
+            if (macroCover(tape, blockStart, blockStart + blockSize - 1) != 0) {
+                reason = RUN_OUT_OF_MEMORY;
+                break;
+            }
+            char* cells = tape->cells + tape->origin + blockStart;
+            uint64_t block = 0;
+            memcpy(&block, cells, blockSize);
+            int offset = (int)(position - blockStart);
+
+            struct MacroEntry local;
+            const struct MacroEntry* entry = macroStep(macro, tm, currentState, offset, block);
+            if (entry->steps > sliceEnd - steps ||
+                (entry->steps == sliceEnd - steps && entry->exit == MACRO_STOPPED && entry->reason == RUN_UNDEFINED)) {
+                // the budget ends inside this macro step, or right before its missing rule is looked up
+                // - take only the steps that are left
+                macroRun(tm, blockSize, currentState, offset, block, sliceEnd - steps, &local);
+                entry = &local;
+            } else if (entry->written == block && entry->state == currentState
+                       && ((entry->exit == MACRO_RIGHT && offset == 0)
+                           || (entry->exit == MACRO_LEFT && offset == blockSize - 1))) {
+                // the step crosses the block unchanged and leaves it in the state it entered it, so it crosses
+                // every following copy of the block the same way - the copies are skipped at once, like a sweep
+                // of the interpreter, as far as the buffer and the budget go
+                long long copies = (sliceEnd - steps) / entry->steps - 1;
+                long long skipped;
+                if (entry->exit == MACRO_RIGHT) {
+                    long room = (tape->capacity - (tape->origin + blockStart)) / blockSize - 1;
+                    skipped = macroCopiesRight(cells, blockSize, copies < room ? copies : room);
+                    blockStart += skipped * blockSize;
+                } else {
+                    long room = (tape->origin + blockStart) / blockSize;
+                    skipped = macroCopiesLeft(cells, blockSize, copies < room ? copies : room);
+                    blockStart -= skipped * blockSize;
+                }
+                cells = tape->cells + tape->origin + blockStart;
+                macro->macroSteps += skipped;
+                steps += skipped * entry->steps;
+            }
+            macro->macroSteps++;
+            steps += entry->steps;
+            memcpy(cells, &entry->written, blockSize);
+            currentState = entry->state;
+            position = blockStart + entry->offset;
+            if (macroCover(tape, position, position) != 0) {
+                reason = RUN_OUT_OF_MEMORY;
+                break;
+            }
+            if (tape->origin + blockStart + entry->lowest < tape->left) {
+                tape->left = tape->origin + blockStart + entry->lowest;
+            }
+            if (tape->origin + blockStart + entry->highest > tape->right) {
+                tape->right = tape->origin + blockStart + entry->highest;
+            }
+            if (tape->origin + position < tape->left) {
+                tape->left = tape->origin + position;
+            }
+            if (tape->origin + position > tape->right) {
+                tape->right = tape->origin + position;
+            }
+            if (entry->exit == MACRO_STOPPED) {
+                reason = entry->reason;
+                break;
+            }
+        }
+
+        if (reason < 0 && currentState == tm->endState) {
+            reason = RUN_HALTED;
+        } else if (reason < 0 && steps >= maxSteps) {
+            reason = RUN_STEP_LIMIT;
+        } else if (reason < 0 && now() - start >= tm->maxSeconds) {
+            reason = RUN_TIME_LIMIT;
+        }
+    }
+
+    finishRun(tm, reason, currentState, steps, tape->origin + position);
+}
+
+// Threaded code engine - every (state, symbol) entry jumps straight to a handler for its kind of move,
+// using computed goto where the compiler supports it and a switch otherwise
+// Called with tm NULL it only resolves the handler addresses of a freshly compiled program
+static void threadedEngine(struct TuringMachine* tm, struct ThreadedProgram* program) {
+#ifdef __GNUC__
+    static const void* const handlers[NUM_OPS] = {
+        &&op_end, &&op_undefined, &&op_no_move, &&op_left, &&op_right, &&op_sweep_left, &&op_sweep_right
+    };
+#define DISPATCH() goto *op->handler
+#else
+    static const void* const handlers[NUM_OPS] = { NULL };
+#define DISPATCH() goto dispatch
+#endif
+    if (tm == NULL) {
+        long numOps = (long)(program->numStates + 1) * program->alphabetSize;
+        for (long i = 0; i < numOps; i++) {
+            program->rows[i].handler = handlers[program->rows[i].code];
+        }
+        return;
+    }
+
+    // the visited region is kept in locals and only written back to the tape when the buffer grows
+    struct Tape* tape = &tm->tape;
+    char* cells = tape->cells;
+    long left = tape->left;
+    long right = tape->right;
+    long head = tape->origin + tm->startHead;
+    const unsigned char* symbolIndex = tm->transitions.symbolIndex;
+    const struct ThreadedOp* endRow = program->rows + (long)program->numStates * program->alphabetSize;
+    const struct ThreadedOp* row = tm->startState == tm->endState
+                                   ? endRow : program->rows + (long)tm->startState * program->alphabetSize;
+    const struct ThreadedOp* op;
+    long long steps = tm->startSteps;
+    long long maxSteps = tm->maxSteps > 0 ? tm->maxSteps : LLONG_MAX;
+    long long sliceEnd;
+    double start = tm->maxSeconds > 0 ? now() : 0;
+    int reason;
+
+// Read the symbol under the head and jump to the handler for it in the current row
+#define NEXT() \
+    if (steps >= sliceEnd) goto slice_done; \
+    op = row + symbolIndex[(unsigned char)cells[head]]; \
+    DISPATCH()
+
+// Move the head one cell, growing the buffer when it runs off an edge - same as moveLeft and moveRight
+#define STEP_LEFT() \
+    if (--head < left) { \
+        if (head < 0) { \
+            tape->left = left; \
+            tape->right = right; \
+            long shift = growTape(tape, 1); \
+            if (shift < 0) { \
+                head = 0; \
+                goto out_of_memory; \
+            } \
+            head += shift; \
+            cells = tape->cells; \
+            right = tape->right; \
+        } \
+        left = head; \
+    }
+#define STEP_RIGHT() \
+    if (++head > right) { \
+        if (head >= tape->capacity) { \
+            tape->left = left; \
+            tape->right = right; \
+            if (growTape(tape, 0) < 0) { \
+                head = tape->capacity - 1; \
+                goto out_of_memory; \
+            } \
+            cells = tape->cells; \
+            left = tape->left; \
+        } \
+        right = head; \
+    }
+
+slice_start:
+    // The run is split into slices so the time budget is checked outside the handlers
+    sliceEnd = maxSteps;
+    if (tm->maxSeconds > 0 && maxSteps - steps > TIME_CHECK_INTERVAL) {
+        sliceEnd = steps + TIME_CHECK_INTERVAL;
+    }
+    NEXT();
+
+#ifndef __GNUC__
+dispatch:
+    switch (op->code) {
+        case OP_END: goto op_end;
+        case OP_UNDEFINED: goto op_undefined;
+        case OP_NO_MOVE: goto op_no_move;
+        case OP_LEFT: goto op_left;
+        case OP_RIGHT: goto op_right;
+        case OP_SWEEP_LEFT: goto op_sweep_left;
+        default: goto op_sweep_right;
+    }
+#endif
+
+op_left:
+    steps++;
+    cells[head] = op->write;
+    STEP_LEFT();
+    row = op->next;
+    NEXT();
+
+op_right:
+    steps++;
+    cells[head] = op->write;
+    STEP_RIGHT();
+    row = op->next;
+    NEXT();
+
+op_sweep_left: {
+        // same as the interpreter - skip the whole run, but not past the end of the slice
+        steps++;
+        long to = left;
+        if (head - to > sliceEnd - steps) {
+            to = head - (long)(sliceEnd - steps);
+        }
+        long end = scanLeft(cells, head, to, op->write);
+        steps += head - (end + 1);
+        head = end + 1;
+        STEP_LEFT();
+        row = op->next;
+        NEXT();
+    }
+
+op_sweep_right: {
+        steps++;
+        long to = right;
+        if (to - head > sliceEnd - steps) {
+            to = head + (long)(sliceEnd - steps);
+        }
+        long end = scanRight(cells, head, to, op->write);
+        steps += end - 1 - head;
+        head = end - 1;
+        STEP_RIGHT();
+        row = op->next;
+        NEXT();
+    }
+
+op_no_move:
+    steps++;
+    cells[head] = op->write;
+    reason = RUN_NO_MOVE;
+    goto done;
+
+op_undefined:
+    reason = RUN_UNDEFINED;
+    goto done;
+
+op_end:
+    reason = RUN_HALTED;
+    goto done;
+
+out_of_memory:
+    reason = RUN_OUT_OF_MEMORY;
+    goto done;
+
+slice_done:
+    if (row == endRow) {
+        reason = RUN_HALTED;
+    } else if (steps >= maxSteps) {
+        reason = RUN_STEP_LIMIT;
+    } else if (now() - start >= tm->maxSeconds) {
+        reason = RUN_TIME_LIMIT;
+    } else {
+        goto slice_start;
+    }
+
+done:
+    tape->left = left;
+    tape->right = right;
+    finishRun(tm, reason, row == endRow ? tm->endState : (int)((row - program->rows) / program->alphabetSize),
+              steps, head);
+#undef NEXT
+#undef STEP_LEFT
+#undef STEP_RIGHT
+#undef DISPATCH
+}
+
+// Function to compile a transition table to threaded code - returns NULL when there is no memory for it
+static struct ThreadedProgram* compileThreaded(const struct TransitionTable* table, int endState) {
+    struct ThreadedProgram* program = (struct ThreadedProgram*)malloc(sizeof(struct ThreadedProgram));
+    long numOps = (long)(table->numStates + 1) * table->alphabetSize;
+    struct ThreadedOp* rows = (struct ThreadedOp*)malloc(numOps * sizeof(struct ThreadedOp));
+    if (program == NULL || rows == NULL) {
+        free(program);
+        free(rows);
+        return NULL;
+    }
+    program->rows = rows;
+    program->numStates = table->numStates;
+    program->alphabetSize = table->alphabetSize;
+    struct ThreadedOp* endRow = program->rows + (long)table->numStates * table->alphabetSize;
+
+    for (long i = 0; i < numOps; i++) {
+        struct ThreadedOp* op = &program->rows[i];
+        if (op >= endRow) {
+            op->code = OP_END;
+            op->write = 0;
+            op->next = endRow;
+            continue;
+        }
+        struct Instruction instruction = table->instructions[i];
+        // entering the end state goes to the end row, whatever the number of the end state
+        op->next = instruction.nextState == endState
+                   ? endRow : program->rows + (long)instruction.nextState * table->alphabetSize;
+        op->write = instruction.write;
+        switch (instruction.move) {
+            case MOVE_LEFT: op->code = OP_LEFT; break;
+            case MOVE_RIGHT: op->code = OP_RIGHT; break;
+            case MOVE_SWEEP_LEFT: op->code = OP_SWEEP_LEFT; break;
+            case MOVE_SWEEP_RIGHT: op->code = OP_SWEEP_RIGHT; break;
+            case MOVE_HALT: op->code = OP_NO_MOVE; break;
+            default: op->code = OP_UNDEFINED; op->next = endRow; break;
+        }
+    }
+
+    threadedEngine(NULL, program);
+    return program;
+}
+
+#ifdef HAVE_JIT
+
+// State of a native code run shared with the generated code - the generated code keeps the head, the visited
+// region and the remaining steps in registers and only stores them here when it exits or calls back into C
+// Tape positions are addresses of cells
+struct JitContext {
+    uintptr_t cells;            // first cell of the buffer
+    uintptr_t cellsEnd;         // one past the last cell of the buffer
+    uintptr_t head;
+    uintptr_t left;
+    uintptr_t right;
+    long long remaining;        // steps left in this slice
+    const unsigned char* symbolIndex;
+    const void* entry;          // code block of the state to start in
+    int reason;                 // one of the RUN_ codes, or JIT_SLICE_DONE
+    int state;                  // state the code stopped in
+    struct Tape* tape;
+};
+
+// Exit reason of the generated code when the steps of a slice run out
+#define JIT_SLICE_DONE (-1)
+
+// Native code for a machine - one block per state, each block reads the symbol under the head and jumps
+// through its own table to the code for that symbol, which writes, moves and jumps to the next state's block
+struct JitProgram {
+    unsigned char* code;        // mmap'd executable code
+    size_t size;
+    void (*run)(struct JitContext* context);
+    long* stateOffsets;         // offset of each state's block in code, the end state's block is the last one
+    int numStates;
+};
+
+// Code buffer the generator emits into before the code is copied to executable memory
+// Once the buffer cannot grow it is marked failed, later code is dropped and the compiler gives up at the end
+struct CodeBuffer {
+    unsigned char* bytes;
+    size_t size;
+    size_t capacity;
+    int failed;
+};
+
+static void emitBytes(struct CodeBuffer* buffer, const void* bytes, size_t count) {
+    if (buffer->failed) {
+        return;
+    }
+    if (buffer->size + count > buffer->capacity) {
+        size_t capacity = buffer->capacity;
+        while (buffer->size + count > capacity) {
+            capacity *= 2;
+        }
+        unsigned char* grown = (unsigned char*)realloc(buffer->bytes, capacity);
+        if (grown == NULL) {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->bytes = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->bytes + buffer->size, bytes, count);
+    buffer->size += count;
+}
+
+static void emit1(struct CodeBuffer* buffer, unsigned char byte) {
+    emitBytes(buffer, &byte, 1);
+}
+
+static void emit4(struct CodeBuffer* buffer, int value) {
+    emitBytes(buffer, &value, 4);
+}
+
+static void emit8(struct CodeBuffer* buffer, unsigned long long value) {
+    emitBytes(buffer, &value, 8);
+}
+
+// Patch a 32 bit displacement at offset so that it points at target
+static void patchRel32(struct CodeBuffer* buffer, size_t offset, size_t target) {
+    int displacement = (int)((long)target - (long)(offset + 4));
+    if (!buffer->failed) {
+        memcpy(buffer->bytes + offset, &displacement, 4);
+    }
+}
+
+// Emit a jump or call with a 32 bit displacement to a known offset
+static void emitRel32(struct CodeBuffer* buffer, unsigned char opcode, size_t target) {
+    emit1(buffer, opcode);
+    emit4(buffer, 0);
+    patchRel32(buffer, buffer->size - 4, target);
+}
+
+// mov [rbx + offset], reg and mov reg, [rbx + offset] for the registers the generated code keeps its state in
+// rex and modrm select the register, offsets into JitContext always fit in a byte
+static void emitStore(struct CodeBuffer* buffer, unsigned char rex, unsigned char modrm, size_t offset) {
+    unsigned char bytes[] = { rex, 0x89, modrm, (unsigned char)offset };
+    emitBytes(buffer, bytes, 4);
+}
+
+static void emitLoad(struct CodeBuffer* buffer, unsigned char rex, unsigned char modrm, size_t offset) {
+    unsigned char bytes[] = { rex, 0x8B, modrm, (unsigned char)offset };
+    emitBytes(buffer, bytes, 4);
+}
+
+// Register encodings used with emitStore and emitLoad
+#define R13_RBX 0x4C, 0x6B
+#define R14_RBX 0x4C, 0x73
+#define R15_RBX 0x4C, 0x7B
+#define RBP_RBX 0x48, 0x6B
+
+// Emit a call to a C function taking the context and one int - the stack must already be 16 byte aligned
+static void emitHelperCall(struct CodeBuffer* buffer, const void* function, int argument) {
+    emitBytes(buffer, "\x48\x89\xDF", 3);                     // mov rdi, rbx
+    emit1(buffer, 0xBE);                                        // mov esi, argument
+    emit4(buffer, argument);
+    emitBytes(buffer, "\x48\xB8", 2);                          // mov rax, function
+    emit8(buffer, (unsigned long long)(uintptr_t)function);
+    emitBytes(buffer, "\xFF\xD0", 2);                          // call rax
+}
+
+// Called by the generated code when the head runs off the buffer - grows the tape like moveLeft and moveRight
+// When it cannot grow the head stays on the edge and no steps are left, so the code exits at the next block
+static void jitGrow(struct JitContext* context, int towardsLeft) {
+    struct Tape* tape = context->tape;
+    long head = (long)(context->head - context->cells);
+    tape->left = (long)(context->left - context->cells);
+    tape->right = (long)(context->right - context->cells);
+    long shift = growTape(tape, towardsLeft);
+    if (shift < 0) {
+        head = towardsLeft ? 0 : tape->capacity - 1;
+        context->remaining = 0;
+    } else {
+        head += shift;
+    }
+    context->cells = (uintptr_t)tape->cells;
+    context->cellsEnd = context->cells + tape->capacity;
+    context->head = context->cells + head;
+    context->left = context->cells + tape->left;
+    context->right = context->cells + tape->right;
+}
+
+// Called by the generated code for a sweep - same as the interpreter, moves the head to the last cell of the
+// run, without passing the visited region or the steps left in the slice
+static void jitSweepLeft(struct JitContext* context, int symbol) {
+    long head = (long)(context->head - context->cells);
+    long to = (long)(context->left - context->cells);
+    if (head - to > context->remaining) {
+        to = head - (long)context->remaining;
+    }
+    long end = scanLeft((const char*)context->cells, head, to, (char)symbol);
+    context->remaining -= head - (end + 1);
+    context->head = context->cells + end + 1;
+}
+
+static void jitSweepRight(struct JitContext* context, int symbol) {
+    long head = (long)(context->head - context->cells);
+    long to = (long)(context->right - context->cells);
+    if (to - head > context->remaining) {
+        to = head + (long)context->remaining;
+    }
+    long end = scanRight((const char*)context->cells, head, to, (char)symbol);
+    context->remaining -= end - 1 - head;
+    context->head = context->cells + end - 1;
+}
+
+// Emit the code that stores the registers and returns - eax holds the reason and edx the state
+static void emitExit(struct CodeBuffer* buffer) {
+    emitStore(buffer, R13_RBX, offsetof(struct JitContext, head));
+    emitStore(buffer, R14_RBX, offsetof(struct JitContext, left));
+    emitStore(buffer, R15_RBX, offsetof(struct JitContext, right));
+    emitStore(buffer, RBP_RBX, offsetof(struct JitContext, remaining));
+    emitBytes(buffer, "\x89\x43", 2);                          // mov [rbx + reason], eax
+    emit1(buffer, (unsigned char)offsetof(struct JitContext, reason));
+    emitBytes(buffer, "\x89\x53", 2);                          // mov [rbx + state], edx
+    emit1(buffer, (unsigned char)offsetof(struct JitContext, state));
+    emitBytes(buffer, "\x48\x83\xC4\x08", 4);                  // add rsp, 8
+    emitBytes(buffer, "\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5D\x5B", 10);   // pop r15, r14, r13, r12, rbp, rbx
+    emit1(buffer, 0xC3);                                        // ret
+}
+
+// Emit a subroutine that records a new leftmost or rightmost cell, growing the buffer first when the head has
+// run off it - called with the stack 8 bytes off alignment
+static void emitExtend(struct CodeBuffer* buffer, int towardsLeft) {
+    // cmp r13, [rbx + cells] / [rbx + cellsEnd], skip the growing when the head is still inside the buffer
+    emitBytes(buffer, "\x4C\x3B\x6B", 3);
+    emit1(buffer, (unsigned char)(towardsLeft ? offsetof(struct JitContext, cells) : offsetof(struct JitContext, cellsEnd)));
+    emit1(buffer, towardsLeft ? 0x73 : 0x72);                   // jae / jb over the growing code
+    size_t skip = buffer->size;
+    emit1(buffer, 0);
+
+    emitStore(buffer, R13_RBX, offsetof(struct JitContext, head));
+    emitStore(buffer, R14_RBX, offsetof(struct JitContext, left));
+    emitStore(buffer, R15_RBX, offsetof(struct JitContext, right));
+    emitStore(buffer, RBP_RBX, offsetof(struct JitContext, remaining));
+    emitBytes(buffer, "\x48\x83\xEC\x08", 4);                  // sub rsp, 8
+    emitHelperCall(buffer, (const void*)jitGrow, towardsLeft);
+    emitBytes(buffer, "\x48\x83\xC4\x08", 4);                  // add rsp, 8
+    emitLoad(buffer, R13_RBX, offsetof(struct JitContext, head));
+    emitLoad(buffer, R14_RBX, offsetof(struct JitContext, left));
+    emitLoad(buffer, R15_RBX, offsetof(struct JitContext, right));
+    emitLoad(buffer, RBP_RBX, offsetof(struct JitContext, remaining));
+    if (!buffer->failed) {
+        buffer->bytes[skip] = (unsigned char)(buffer->size - skip - 1);
+    }
+
+    emitBytes(buffer, towardsLeft ? "\x4D\x89\xEE" : "\x4D\x89\xEF", 3);  // mov r14, r13 / mov r15, r13
+    emit1(buffer, 0xC3);                                        // ret
+}
+
+// Function to compile a transition table to native code - returns NULL with *error set to TM_ERROR_UNSUPPORTED
+// when the machine is too big for it, or to TM_ERROR_MEMORY when there is no memory for the code
+static struct JitProgram* compileJit(const struct TransitionTable* table, int endState, int* error) {
+    int numStates = table->numStates;
+    int alphabetSize = table->alphabetSize;
+    struct CodeBuffer buffer;
+    buffer.capacity = 4096 + (size_t)numStates * alphabetSize * 48;
+    buffer.size = 0;
+    buffer.failed = 0;
+    buffer.bytes = (unsigned char*)malloc(buffer.capacity);
+
+    // offsets of every state's block plus the end state's block, and of the jumps that still need them
+    long* stateOffsets = (long*)malloc((numStates + 1) * sizeof(long));
+    int numFixups = 0, fixupsCapacity = 1024;
+    long* fixupOffsets = (long*)malloc(fixupsCapacity * sizeof(long));
+    int* fixupStates = (int*)malloc(fixupsCapacity * sizeof(int));
+    long* tableEntries = (long*)malloc(alphabetSize * sizeof(long));
+    if (buffer.bytes == NULL || stateOffsets == NULL || fixupOffsets == NULL || fixupStates == NULL
+        || tableEntries == NULL) {
+        free(buffer.bytes);
+        free(stateOffsets);
+        free(fixupOffsets);
+        free(fixupStates);
+        free(tableEntries);
+        *error = TM_ERROR_MEMORY;
+        return NULL;
+    }
+
+    // entry: save the callee saved registers and load the run state into them
+    // rbx = context, r12 = symbol index, r13 = head, r14 = leftmost cell, r15 = rightmost cell, rbp = steps left
+    emitBytes(&buffer, "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57", 10);   // push rbx, rbp, r12, r13, r14, r15
+    emitBytes(&buffer, "\x48\x83\xEC\x08", 4);                 // sub rsp, 8 - align the stack for helper calls
+    emitBytes(&buffer, "\x48\x89\xFB", 3);                     // mov rbx, rdi
+    emitBytes(&buffer, "\x4C\x8B\x63", 3);                     // mov r12, [rbx + symbolIndex]
+    emit1(&buffer, (unsigned char)offsetof(struct JitContext, symbolIndex));
+    emitLoad(&buffer, R13_RBX, offsetof(struct JitContext, head));
+    emitLoad(&buffer, R14_RBX, offsetof(struct JitContext, left));
+    emitLoad(&buffer, R15_RBX, offsetof(struct JitContext, right));
+    emitLoad(&buffer, RBP_RBX, offsetof(struct JitContext, remaining));
+    emitBytes(&buffer, "\xFF\x63", 2);                         // jmp [rbx + entry]
+    emit1(&buffer, (unsigned char)offsetof(struct JitContext, entry));
+
+    size_t exitOffset = buffer.size;
+    emitExit(&buffer);
+    size_t extendLeftOffset = buffer.size;
+    emitExtend(&buffer, 1);
+    size_t extendRightOffset = buffer.size;
+    emitExtend(&buffer, 0);
+
+    // the end state's block
+    stateOffsets[numStates] = (long)buffer.size;
+    emit1(&buffer, 0xB8);                                       // mov eax, RUN_HALTED
+    emit4(&buffer, RUN_HALTED);
+    emit1(&buffer, 0xBA);                                       // mov edx, endState
+    emit4(&buffer, endState);
+    emitRel32(&buffer, 0xE9, exitOffset);
+
+    for (int state = 0; state < numStates && !buffer.failed; state++) {
+        // out of steps: put back the step that was taken off and exit in this state
+        size_t budgetOffset = buffer.size;
+        emitBytes(&buffer, "\x31\xED", 2);                     // xor ebp, ebp
+        emit1(&buffer, 0xB8);                                   // mov eax, JIT_SLICE_DONE
+        emit4(&buffer, JIT_SLICE_DONE);
+        emit1(&buffer, 0xBA);                                   // mov edx, state
+        emit4(&buffer, state);
+        emitRel32(&buffer, 0xE9, exitOffset);
+
+        // no rule for the symbol: the step taken off did not happen
+        size_t undefinedOffset = buffer.size;
+        emitBytes(&buffer, "\x48\x83\xC5\x01", 4);             // add rbp, 1
+        emit1(&buffer, 0xB8);                                   // mov eax, RUN_UNDEFINED
+        emit4(&buffer, RUN_UNDEFINED);
+        emit1(&buffer, 0xBA);                                   // mov edx, state
+        emit4(&buffer, state);
+        emitRel32(&buffer, 0xE9, exitOffset);
+
+        // the state's block: take a step off the slice, read the symbol and jump through the state's table
+        stateOffsets[state] = (long)buffer.size;
+        emitBytes(&buffer, "\x48\x83\xED\x01", 4);             // sub rbp, 1
+        emitBytes(&buffer, "\x0F\x82", 2);                     // jb budget
+        emit4(&buffer, 0);
+        patchRel32(&buffer, buffer.size - 4, budgetOffset);
+        emitBytes(&buffer, "\x41\x0F\xB6\x45\x00", 5);         // movzx eax, byte [r13]
+        emitBytes(&buffer, "\x41\x0F\xB6\x04\x04", 5);         // movzx eax, byte [r12 + rax]
+        emitBytes(&buffer, "\x48\x8D\x0D", 3);                 // lea rcx, [rip + table]
+        size_t tableDisplacement = buffer.size;
+        emit4(&buffer, 0);
+        emitBytes(&buffer, "\x48\x63\x14\x81", 4);             // movsxd rdx, dword [rcx + rax * 4]
+        emitBytes(&buffer, "\x48\x01\xCA", 3);                 // add rdx, rcx
+        emitBytes(&buffer, "\xFF\xE2", 2);                     // jmp rdx
+
+        // the table holds the offsets of each symbol's code from the start of the table
+        while (buffer.size % 4 != 0) {
+            emit1(&buffer, 0xCC);
+        }
+        size_t tableOffset = buffer.size;
+        patchRel32(&buffer, tableDisplacement, tableOffset);
+        for (int symbol = 0; symbol < alphabetSize; symbol++) {
+            emit4(&buffer, 0);
+        }
+
+        for (int symbol = 0; symbol < alphabetSize; symbol++) {
+            struct Instruction instruction = table->instructions[(long)state * alphabetSize + symbol];
+            if (instruction.move == MOVE_NONE) {
+                tableEntries[symbol] = (long)undefinedOffset;
+                continue;
+            }
+            tableEntries[symbol] = (long)buffer.size;
+
+            // column 0 is shared by every symbol without a rule, any other column reads a single symbol
+            // and does not need to write it back
+            if (symbol == 0 || instruction.write != table->symbols[symbol]) {
+                emitBytes(&buffer, "\x41\xC6\x45\x00", 4);     // mov byte [r13], write
+                emit1(&buffer, (unsigned char)instruction.write);
+            }
+
+            if (instruction.move == MOVE_HALT) {
+                emit1(&buffer, 0xB8);                           // mov eax, RUN_NO_MOVE
+                emit4(&buffer, RUN_NO_MOVE);
+                emit1(&buffer, 0xBA);                           // mov edx, state
+                emit4(&buffer, state);
+                emitRel32(&buffer, 0xE9, exitOffset);
+                continue;
+            }
+
+            int left = instruction.move == MOVE_LEFT || instruction.move == MOVE_SWEEP_LEFT;
+            if (instruction.move == MOVE_SWEEP_LEFT || instruction.move == MOVE_SWEEP_RIGHT) {
+                emitStore(&buffer, R13_RBX, offsetof(struct JitContext, head));
+                emitStore(&buffer, R14_RBX, offsetof(struct JitContext, left));
+                emitStore(&buffer, R15_RBX, offsetof(struct JitContext, right));
+                emitStore(&buffer, RBP_RBX, offsetof(struct JitContext, remaining));
+                emitHelperCall(&buffer, left ? (const void*)jitSweepLeft : (const void*)jitSweepRight,
+                               (unsigned char)instruction.write);
+                emitLoad(&buffer, R13_RBX, offsetof(struct JitContext, head));
+                emitLoad(&buffer, RBP_RBX, offsetof(struct JitContext, remaining));
+            }
+
+            // move the head, and record a new leftmost or rightmost cell when it passes the visited region
+            if (left) {
+                emitBytes(&buffer, "\x49\xFF\xCD", 3);          // dec r13
+                emitBytes(&buffer, "\x4D\x39\xF5", 3);          // cmp r13, r14
+                emitBytes(&buffer, "\x73\x05", 2);              // jae over the call
+                emitRel32(&buffer, 0xE8, extendLeftOffset);
+            } else {
+                emitBytes(&buffer, "\x49\xFF\xC5", 3);          // inc r13
+                emitBytes(&buffer, "\x4D\x39\xFD", 3);          // cmp r13, r15
+                emitBytes(&buffer, "\x76\x05", 2);              // jbe over the call
+                emitRel32(&buffer, 0xE8, extendRightOffset);
+            }
+
+            // jump to the next state's block, or the end state's block
+            emit1(&buffer, 0xE9);
+            if (numFixups == fixupsCapacity) {
+                long* offsets = (long*)realloc(fixupOffsets, 2 * fixupsCapacity * sizeof(long));
+                fixupOffsets = offsets != NULL ? offsets : fixupOffsets;
+                int* states = (int*)realloc(fixupStates, 2 * fixupsCapacity * sizeof(int));
+                fixupStates = states != NULL ? states : fixupStates;
+                if (offsets == NULL || states == NULL) {
+                    buffer.failed = 1;
+                    break;
+                }
+                fixupsCapacity *= 2;
+            }
+            fixupOffsets[numFixups] = (long)buffer.size;
+            fixupStates[numFixups] = instruction.nextState == endState ? numStates : instruction.nextState;
+            numFixups++;
+            emit4(&buffer, 0);
+        }
+
+        for (int symbol = 0; symbol < alphabetSize && !buffer.failed; symbol++) {
+            int entry = (int)(tableEntries[symbol] - (long)tableOffset);
+            memcpy(buffer.bytes + tableOffset + symbol * 4, &entry, 4);
+        }
+    }
+    for (int i = 0; i < numFixups; i++) {
+        patchRel32(&buffer, fixupOffsets[i], stateOffsets[fixupStates[i]]);
+    }
+    free(tableEntries);
+    free(fixupOffsets);
+    free(fixupStates);
+
+    // the code only needs 32 bit displacements while it stays under 2 GB
+    struct JitProgram* program = NULL;
+    *error = buffer.failed ? TM_ERROR_MEMORY : TM_ERROR_UNSUPPORTED;
+    if (!buffer.failed && buffer.size < (size_t)INT_MAX) {
+        void* code = mmap(NULL, buffer.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code != MAP_FAILED) {
+            memcpy(code, buffer.bytes, buffer.size);
+            if (mprotect(code, buffer.size, PROT_READ | PROT_EXEC) == 0) {
+                program = (struct JitProgram*)malloc(sizeof(struct JitProgram));
+                *error = program == NULL ? TM_ERROR_MEMORY : TM_OK;
+            }
+            if (program != NULL) {
+                program->code = (unsigned char*)code;
+                program->size = buffer.size;
+                program->run = (void (*)(struct JitContext*))code;
+                program->stateOffsets = stateOffsets;
+                program->numStates = numStates;
+            } else {
+                munmap(code, buffer.size);
+            }
+        }
+    }
+    free(buffer.bytes);
+    if (program == NULL) {
+        free(stateOffsets);
+    }
+    return program;
+}
+
+static void freeJit(struct JitProgram* program) {
+    munmap(program->code, program->size);
+    free(program->stateOffsets);
+    free(program);
+}
+
+// Native code engine - runs the generated code one slice at a time so the time budget is checked between slices
+static void jitTM(struct TuringMachine* tm) {
+    struct JitProgram* program = tm->jit;
+    struct Tape* tape = &tm->tape;
+    struct JitContext context;
+    context.cells = (uintptr_t)tape->cells;
+    context.cellsEnd = context.cells + tape->capacity;
+    context.head = context.cells + tape->origin + tm->startHead;
+    context.left = context.cells + tape->left;
+    context.right = context.cells + tape->right;
+    context.symbolIndex = tm->transitions.symbolIndex;
+    context.tape = tape;
+
+    long long steps = tm->startSteps;
+    long long maxSteps = tm->maxSteps > 0 ? tm->maxSteps : LLONG_MAX;
+    double start = tm->maxSeconds > 0 ? now() : 0;
+    int state = tm->startState;
+    int reason = -1;
+    while (reason < 0) {
+        long long slice = maxSteps - steps;
+        if (tm->maxSeconds > 0 && slice > TIME_CHECK_INTERVAL) {
+            slice = TIME_CHECK_INTERVAL;
+        }
+        if (slice < 0) {
+            slice = 0;      // resumed past the step budget
+        }
+        context.remaining = slice;
+        context.entry = program->code + program->stateOffsets[state == tm->endState ? program->numStates : state];
+        program->run(&context);
+        steps += slice - context.remaining;
+        state = context.state;
+
+        if (tape->failed) {
+            reason = RUN_OUT_OF_MEMORY;
+        } else if (context.reason != JIT_SLICE_DONE) {
+            reason = context.reason;
+        } else if (steps >= maxSteps) {
+            reason = RUN_STEP_LIMIT;
+        } else if (now() - start >= tm->maxSeconds) {
+            reason = RUN_TIME_LIMIT;
+        }
+    }
+
+    tape->left = (long)(context.left - context.cells);
+    tape->right = (long)(context.right - context.cells);
+    finishRun(tm, reason, state, steps, (long)(context.head - context.cells));
+}
+
+#endif
+
+#ifndef TM_LIBRARY
+// Function to pick the engine that runs the machine, compiling the transitions if the engine needs it
+// Without native code support, or for machines too big to compile, ENGINE_JIT falls back to the interpreter
+// Multi-tape machines, runs with loop detection, runs on a sparse tape, profiled runs and macro machine runs
+// always use the interpreter
+static void selectEngine(struct TuringMachine* tm, int engine) {
+    if (tm->multi != NULL || tm->detectLoops || tm->sparse != NULL || tm->profile != NULL || tm->macro != NULL) {
+        if (engine != ENGINE_INTERPRETER) {
+            fprintf(stderr, "%s run on the interpreter. \n", tm->multi != NULL ? "Multi-tape machines"
+                    : tm->detectLoops ? "Runs with loop detection" : tm->sparse != NULL ? "Runs on a sparse tape"
+                    : tm->profile != NULL ? "Profiled runs" : "Macro machine runs");
+        }
+        engine = ENGINE_INTERPRETER;
+    }
+    tm->engine = engine;
+    if (engine == ENGINE_THREADED && tm->threaded == NULL) {
+        tm->threaded = compileThreaded(&tm->transitions, tm->endState);
+        if (tm->threaded == NULL) {
+            printf("Out of memory for threaded code. \n");
+            exit(1);
+        }
+    }
+    if (engine == ENGINE_JIT && tm->jit == NULL) {
+        int error = TM_ERROR_UNSUPPORTED;
+#ifdef HAVE_JIT
+        tm->jit = compileJit(&tm->transitions, tm->endState, &error);
+#endif
+        if (tm->jit == NULL && error == TM_ERROR_MEMORY) {
+            printf("Out of memory for native code. \n");
+            exit(1);
+        }
+        if (tm->jit == NULL) {
+            fprintf(stderr, "Native code is not available for this machine, using the interpreter. \n");
+            tm->engine = ENGINE_INTERPRETER;
+        }
+    }
+}
+#endif
+
+// Run the machine on the engine selected for it - a tape that could not grow in an earlier run starts out clear
+static void runEngine(struct TuringMachine* tm) {
+    tm->tape.failed = 0;
+    if (tm->multi != NULL) {
+        for (int t = 0; t < tm->multi->numTapes - 1; t++) {
+            tm->multi->tapes[t].failed = 0;
+        }
+        multiTM(tm);
+    } else if (tm->sparse != NULL) {
+        sparseTM(tm);
+    } else if (tm->detectLoops) {
+        loopCheckTM(tm);
+    } else if (tm->profile != NULL) {
+        profileTM(tm);
+    } else if (tm->macro != NULL) {
+        macroTM(tm);
+    } else if (tm->engine == ENGINE_THREADED) {
+        threadedEngine(tm, tm->threaded);
+#ifdef HAVE_JIT
+    } else if (tm->engine == ENGINE_JIT) {
+        jitTM(tm);
+#endif
+    } else {
+        interpretTM(tm);
+    }
+}
+
+// Checkpoints - the configuration of a run (visited cells, head, state and step count) saved to a file
+// A checkpointed run is split into segments of checkpointInterval steps; between segments the visited cells
+// are copied and a writer thread saves them while the next segment runs, through a temporary file that is
+// renamed over the checkpoint so the file always holds a complete checkpoint
+// Checkpoints are written in the byte order of the machine that writes them
+#define CHECKPOINT_MAGIC "TMCHECK"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_INTERVAL (1LL << 30)     // default steps between checkpoints
+
+struct CheckpointHeader {
+    char magic[8];              // CHECKPOINT_MAGIC
+    uint32_t version;           // CHECKPOINT_VERSION
+    uint32_t byteOrder;         // 0x01020304 as written
+    int64_t state;
+    int64_t steps;
+    int64_t head;               // positions are relative to the 'A' cell
+    int64_t first;              // position of the first saved cell, the leftmost visited one
+    uint64_t tapeLength;        // number of saved cells, up to the rightmost visited one
+    uint64_t machineHash;       // hash of the transition table, a checkpoint only resumes the machine that wrote it
+    uint64_t dataChecksum;      // hash of the saved cells
+    uint64_t headerChecksum;    // hash of the header up to this field
+};
+
+// Writer of the checkpoints of one run - owns its copy of the cells while its thread is busy
+struct CheckpointWriter {
+    const char* fileName;
+    struct CheckpointHeader header;
+    char* cells;
+    long capacity;
+    pthread_t thread;
+    int busy;       // thread started and not joined yet
+    int failed;
+};
+
+// Hash of everything a run depends on besides its configuration
+static uint64_t machineHash(const struct TuringMachine* tm) {
+    const struct TransitionTable* table = &tm->transitions;
+    int32_t sizes[3] = { table->numStates, table->alphabetSize, tm->endState };
+    uint64_t hash = hashBytes(sizes, sizeof(sizes), HASH_SEED);
+    hash = hashBytes(table->symbolIndex, sizeof(table->symbolIndex), hash);
+    return hashBytes(table->instructions, (size_t)table->numStates * table->alphabetSize * sizeof(struct Instruction), hash);
+}
+
+static void* checkpointWriter(void* argument) {
+    struct CheckpointWriter* writer = (struct CheckpointWriter*)argument;
+    size_t nameLength = strlen(writer->fileName);
+    char* tempName = (char*)malloc(nameLength + 5);
+    memcpy(tempName, writer->fileName, nameLength);
+    memcpy(tempName + nameLength, ".tmp", 5);
+
+    FILE* file = fopen(tempName, "wb");
+    int written = file != NULL
+                  && fwrite(&writer->header, sizeof(writer->header), 1, file) == 1
+                  && fwrite(writer->cells, 1, writer->header.tapeLength, file) == writer->header.tapeLength
+                  && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (file != NULL && fclose(file) != 0) {
+        written = 0;
+    }
+    if (!written || rename(tempName, writer->fileName) != 0) {
+        writer->failed = 1;
+    }
+    free(tempName);
+    return NULL;
+}
+
+// Wait for the checkpoint being written, if any
+static void finishCheckpoint(struct CheckpointWriter* writer) {
+    if (writer->busy) {
+        pthread_join(writer->thread, NULL);
+        writer->busy = 0;
+    }
+}
+
+// Function to checkpoint the configuration a run stopped in - only the copy of the visited cells holds the run up
+static void startCheckpoint(struct CheckpointWriter* writer, const struct TuringMachine* tm) {
+    finishCheckpoint(writer);
+    const struct Tape* tape = &tm->tape;
+    long length = tape->right - tape->left + 1;
+    if (length > writer->capacity) {
+        free(writer->cells);
+        writer->capacity = length;
+        writer->cells = (char*)malloc(length);
+    }
+    memcpy(writer->cells, tape->cells + tape->left, length);
+
+    struct CheckpointHeader* header = &writer->header;
+    memset(header, 0, sizeof(struct CheckpointHeader));
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header->version = CHECKPOINT_VERSION;
+    header->byteOrder = 0x01020304;
+    header->state = tm->result.finalState;
+    header->steps = tm->result.steps;
+    header->head = tm->result.head;
+    header->first = tape->left - tape->origin;
+    header->tapeLength = (uint64_t)length;
+    header->machineHash = machineHash(tm);
+    header->dataChecksum = hashBytes(writer->cells, length, HASH_SEED);
+    header->headerChecksum = hashBytes(header, offsetof(struct CheckpointHeader, headerChecksum), HASH_SEED);
+    writer->busy = pthread_create(&writer->thread, NULL, checkpointWriter, writer) == 0;
+    if (!writer->busy) {
+        checkpointWriter(writer);
+    }
+}
+
+// Function to load the visited cells of a checkpoint, first being the position of the first one
+// The buffer of the tape is reused when it is big enough - returns -1, leaving the tape as it was, when there is
+// no memory for a bigger one
+static int restoreTape(struct Tape* tape, const char* cells, long length, long first) {
+    if (tape->cells == NULL || tape->capacity < length + 2 * TAPE_CHUNK) {
+        char* buffer = (char*)malloc(length + 2 * TAPE_CHUNK);
+        if (buffer == NULL) {
+            return -1;
+        }
+        free(tape->cells);
+        tape->cells = buffer;
+        tape->capacity = length + 2 * TAPE_CHUNK;
+        memset(tape->cells, BLANK, tape->capacity);
+    } else {
+        // only the cells visited before can be non blank
+        memset(tape->cells + tape->left, BLANK, tape->right - tape->left + 1);
+    }
+    memcpy(tape->cells + TAPE_CHUNK, cells, length);
+    tape->left = TAPE_CHUNK;
+    tape->right = TAPE_CHUNK + length - 1;
+    tape->origin = TAPE_CHUNK - first;
+    tape->failed = 0;
+    return 0;
+}
+
+#ifndef TM_LIBRARY
+// Function to resume a loaded machine from a checkpoint - the run continues exactly where the checkpoint was taken
+static void resumeTM(struct TuringMachine* tm, const char* fileName) {
+    FILE* file = fopen(fileName, "rb");
+    struct CheckpointHeader header;
+    if (!file || fread(&header, sizeof(header), 1, file) != 1) {
+        printf("Enter valid checkpoint file. \n");
+        exit(1);
+    }
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 || header.version != CHECKPOINT_VERSION
+        || header.byteOrder != 0x01020304
+        || header.headerChecksum != hashBytes(&header, offsetof(struct CheckpointHeader, headerChecksum), HASH_SEED)) {
+        printf("%s: not a valid checkpoint \n", fileName);
+        exit(1);
+    }
+    if (tm->multi != NULL || tm->nondet != NULL || header.machineHash != machineHash(tm)) {
+        printf("%s: checkpoint of a different machine \n", fileName);
+        exit(1);
+    }
+    // the 'A' cell and the head are always among the visited cells, and the state is one of the table the hash
+    // matched - of the optimized table, numbered as the optimizer left it, for a checkpoint of an optimized run
+    long length = (long)header.tapeLength;
+    if (header.first > 0 || header.first + length <= 0 || header.head < header.first || header.head >= header.first + length
+        || header.steps < 0 || header.state < 0
+        || (header.state >= tm->transitions.numStates && header.state != tm->endState)) {
+        printf("%s: not a valid checkpoint \n", fileName);
+        exit(1);
+    }
+    char* cells = (char*)malloc(length);
+    if (cells == NULL || fread(cells, 1, length, file) != (size_t)length
+        || hashBytes(cells, length, HASH_SEED) != header.dataChecksum) {
+        printf("%s: checkpoint data is corrupt \n", fileName);
+        exit(1);
+    }
+    fclose(file);
+
+    if (restoreTape(&tm->tape, cells, length, (long)header.first) != 0) {
+        printf("Out of memory for tape. \n");
+        exit(1);
+    }
+    free(cells);
+    tm->startState = (int)header.state;
+    tm->startHead = (long)header.head;
+    tm->startSteps = header.steps;
+}
+#endif
+
+// Run the machine in segments of interval steps, checkpointing between them
+// A run stopped by its budget is checkpointed as well, so it can be resumed with a larger one
+static void checkpointedTM(struct TuringMachine* tm) {
+    struct CheckpointWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.fileName = tm->checkpointName;
+    long long interval = tm->checkpointInterval > 0 ? tm->checkpointInterval : CHECKPOINT_INTERVAL;
+    long long maxSteps = tm->maxSteps > 0 ? tm->maxSteps : LLONG_MAX;
+    double maxSeconds = tm->maxSeconds;
+    double start = now();
+
+    while (1) {
+        tm->maxSteps = maxSteps - tm->startSteps > interval ? tm->startSteps + interval : maxSteps;
+        if (maxSeconds > 0) {
+            double left = maxSeconds - (now() - start);
+            tm->maxSeconds = left > 1e-9 ? left : 1e-9;
+        }
+        runEngine(tm);
+        if (tm->result.reason != RUN_STEP_LIMIT || tm->result.steps >= maxSteps) {
+            break;
+        }
+        // the next segment continues from where this one stopped
+        tm->startState = tm->result.finalState;
+        tm->startHead = tm->result.head;
+        tm->startSteps = tm->result.steps;
+        startCheckpoint(&writer, tm);
+    }
+    if (tm->result.reason == RUN_STEP_LIMIT || tm->result.reason == RUN_TIME_LIMIT) {
+        startCheckpoint(&writer, tm);
+    }
+    finishCheckpoint(&writer);
+    if (writer.failed) {
+        fprintf(stderr, "Cannot write checkpoint file %s. \n", writer.fileName);
+    }
+    free(writer.cells);
+    tm->maxSteps = maxSteps == LLONG_MAX ? 0 : maxSteps;
+    tm->maxSeconds = maxSeconds;
+}
+
+// Result cache - runs of the same machine on the same input tape with the same step budget end the same way,
+// so a cache in front of the engines keeps the result and final tape of recent runs and hands them out again
+// Results are keyed by hashes of the machine and the input tape and the step budget; the cache is bounded by
+// results and by the bytes of their final tapes, and drops the least recently used result first
+// With a store file every new result is also appended to the file, and the results in the file are loaded when
+// the cache is opened, so they outlive the process; the store is rewritten without the results it no longer
+// needs when it is opened. Stores are written in the byte order of the machine that writes them
+#define CACHE_MAGIC "TMCACHE"
+#define CACHE_VERSION 1
+#define CACHE_ENTRIES 4096              // default bound on the results kept
+#define CACHE_BYTES (256L << 20)        // bound on the bytes of the final tapes kept
+#define CACHE_MAX_TAPE (CACHE_BYTES / 16)   // longer final tapes are not kept
+
+struct CacheKey {
+    uint64_t machine;       // hash of the machine and how it runs, see attachCache
+    uint64_t input;         // hash of the input tape
+    int64_t maxSteps;       // step budget, 0 for none
+};
+
+struct CachedResult {
+    struct CacheKey key;
+    struct RunResult result;
+    char* cells;                    // final tape, from the leftmost to the rightmost visited cell
+    struct CachedResult* newer;     // list of results in order of use, the newest first
+    struct CachedResult* older;
+    struct CachedResult* next;      // next result in the same bucket
+};
+
+struct ResultCache {
+    pthread_mutex_t lock;           // the cache is shared by every thread that runs machines
+    struct CachedResult** buckets;
+    long numBuckets;                // a power of two, at least twice maxEntries
+    struct CachedResult* newest;
+    struct CachedResult* oldest;
+    long count;
+    long maxEntries;
+    long long bytes;                // bytes of the final tapes kept
+    long long hits;
+    long long misses;
+    FILE* store;                    // store the new results are appended to, NULL for none
+    int storeFailed;
+};
+
+// Store file - a CacheHeader followed by one CacheRecord per result, each followed by its final tape
+struct CacheHeader {
+    char magic[8];                  // CACHE_MAGIC
+    uint32_t version;               // CACHE_VERSION
+    uint32_t byteOrder;             // 0x01020304 as written
+};
+
+struct CacheRecord {
+    struct CacheKey key;
+    int64_t steps;
+    int64_t head;
+    int64_t leftmost;
+    int64_t rightmost;
+    int32_t reason;
+    int32_t finalState;
+    uint64_t checksum;              // hash of the record up to this field and of the final tape
+};
+
+static struct CachedResult** cacheBucket(struct ResultCache* cache, const struct CacheKey* key) {
+    uint64_t hash = mixHash(key->machine ^ mixHash(key->input ^ (uint64_t)key->maxSteps));
+    return &cache->buckets[hash & (uint64_t)(cache->numBuckets - 1)];
+}
+
+static struct CachedResult* findResult(struct ResultCache* cache, const struct CacheKey* key) {
+    struct CachedResult* entry = *cacheBucket(cache, key);
+    while (entry != NULL && memcmp(&entry->key, key, sizeof(struct CacheKey)) != 0) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+static void unlinkResult(struct ResultCache* cache, struct CachedResult* entry) {
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+}
+
+static void pushResult(struct ResultCache* cache, struct CachedResult* entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest != NULL) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+static void dropOldest(struct ResultCache* cache) {
+    struct CachedResult* entry = cache->oldest;
+    unlinkResult(cache, entry);
+    struct CachedResult** link = cacheBucket(cache, &entry->key);
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    cache->count--;
+    cache->bytes -= entry->result.cellsTouched;
+    free(entry->cells);
+    free(entry);
+}
+
+// Function to add a result to the cache, with its lock held - the cache takes over entry
+// Returns 0 when the cache already holds a result for the key, entry is freed then
+static int insertResult(struct ResultCache* cache, struct CachedResult* entry) {
+    if (findResult(cache, &entry->key) != NULL) {
+        free(entry->cells);
+        free(entry);
+        return 0;
+    }
+    struct CachedResult** bucket = cacheBucket(cache, &entry->key);
+    entry->next = *bucket;
+    *bucket = entry;
+    pushResult(cache, entry);
+    cache->count++;
+    cache->bytes += entry->result.cellsTouched;
+    while (cache->count > cache->maxEntries || cache->bytes > CACHE_BYTES) {
+        dropOldest(cache);
+    }
+    return 1;
+}
+
+static int writeRecord(FILE* store, const struct CachedResult* entry) {
+    struct CacheRecord record;
+    memset(&record, 0, sizeof(record));
+    record.key = entry->key;
+    record.steps = entry->result.steps;
+    record.head = entry->result.head;
+    record.leftmost = entry->result.leftmost;
+    record.rightmost = entry->result.rightmost;
+    record.reason = entry->result.reason;
+    record.finalState = entry->result.finalState;
+    uint64_t checksum = hashBytes(&record, offsetof(struct CacheRecord, checksum), HASH_SEED);
+    record.checksum = hashBytes(entry->cells, entry->result.cellsTouched, checksum);
+    return fwrite(&record, sizeof(record), 1, store) == 1
+           && fwrite(entry->cells, 1, entry->result.cellsTouched, store) == (size_t)entry->result.cellsTouched;
+}
+
+#ifndef TM_LIBRARY
+// Function to load the results of a store into the cache - returns the number of records read, or -1 when the
+// file is not a store; reading stops at the first incomplete or damaged record
+static long readStore(struct ResultCache* cache, FILE* file, int* damaged) {
+    struct CacheHeader header;
+    *damaged = 0;
+    if (fread(&header, sizeof(header), 1, file) != 1) {
+        // an empty file gets its header when it is rewritten
+        *damaged = 1;
+        return feof(file) && ftell(file) == 0 ? 0 : -1;
+    }
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION
+        || header.byteOrder != 0x01020304) {
+        return -1;
+    }
+    long numRecords = 0;
+    long offset = ftell(file);
+    struct CacheRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        long length = (long)(record.rightmost - record.leftmost + 1);
+        if (length < 1 || length > CACHE_MAX_TAPE || record.reason < 0 || record.reason > RUN_NON_HALTING) {
+            *damaged = 1;
+            return numRecords;
+        }
+        struct CachedResult* entry = (struct CachedResult*)calloc(1, sizeof(struct CachedResult));
+        char* cells = (char*)malloc(length);
+        if (entry == NULL || cells == NULL || fread(cells, 1, length, file) != (size_t)length
+            || hashBytes(cells, length, hashBytes(&record, offsetof(struct CacheRecord, checksum), HASH_SEED))
+               != record.checksum) {
+            free(entry);
+            free(cells);
+            *damaged = 1;
+            return numRecords;
+        }
+        entry->key = record.key;
+        entry->cells = cells;
+        entry->result.reason = record.reason;
+        entry->result.finalState = record.finalState;
+        entry->result.steps = record.steps;
+        entry->result.head = (long)record.head;
+        entry->result.leftmost = (long)record.leftmost;
+        entry->result.rightmost = (long)record.rightmost;
+        entry->result.cellsTouched = length;
+        // a later record of the same run is the same result
+        insertResult(cache, entry);
+        numRecords++;
+        offset = ftell(file);
+    }
+    // a record cut short by a crash while it was written
+    *damaged = !feof(file) || ftell(file) != offset;
+    return numRecords;
+}
+
+// Function to open a result cache of at most maxEntries results, with the store at storeName or none for NULL
+// A store that holds results the cache does not keep, or a damaged tail, is rewritten through a temporary file
+static struct ResultCache* openResultCache(long maxEntries, const char* storeName) {
+    struct ResultCache* cache = (struct ResultCache*)calloc(1, sizeof(struct ResultCache));
+    cache->maxEntries = maxEntries;
+    cache->numBuckets = 1024;
+    while (cache->numBuckets < 2 * maxEntries) {
+        cache->numBuckets *= 2;
+    }
+    cache->buckets = (struct CachedResult**)calloc(cache->numBuckets, sizeof(struct CachedResult*));
+    if (cache->buckets == NULL) {
+        printf("Out of memory for result cache. \n");
+        exit(1);
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    if (storeName == NULL) {
+        return cache;
+    }
+
+    long numRecords = 0;
+    int damaged = 0;
+    FILE* file = fopen(storeName, "rb");
+    if (file != NULL) {
+        numRecords = readStore(cache, file, &damaged);
+        fclose(file);
+        if (numRecords < 0) {
+            printf("%s: not a result store \n", storeName);
+            exit(1);
+        }
+    }
+    if (file == NULL || damaged || numRecords > cache->count) {
+        size_t nameLength = strlen(storeName);
+        char* tempName = (char*)malloc(nameLength + 5);
+        memcpy(tempName, storeName, nameLength);
+        memcpy(tempName + nameLength, ".tmp", 5);
+        FILE* rewritten = fopen(tempName, "wb");
+        struct CacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        header.version = CACHE_VERSION;
+        header.byteOrder = 0x01020304;
+        int written = rewritten != NULL && fwrite(&header, sizeof(header), 1, rewritten) == 1;
+        for (struct CachedResult* entry = cache->oldest; written && entry != NULL; entry = entry->newer) {
+            written = writeRecord(rewritten, entry);
+        }
+        if (rewritten != NULL && fclose(rewritten) != 0) {
+            written = 0;
+        }
+        if (!written || rename(tempName, storeName) != 0) {
+            printf("Cannot write result store %s. \n", storeName);
+            exit(1);
+        }
+        free(tempName);
+    }
+    cache->store = fopen(storeName, "ab");
+    if (cache->store == NULL) {
+        printf("Cannot write result store %s. \n", storeName);
+        exit(1);
+    }
+    return cache;
+}
+
+static void closeResultCache(struct ResultCache* cache) {
+    if (cache->store != NULL && fclose(cache->store) != 0) {
+        cache->storeFailed = 1;
+    }
+    if (cache->storeFailed) {
+        fprintf(stderr, "Cannot write result store. \n");
+    }
+    while (cache->oldest != NULL) {
+        dropOldest(cache);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+// Function to let a machine's runs go through a cache - the machine is hashed once, with everything besides the
+// input and the step budget that decides how its runs end
+static void attachCache(struct TuringMachine* tm, struct ResultCache* cache) {
+    int32_t run[2] = { tm->startState, tm->detectLoops };
+    uint64_t hash = hashBytes(run, sizeof(run), machineHash(tm));
+    if (tm->originalStates != NULL) {
+        // final states are reported by their numbers in the machine file
+        hash = hashBytes(tm->originalStates, (size_t)(tm->transitions.numStates + 1) * sizeof(int), hash);
+    }
+    tm->cache = cache;
+    tm->cacheMachine = hash;
+}
+#endif
+
+// Whether a run can be answered from the cache - runs that start from a checkpoint, or end anywhere but on the
+// dense tape, are always run
+static int cacheableRun(const struct TuringMachine* tm) {
+    return tm->cache != NULL && tm->multi == NULL && tm->nondet == NULL && tm->sparse == NULL && tm->profile == NULL
+           && tm->checkpointName == NULL && tm->startSteps == 0 && tm->startHead == 0;
+}
+
+// Function to look the run up before it starts - on a hit the final tape and result are put in place
+static int lookupResult(struct TuringMachine* tm, struct CacheKey* key) {
+    struct ResultCache* cache = tm->cache;
+    const struct Tape* tape = &tm->tape;
+    int64_t offset = tape->origin - tape->left;
+    key->machine = tm->cacheMachine;
+    key->input = hashBytes(tape->cells + tape->left, tape->right - tape->left + 1,
+                           hashBytes(&offset, sizeof(offset), HASH_SEED));
+    key->maxSteps = tm->maxSteps;
+
+    pthread_mutex_lock(&cache->lock);
+    struct CachedResult* entry = findResult(cache, key);
+    if (entry == NULL) {
+        cache->misses++;
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    if (restoreTape(&tm->tape, entry->cells, entry->result.cellsTouched, entry->result.leftmost) != 0) {
+        // no memory for the final tape - the input tape is still in place, so the run goes ahead as a miss
+        cache->misses++;
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    cache->hits++;
+    unlinkResult(cache, entry);
+    pushResult(cache, entry);
+    tm->result = entry->result;
+    pthread_mutex_unlock(&cache->lock);
+    return 1;
+}
+
+// Function to keep the result of a run that missed the cache - runs stopped by the clock or by a lack of memory are
+// not repeatable
+static void keepResult(struct TuringMachine* tm, const struct CacheKey* key) {
+    struct ResultCache* cache = tm->cache;
+    const struct Tape* tape = &tm->tape;
+    long length = tape->right - tape->left + 1;
+    if (tm->result.reason == RUN_TIME_LIMIT || tm->result.reason == RUN_OUT_OF_MEMORY || length > CACHE_MAX_TAPE) {
+        return;
+    }
+    struct CachedResult* entry = (struct CachedResult*)calloc(1, sizeof(struct CachedResult));
+    char* cells = (char*)malloc(length);
+    if (entry == NULL || cells == NULL) {
+        free(entry);
+        free(cells);
+        return;
+    }
+    memcpy(cells, tape->cells + tape->left, length);
+    entry->key = *key;
+    entry->result = tm->result;
+    entry->cells = cells;
+
+    pthread_mutex_lock(&cache->lock);
+    if (insertResult(cache, entry) && cache->store != NULL && !cache->storeFailed) {
+        cache->storeFailed = !writeRecord(cache->store, entry) || fflush(cache->store) != 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Run the machine on its tape until it halts or its budget runs out - the final tape is left in tm->tape
+// and the reason it stopped in tm->result
+static void executeTM(struct TuringMachine* tm) {
+    struct CacheKey key;
+    int cacheable = cacheableRun(tm);
+    if (cacheable && lookupResult(tm, &key)) {
+        return;
+    }
+    if (tm->checkpointName != NULL) {
+        checkpointedTM(tm);
+    } else {
+        runEngine(tm);
+    }
+    tm->result.finalState = originalState(tm, tm->result.finalState);
+    if (cacheable) {
+        keepResult(tm, &key);
+    }
+}
+
+#ifndef TM_LIBRARY
+// Function to print the result of a run
+static void printResult(const struct RunResult* result) {
+    printf("Stopped: %s in state %d after %lld steps, head at %ld, visited cells %ld to %ld (%ld cells)\n",
+           runReasons[result->reason], result->finalState, result->steps, result->head,
+           result->leftmost, result->rightmost, result->cellsTouched);
+}
+
+// Function to write the final tape of a machine, from its sparse tape when it has one
+static int writeFinalTape(const struct TuringMachine* tm, int fd, int flags) {
+    return tm->sparse != NULL ? writeSparseTape(tm->sparse, fd, flags) : writeTape(&tm->tape, fd, flags);
+}
+
+// Function to check the final tape against the tape in a file, without its line end - returns 0 when they match
+// The file is mapped, so a large expected tape is compared without being read into a copy first
+static int expectTape(const struct TuringMachine* tm, const char* fileName, int flags) {
+    int fd = open(fileName, O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        printf("Enter valid expected tape file. \n");
+        return 1;
+    }
+    size_t size = (size_t)status.st_size;
+    const char* expected = "";
+    void* mapping = MAP_FAILED;
+    if (size > 0) {
+        mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fd);
+            printf("Enter valid expected tape file. \n");
+            return 1;
+        }
+        expected = (const char*)mapping;
+    }
+    close(fd);
+    long length = (long)size;
+    if (length > 0 && expected[length - 1] == '\n') {
+        length--;
+    }
+    if (length > 0 && expected[length - 1] == '\r') {
+        length--;
+    }
+
+    long mismatch = tm->sparse != NULL ? compareSparseTape(tm->sparse, flags, expected, length)
+                    : compareTape(&tm->tape, flags, expected, length);
+    if (mismatch < 0) {
+        printf("Final tape matches %s\n", fileName);
+    } else {
+        printf("Final tape differs from %s at output cell %ld\n", fileName, mismatch);
+    }
+    if (mapping != MAP_FAILED) {
+        munmap(mapping, size);
+    }
+    return mismatch < 0 ? 0 : 1;
+}
+
+// Function to run the machine, quitting when a tape or the engine's own data cannot grow
+static void executeOrQuit(struct TuringMachine* tm) {
+    executeTM(tm);
+    if (tm->result.reason == RUN_OUT_OF_MEMORY) {
+        printf("Out of memory during the run. \n");
+        exit(1);
+    }
+}
+
+// Run the machine and print the final tape
+static void runTM(struct TuringMachine* tm) {
+    executeOrQuit(tm);
+
+    // print tape
+    printf("Final tape contents: ");
+    fflush(stdout);
+    writeFinalTape(tm, STDOUT_FILENO, 0);
+    if (tm->multi != NULL) {
+        for (int t = 0; t < tm->multi->numTapes - 1; t++) {
+            printf("Final tape %d contents: ", t + 2);
+            printTape(&tm->multi->tapes[t]);
+        }
+    }
+}
+#endif
+
+static void cleanUp(struct TuringMachine* tm) {
+
+    // free the tape buffer - the whole tape is a single allocation
+    free(tm->tape.cells);
+    tm->tape.cells = NULL;
+
+    // Free the flat transitions table - also a single allocation, or part of the mapped image
+    if (tm->image != NULL) {
+        munmap(tm->image, tm->imageSize);
+        tm->image = NULL;
+    } else {
+        free(tm->transitions.instructions);
+    }
+    tm->transitions.instructions = NULL;
+
+    if (tm->multi != NULL) {
+        for (int t = 0; t < tm->multi->numTapes - 1; t++) {
+            free(tm->multi->tapes[t].cells);
+        }
+        free(tm->multi->instructions);
+        free(tm->multi);
+        tm->multi = NULL;
+    }
+
+    if (tm->sparse != NULL) {
+        freeSparseTape(tm->sparse);
+        tm->sparse = NULL;
+    }
+
+    free(tm->originalStates);
+    tm->originalStates = NULL;
+
+    if (tm->macro != NULL) {
+        freeMacroMachine(tm->macro);
+        tm->macro = NULL;
+    }
+
+    if (tm->nondet != NULL) {
+        freeNdTable(tm->nondet);
+        tm->nondet = NULL;
+    }
+
+    if (tm->threaded != NULL) {
+        free(tm->threaded->rows);
+        free(tm->threaded);
+        tm->threaded = NULL;
+    }
+#ifdef HAVE_JIT
+    if (tm->jit != NULL) {
+        freeJit(tm->jit);
+        tm->jit = NULL;
+    }
+#endif
+}
+
+// Library interface, declared in tm.h - a handle holds a loaded machine and the tapes it runs on
+// The machine keeps the tapes of its file; runs go on the handle's own tapes, which are refilled in place
+// for every input, the same way the batch workers reuse their tape arenas
+struct TmMachine {
+    struct TuringMachine machine;       // as loaded, with its compiled code once an engine needs it
+    struct Tape tape;                   // first tape of the runs
+    struct MultiTape multi;             // other tapes of the runs of a k-tape machine, and its table
+};
+
+// Function to finish loading a handle - the run tapes start out as the machine's own
+static int startHandle(struct TuringMachine* tm, struct TmMachine** machine, char* message, size_t messageSize) {
+    struct TmMachine* handle = (struct TmMachine*)calloc(1, sizeof(struct TmMachine));
+    if (handle == NULL) {
+        cleanUp(tm);
+        return loadError(message, messageSize, TM_ERROR_MEMORY, "Out of memory for machine.", NULL);
+    }
+    handle->machine = *tm;
+    if (tm->multi != NULL) {
+        // the table is shared with the machine, the tapes get buffers of their own
+        handle->multi = *tm->multi;
+        for (int t = 0; t < tm->multi->numTapes - 1; t++) {
+            memset(&handle->multi.tapes[t], 0, sizeof(struct Tape));
+        }
+    }
+    if (tmResetTape(handle) != TM_OK) {
+        tmFree(handle);
+        return loadError(message, messageSize, TM_ERROR_MEMORY, "Out of memory for tape.", NULL);
+    }
+    *machine = handle;
+    return TM_OK;
+}
+
+int tmLoadFile(const char* fileName, struct TmMachine** machine, char* message, size_t messageSize) {
+    *machine = NULL;
+    if (fileName == NULL) {
+        return loadError(message, messageSize, TM_ERROR_ARGUMENT, "No machine file.", NULL);
+    }
+    struct TuringMachine tm;
+    int error = readMachine(fileName, 0, &tm, message, messageSize);
+    if (error != TM_OK) {
+        return error;
+    }
+    return startHandle(&tm, machine, message, messageSize);
+}
+
+// Function to load a machine file, or a precompiled image, from memory that belongs to the caller
+static int bufferMachine(const char* data, size_t size, const char* name, struct TuringMachine* tm,
+                         char* message, size_t messageSize) {
+    if (size >= sizeof(IMAGE_MAGIC) && memcmp(data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0) {
+        // the buffer need not be aligned - the image is checked in full on an aligned copy, and the table is
+        // copied out of that
+        char* image = (char*)malloc(size);
+        if (image == NULL) {
+            return loadError(message, messageSize, TM_ERROR_MEMORY, "Out of memory for %s.", name);
+        }
+        memcpy(image, data, size);
+        int error = openImage(image, size, name, 1, tm, message, messageSize);
+        if (error == TM_OK) {
+            size_t tableSize = (size_t)tm->transitions.numStates * tm->transitions.alphabetSize * sizeof(struct Instruction);
+            struct Instruction* instructions = (struct Instruction*)malloc(tableSize);
+            if (instructions == NULL) {
+                free(tm->tape.cells);
+                error = loadError(message, messageSize, TM_ERROR_MEMORY, "Out of memory for transition table.", name);
+            } else {
+                memcpy(instructions, tm->transitions.instructions, tableSize);
+                tm->transitions.instructions = instructions;
+            }
+        }
+        free(image);
+        return error;
+    }
+
+    struct Parser parser;
+    parser.fileName = name;
+    parser.data = data;
+    parser.size = size;
+    parser.pos = 0;
+    parser.line = 1;
+    parser.lineStart = 0;
+    parser.error = TM_OK;
+    parser.flags = 0;
+    parser.message = message;
+    parser.messageSize = messageSize;
+    return parseMachine(&parser, tm);
+}
+
+int tmLoadBuffer(const char* data, size_t size, const char* name, struct TmMachine** machine,
+                 char* message, size_t messageSize) {
+    *machine = NULL;
+    if (data == NULL && size > 0) {
+        return loadError(message, messageSize, TM_ERROR_ARGUMENT, "No machine data.", NULL);
+    }
+    struct TuringMachine tm;
+    int error = bufferMachine(data, size, name != NULL ? name : "<buffer>", &tm, message, messageSize);
+    if (error != TM_OK) {
+        return error;
+    }
+    return startHandle(&tm, machine, message, messageSize);
+}
+
+void tmFree(struct TmMachine* machine) {
+    if (machine == NULL) {
+        return;
+    }
+    free(machine->tape.cells);
+    if (machine->machine.multi != NULL) {
+        for (int t = 0; t < machine->multi.numTapes - 1; t++) {
+            free(machine->multi.tapes[t].cells);
+        }
+    }
+    cleanUp(&machine->machine);
+    free(machine);
+}
+
+// Like selectEngine, without falling back - an engine that cannot run the machine is an error
+int tmSetEngine(struct TmMachine* machine, int engine) {
+    struct TuringMachine* tm = &machine->machine;
+    if (engine != ENGINE_INTERPRETER && engine != ENGINE_THREADED && engine != ENGINE_JIT) {
+        return TM_ERROR_ARGUMENT;
+    }
+    if (engine != ENGINE_INTERPRETER && tm->multi != NULL) {
+        return TM_ERROR_UNSUPPORTED;
+    }
+    if (engine == ENGINE_THREADED && tm->threaded == NULL) {
+        tm->threaded = compileThreaded(&tm->transitions, tm->endState);
+        if (tm->threaded == NULL) {
+            return TM_ERROR_MEMORY;
+        }
+    }
+    if (engine == ENGINE_JIT && tm->jit == NULL) {
+        int error = TM_ERROR_UNSUPPORTED;
+#ifdef HAVE_JIT
+        tm->jit = compileJit(&tm->transitions, tm->endState, &error);
+#endif
+        if (tm->jit == NULL) {
+            return error;
+        }
+    }
+    tm->engine = engine;
+    return TM_OK;
+}
+
+int tmSetLimits(struct TmMachine* machine, long long maxSteps, double maxSeconds) {
+    if (maxSteps < 0 || maxSeconds < 0) {
+        return TM_ERROR_ARGUMENT;
+    }
+    machine->machine.maxSteps = maxSteps;
+    machine->machine.maxSeconds = maxSeconds;
+    return TM_OK;
+}
+
+int tmSetTape(struct TmMachine* machine, const char* content, size_t length) {
+    if (content == NULL && length > 0) {
+        return TM_ERROR_ARGUMENT;
+    }
+    if (fillTape(&machine->tape, content, (long)length) != 0) {
+        return TM_ERROR_MEMORY;
+    }
+    // a k-tape machine gets its own other tapes back
+    const struct MultiTape* multi = machine->machine.multi;
+    if (multi != NULL) {
+        for (int t = 0; t < multi->numTapes - 1; t++) {
+            const struct Tape* tape = &multi->tapes[t];
+            if (fillTape(&machine->multi.tapes[t], tape->cells + tape->origin + 1, tape->right - tape->origin) != 0) {
+                return TM_ERROR_MEMORY;
+            }
+        }
+    }
+    return TM_OK;
+}
+
+int tmResetTape(struct TmMachine* machine) {
+    const struct TuringMachine* tm = &machine->machine;
+    return tmSetTape(machine, tm->tape.cells + tm->tape.origin + 1, (size_t)(tm->tape.right - tm->tape.origin));
+}
+
+int tmRun(struct TmMachine* machine, struct TmResult* result) {
+    // the loaded machine is shared by every run, only the tapes belong to this one
+    struct TuringMachine tm = machine->machine;
+    tm.tape = machine->tape;
+    if (tm.multi != NULL) {
+        tm.multi = &machine->multi;
+    }
+    executeTM(&tm);
+    machine->tape = tm.tape;
+    if (tm.result.reason == RUN_OUT_OF_MEMORY) {
+        return TM_ERROR_MEMORY;
+    }
+
+    if (result != NULL) {
+        result->reason = tm.result.reason;
+        result->finalState = tm.result.finalState;
+        result->steps = tm.result.steps;
+        result->head = tm.result.head;
+        result->leftmost = tm.result.leftmost;
+        result->rightmost = tm.result.rightmost;
+        result->cellsTouched = tm.result.cellsTouched;
+    }
+    return TM_OK;
+}
+
+// Function to find a tape of the handle by its number - NULL when the machine does not have it
+static const struct Tape* handleTape(const struct TmMachine* machine, int tape) {
+    if (tape < 0 || tape >= tmNumTapes(machine)) {
+        return NULL;
+    }
+    return tape == 0 ? &machine->tape : &machine->multi.tapes[tape - 1];
+}
+
+const char* tmTape(const struct TmMachine* machine, int tape, int flags, size_t* length) {
+    const struct Tape* cells = handleTape(machine, tape);
+    if (cells == NULL) {
+        *length = 0;
+        return NULL;
+    }
+    long first, last;
+    tapeBounds(cells, flags & TM_TAPE_TRIM ? OUTPUT_TRIM : 0, &first, &last);
+    *length = last >= first ? (size_t)(last - first + 1) : 0;
+    return cells->cells + first;
+}
+
+long tmCompareTape(const struct TmMachine* machine, int tape, int flags, const char* expected, size_t length) {
+    const struct Tape* cells = handleTape(machine, tape);
+    if (cells == NULL || (expected == NULL && length > 0) || length > (size_t)LONG_MAX) {
+        return TM_COMPARE_INVALID;
+    }
+    return compareTape(cells, flags & TM_TAPE_TRIM ? OUTPUT_TRIM : 0, expected, (long)length);
+}
+
+int tmNumTapes(const struct TmMachine* machine) {
+    return machine->machine.multi != NULL ? machine->machine.multi->numTapes : 1;
+}
+
+const char* tmErrorString(int error) {
+    static const char* errors[] = {
+        "no error", "cannot read machine file", "malformed machine", "invalid machine image", "out of memory",
+        "not supported for this machine", "argument out of range"
+    };
+    return error >= 0 && error < (int)(sizeof(errors) / sizeof(errors[0])) ? errors[error] : "unknown error";
+}
+
+// The library build, see tm.h, leaves out the batch runner, the search of nondeterministic machines, the server and
+// the command line program
+#ifndef TM_LIBRARY
+
+// One job of a batch - a machine and the tape to run it on, plus the result of the run
+struct BatchJob {
+    const struct TuringMachine* machine;    // loaded machine, shared by every job that names the same file
+    char* input;                            // tape content without the 'A' cell, NULL for the machine file's own tape
+    long inputLength;
+    struct RunResult result;                // result: why the run stopped, steps and tape extent
+    char* finalTape;                        // result: copy of the visited cells of the final tape
+    double seconds;                         // result: time spent running the job
+};
+
+// Range of job indices owned by one worker of a pool - each worker takes jobs from its own range and steals
+// from the others when it runs out; range packs the next job in the low 32 bits and the end in the high 32 bits
+struct WorkRange {
+    unsigned long long range __attribute__((aligned(64)));   // own cache line, workers update it concurrently
+};
+
+// Worker thread of the batch pool
+struct BatchWorker {
+    pthread_t thread;
+    int outputFlags;        // OUTPUT_TRIM for the copies of the final tapes
+    struct BatchJob* jobs;
+    struct WorkRange* ranges;   // ranges of all workers, indexed by id
+    int numWorkers;
+    int id;
+    struct Tape arena;      // tape buffer reused by every job this worker runs
+};
+
+// Function to hand every worker an equal slice of numJobs jobs, stealing evens out the rest
+static void splitJobs(struct WorkRange* ranges, int numWorkers, unsigned numJobs) {
+    for (int i = 0; i < numWorkers; i++) {
+        unsigned first = (unsigned)((unsigned long long)numJobs * i / numWorkers);
+        unsigned end = (unsigned)((unsigned long long)numJobs * (i + 1) / numWorkers);
+        __atomic_store_n(&ranges[i].range, ((unsigned long long)end << 32) | first, __ATOMIC_RELEASE);
+    }
+}
+
+// Take the next job from the worker's own range
+static int popJob(struct WorkRange* own, unsigned* job) {
+    unsigned long long range = __atomic_load_n(&own->range, __ATOMIC_ACQUIRE);
+    while (1) {
+        unsigned next = (unsigned)range;
+        unsigned end = (unsigned)(range >> 32);
+        if (next >= end) {
+            return 0;
+        }
+        unsigned long long updated = ((unsigned long long)end << 32) | (next + 1);
+        if (__atomic_compare_exchange_n(&own->range, &range, updated, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *job = next;
+            return 1;
+        }
+    }
+}
+
+// Steal the upper half of another worker's remaining range - only called when the thief's own range is empty,
+// so no other thread can be taking jobs from it at the same time
+static int stealJobs(struct WorkRange* ranges, int numWorkers, int thief) {
+    for (int i = 1; i < numWorkers; i++) {
+        struct WorkRange* victim = &ranges[(thief + i) % numWorkers];
+        unsigned long long range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+        while (1) {
+            unsigned next = (unsigned)range;
+            unsigned end = (unsigned)(range >> 32);
+            if (next >= end) {
+                break;
+            }
+            unsigned split = end - (end - next + 1) / 2;
+            unsigned long long kept = ((unsigned long long)split << 32) | next;
+            if (__atomic_compare_exchange_n(&victim->range, &range, kept, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&ranges[thief].range, ((unsigned long long)end << 32) | split, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Run a single job on the worker's tape arena
+static void runJob(struct BatchWorker* worker, struct BatchJob* job) {
+    double start = now();
+
+    // the transition table is shared read-only, only the tape belongs to this job
+    struct TuringMachine tm = *job->machine;
+    tm.tape = worker->arena;
+    if (job->input != NULL) {
+        resetTape(&tm.tape, job->input, job->inputLength);
+    } else {
+        // the machine file's own tape, everything after the 'A' cell
+        const struct Tape* tape = &job->machine->tape;
+        resetTape(&tm.tape, tape->cells + tape->origin + 1, tape->right - tape->origin);
+    }
+    // a k-tape machine gets fresh copies of its other tapes as well
+    struct MultiTape multi;
+    if (job->machine->multi != NULL) {
+        multi = *job->machine->multi;
+        for (int t = 0; t < multi.numTapes - 1; t++) {
+            const struct Tape* tape = &job->machine->multi->tapes[t];
+            memset(&multi.tapes[t], 0, sizeof(struct Tape));
+            resetTape(&multi.tapes[t], tape->cells + tape->origin + 1, tape->right - tape->origin);
+        }
+        tm.multi = &multi;
+    }
+    executeTM(&tm);
+    worker->arena = tm.tape;
+    if (tm.multi != NULL) {
+        for (int t = 0; t < multi.numTapes - 1; t++) {
+            free(multi.tapes[t].cells);
+        }
+    }
+
+    long first, last;
+    tapeBounds(&tm.tape, worker->outputFlags, &first, &last);
+    long length = last - first + 1;
+    job->finalTape = (char*)malloc(length + 1);
+    memcpy(job->finalTape, tm.tape.cells + first, length);
+    job->finalTape[length] = '\0';
+    job->result = tm.result;
+    job->seconds = now() - start;
+}
+
+// Command line options
+struct Options {
+    const char* manifestName;   // batch mode manifest
+    const char* serveName;      // server mode: socket to listen on
+    const char* machineName;    // machine file to run
+    const char* imageName;      // compile mode: image file to write
+    const char* outputName;     // file to write the final tape to, NULL for standard output
+    int numThreads;             // batch mode threads, 0 for one per core
+    int engine;
+    long long maxSteps;
+    double maxSeconds;
+    int outputFlags;            // OUTPUT_ flags for the final tape
+    int showStats;
+    int detectLoops;            // stop machines that provably never halt
+    int optimize;               // optimize the transition table before running
+    int macroBlock;             // cells per block of a macro machine run, 0 to run the machine itself
+    const char* checkpointName;     // file to checkpoint the run to
+    long long checkpointInterval;   // steps between checkpoints, 0 for the default
+    const char* resumeName;         // checkpoint to resume the run from
+    int sparseTape;             // run on a sparse tape
+    int nondeterministic;       // explore every rule for a state and symbol
+    int verifyImages;           // check the data checksum of the images loaded too
+    long long maxConfigurations;    // configuration budget of the explorer, 0 for none
+    const char* profileName;    // file to write the profile report to, "-" for standard output
+    const char* traceName;      // file to write the sampled step trace to
+    long long traceEvery;       // steps between trace samples, 0 for every step
+    const char* printTraceName; // trace file to print as text
+    const char* expectName;     // file with the tape the final tape is checked against, NULL for none
+    long cacheEntries;          // results the result cache keeps, 0 for no cache
+    const char* cacheStoreName; // file the result cache is kept in between runs, NULL for none
+};
+
+// Function to open the result cache the options ask for, NULL for none
+static struct ResultCache* openOptionsCache(const struct Options* options) {
+    if (options->cacheEntries == 0 && options->cacheStoreName == NULL) {
+        return NULL;
+    }
+    return openResultCache(options->cacheEntries > 0 ? options->cacheEntries : CACHE_ENTRIES,
+                           options->cacheStoreName);
+}
+
+static void* batchWorker(void* argument) {
+    struct BatchWorker* worker = (struct BatchWorker*)argument;
+    unsigned job;
+    do {
+        while (popJob(&worker->ranges[worker->id], &job)) {
+            runJob(worker, &worker->jobs[job]);
+        }
+    } while (stealJobs(worker->ranges, worker->numWorkers, worker->id));
+    return NULL;
+}
+
+// Batch mode - run every job of a manifest on a pool of threads
+// Each manifest line names a machine file and optionally the tape to run it on instead of the file's own tape,
+// blank lines and lines starting with '#' are skipped; each machine file is loaded only once
+static int runBatch(const struct Options* options) {
+    const char* manifestName = options->manifestName;
+    int numThreads = options->numThreads;
+    FILE* manifest = fopen(manifestName, "r");
+    if (!manifest) {
+        printf("Enter valid manifest file. \n");
+        return 1;
+    }
+
+    int numJobs = 0, jobsCapacity = 64;
+    struct BatchJob* jobs = (struct BatchJob*)malloc(jobsCapacity * sizeof(struct BatchJob));
+    int numMachines = 0, machinesCapacity = 8;
+    struct TuringMachine* machines = (struct TuringMachine*)malloc(machinesCapacity * sizeof(struct TuringMachine));
+    char** machineNames = (char**)malloc(machinesCapacity * sizeof(char*));
+    // index of each job's machine - jobs only point at their machine once the machines array stops moving
+    int* machineOfJob = (int*)malloc(jobsCapacity * sizeof(int));
+    struct ResultCache* cache = openOptionsCache(options);
+
+    double loadStart = now();
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    while (getline(&line, &lineCapacity, manifest) != -1) {
+        char* machineName = strtok(line, " \t\r\n");
+        if (machineName == NULL || machineName[0] == '#') {
+            continue;
+        }
+        char* input = strtok(NULL, " \t\r\n");
+
+        // find the machine among the ones already loaded, or load it
+        int machine = numMachines - 1;
+        while (machine >= 0 && strcmp(machineNames[machine], machineName) != 0) {
+            machine--;
+        }
+        if (machine < 0) {
+            if (numMachines == machinesCapacity) {
+                machinesCapacity *= 2;
+                machines = (struct TuringMachine*)realloc(machines, machinesCapacity * sizeof(struct TuringMachine));
+                machineNames = (char**)realloc(machineNames, machinesCapacity * sizeof(char*));
+            }
+            machines[numMachines] = loadTM(machineName, options->verifyImages ? LOAD_VERIFY : 0);
+            if (options->optimize) {
+                optimizeTM(&machines[numMachines]);
+            }
+            machines[numMachines].maxSteps = options->maxSteps;
+            machines[numMachines].maxSeconds = options->maxSeconds;
+            machines[numMachines].detectLoops = options->detectLoops;
+            if (cache != NULL) {
+                attachCache(&machines[numMachines], cache);
+            }
+            selectEngine(&machines[numMachines], options->engine);
+            machineNames[numMachines] = strdup(machineName);
+            machine = numMachines++;
+        }
+
+        if (numJobs == jobsCapacity) {
+            jobsCapacity *= 2;
+            jobs = (struct BatchJob*)realloc(jobs, jobsCapacity * sizeof(struct BatchJob));
+            machineOfJob = (int*)realloc(machineOfJob, jobsCapacity * sizeof(int));
+        }
+        struct BatchJob* job = &jobs[numJobs];
+        memset(job, 0, sizeof(struct BatchJob));
+        machineOfJob[numJobs] = machine;
+        if (input != NULL) {
+            job->input = strdup(input);
+            job->inputLength = (long)strlen(input);
+        }
+        numJobs++;
+    }
+    free(line);
+    fclose(manifest);
+
+    for (int i = 0; i < numJobs; i++) {
+        jobs[i].machine = &machines[machineOfJob[i]];
+    }
+    double loadSeconds = now() - loadStart;
+
+    // one thread per core by default, and no more threads than jobs
+    if (numThreads <= 0) {
+        numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (numThreads > numJobs) {
+        numThreads = numJobs > 0 ? numJobs : 1;
+    }
+    struct WorkRange* ranges;
+    if (posix_memalign((void**)&ranges, 64, numThreads * sizeof(struct WorkRange)) != 0) {
+        printf("Out of memory for batch workers. \n");
+        return 1;
+    }
+    struct BatchWorker* workers = (struct BatchWorker*)calloc(numThreads, sizeof(struct BatchWorker));
+    double runStart = now();
+    splitJobs(ranges, numThreads, (unsigned)numJobs);
+    for (int i = 0; i < numThreads; i++) {
+        struct BatchWorker* worker = &workers[i];
+        worker->jobs = jobs;
+        worker->ranges = ranges;
+        worker->numWorkers = numThreads;
+        worker->id = i;
+        worker->outputFlags = options->outputFlags & OUTPUT_TRIM;
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_create(&workers[i].thread, NULL, batchWorker, &workers[i]);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].arena.cells);
+    }
+    double runSeconds = now() - runStart;
+    free(workers);
+    free(ranges);
+
+    // per job results, in manifest order, through a large buffer since there is no prompt to show
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+    long long totalSteps = 0;
+    for (int i = 0; i < numJobs; i++) {
+        struct BatchJob* job = &jobs[i];
+        printf("Job %d (%s): %s after %lld steps in %.6f s, head at %ld, final tape contents: %s\n",
+               i + 1, machineNames[machineOfJob[i]], runReasons[job->result.reason], job->result.steps,
+               job->seconds, job->result.head, job->finalTape);
+        totalSteps += job->result.steps;
+        free(job->finalTape);
+        free(job->input);
+    }
+    printf("Ran %d jobs over %d machines on %d threads: load %.6f s, run %.6f s, %.0f jobs/s, %.0f steps/s\n",
+           numJobs, numMachines, numThreads, loadSeconds, runSeconds,
+           runSeconds > 0 ? numJobs / runSeconds : 0.0, runSeconds > 0 ? totalSteps / runSeconds : 0.0);
+    if (cache != NULL) {
+        printf("Result cache: %lld hits, %lld misses, %ld results kept\n", cache->hits, cache->misses, cache->count);
+        closeResultCache(cache);
+    }
+
+    for (int i = 0; i < numMachines; i++) {
+        cleanUp(&machines[i]);
+        free(machineNames[i]);
+    }
+    free(machines);
+    free(machineNames);
+    free(machineOfJob);
+    free(jobs);
+    return 0;
+}
+
+// Nondeterministic explorer - searches the tree of configurations breadth first, one level of steps at a time,
+// for a branch that reaches the end state; the configurations of a level are expanded by a pool of threads
+// that take them from work ranges like the batch pool, and every configuration seen is kept in a set so no
+// configuration is expanded twice
+// Tapes are split into pages shared by all the configurations that have not written to them
+#define ND_PAGE_SIZE 64             // cells per tape page
+#define ND_SHARDS 64                // independently locked parts of the set of seen configurations
+#define ND_ARENA_BLOCK (1 << 20)    // bytes per block of a worker's arena
+
+// Verdicts of the explorer
+#define ND_ACCEPTED 0           // some branch reaches the end state
+#define ND_REJECTED 1           // every branch halts without reaching it, or loops through seen configurations
+#define ND_STEP_LIMIT 2         // branches left after the step budget
+#define ND_TIME_LIMIT 3
+#define ND_CONFIG_LIMIT 4       // configuration budget used up
+
+static const char* ndVerdicts[] = {
+    "accepted", "rejected", "step limit exceeded", "time limit exceeded", "configuration limit exceeded"
+};
+
+// Tape page - never changed once a configuration refers to it, a write copies the page
+struct NdPage {
+    uint64_t hash;      // hash of the cells, 0 for a page of blanks
+    char cells[ND_PAGE_SIZE];
+};
+
+// Configuration of a nondeterministic machine - state, head and tape, plus the step that led to it
+// Cell indices count from the first cell of the first page; the 'A' cell starts a page, so configurations
+// with the same tape content have the same page at the same offset from origin
+struct NdConfig {
+    const struct NdConfig* parent;      // configuration this one was reached from, NULL for the start
+    struct NdConfig* nextInSet;         // chain of its bucket in the set of seen configurations
+    struct NdPage** pages;              // shared with the parent unless a page was written or added
+    uint64_t tapeHash;                  // XOR of the hashes of the pages holding more than blanks, mixed with their offsets
+    uint64_t hash;                      // hash of the whole configuration
+    long numPages;
+    long origin;                        // index of the 'A' cell
+    long head;
+    long left;                          // leftmost cell visited
+    long right;                         // rightmost cell visited
+    long long depth;                    // steps from the start
+    int state;
+    struct Instruction via;             // rule applied to reach this configuration
+    char read;                          // symbol read by that rule
+};
+
+// Part of the set of seen configurations - chained hash table behind its own lock
+struct NdShard {
+    pthread_mutex_t lock;
+    struct NdConfig** buckets;
+    size_t numBuckets;      // power of two
+    size_t count;
+};
+
+// Memory of one worker - configurations and pages live until the search ends, so they are carved out of large
+// blocks and freed all at once; each block starts with a pointer to the previous one
+struct NdArena {
+    char* block;
+    size_t used;
+    size_t size;
+};
+
+// Barrier between the levels of the search
+struct NdBarrier {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int count;
+    int waiting;
+    unsigned generation;
+};
+
+struct NdSearch;
+
+struct NdWorker {
+    struct NdSearch* search;
+    pthread_t thread;
+    int id;
+    struct NdArena arena;
+    struct NdConfig** next;     // new configurations found on this level
+    long numNext;
+    long nextCapacity;
+};
+
+struct NdSearch {
+    const struct NdTable* table;
+    int endState;
+    struct NdShard shards[ND_SHARDS];
+    struct NdWorker* workers;
+    struct WorkRange* ranges;
+    int numWorkers;
+    struct NdBarrier barrier;
+    struct NdConfig** frontier;         // configurations of the current level
+    long frontierSize;
+    long long depth;                    // steps to reach the current level
+    long long maxSteps;
+    double maxSeconds;
+    double start;
+    long long maxConfigs;
+    long long numConfigs;               // configurations seen, updated atomically
+    const struct NdConfig* accepted;    // first configuration found in the end state, set atomically
+    int stop;                           // set when a level should be cut short
+    int done;                           // set between levels when the search is over
+    int verdict;                        // one of the ND_ codes
+};
+
+static struct NdPage blankPage;
+
+static void* ndAlloc(struct NdArena* arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (arena->block == NULL || arena->used + size > arena->size) {
+        size_t blockSize = size + 16 > ND_ARENA_BLOCK ? size + 16 : ND_ARENA_BLOCK;
+        char* block = (char*)malloc(blockSize);
+        if (block == NULL) {
+            printf("Out of memory for configurations. \n");
+            exit(1);
+        }
+        *(char**)block = arena->block;
+        arena->block = block;
+        arena->size = blockSize;
+        arena->used = 16;
+    }
+    void* memory = arena->block + arena->used;
+    arena->used += size;
+    return memory;
+}
+
+static void ndFreeArena(struct NdArena* arena) {
+    while (arena->block != NULL) {
+        char* previous = *(char**)arena->block;
+        free(arena->block);
+        arena->block = previous;
+    }
+}
+
+static void barrierWait(struct NdBarrier* barrier) {
+    pthread_mutex_lock(&barrier->lock);
+    unsigned generation = barrier->generation;
+    if (++barrier->waiting == barrier->count) {
+        barrier->waiting = 0;
+        barrier->generation++;
+        pthread_cond_broadcast(&barrier->changed);
+    } else {
+        while (generation == barrier->generation) {
+            pthread_cond_wait(&barrier->changed, &barrier->lock);
+        }
+    }
+    pthread_mutex_unlock(&barrier->lock);
+}
+
+// Share of a page in the tape hash - nothing for pages of blanks, so a tape hashes the same however far it extends
+static uint64_t pageShare(const struct NdPage* page, long offset) {
+    return page->hash == 0 ? 0 : mixHash(page->hash ^ ((uint64_t)offset * 0x9e3779b97f4a7c15ULL));
+}
+
+static void hashPage(struct NdPage* page) {
+    if (memcmp(page->cells, blankPage.cells, ND_PAGE_SIZE) == 0) {
+        page->hash = 0;
+    } else {
+        page->hash = hashBytes(page->cells, ND_PAGE_SIZE, HASH_SEED) | 1;
+    }
+}
+
+static void hashConfig(struct NdConfig* config) {
+    uint64_t position = (uint64_t)(config->head - config->origin);
+    config->hash = mixHash(((uint64_t)config->state << 40) ^ position) ^ config->tapeHash;
+}
+
+// Page of a configuration by its offset in pages from the 'A' cell, blank outside the pages it holds
+static const struct NdPage* ndPage(const struct NdConfig* config, long offset) {
+    long index = offset + config->origin / ND_PAGE_SIZE;
+    return index >= 0 && index < config->numPages ? config->pages[index] : &blankPage;
+}
+
+static int sameConfig(const struct NdConfig* a, const struct NdConfig* b) {
+    if (a->hash != b->hash || a->tapeHash != b->tapeHash || a->state != b->state
+        || a->head - a->origin != b->head - b->origin) {
+        return 0;
+    }
+    long aFirst = -(a->origin / ND_PAGE_SIZE), bFirst = -(b->origin / ND_PAGE_SIZE);
+    long first = aFirst < bFirst ? aFirst : bFirst;
+    long aEnd = aFirst + a->numPages, bEnd = bFirst + b->numPages;
+    long end = aEnd > bEnd ? aEnd : bEnd;
+    for (long offset = first; offset < end; offset++) {
+        const struct NdPage* aPage = ndPage(a, offset);
+        const struct NdPage* bPage = ndPage(b, offset);
+        if (aPage != bPage && (aPage->hash != bPage->hash || memcmp(aPage->cells, bPage->cells, ND_PAGE_SIZE) != 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to add a configuration to the set of seen configurations - returns 0 when it was already there
+static int insertConfig(struct NdSearch* search, struct NdConfig* config) {
+    struct NdShard* shard = &search->shards[config->hash >> 58];
+    pthread_mutex_lock(&shard->lock);
+    size_t bucket = config->hash & (shard->numBuckets - 1);
+    for (const struct NdConfig* seen = shard->buckets[bucket]; seen != NULL; seen = seen->nextInSet) {
+        if (sameConfig(seen, config)) {
+            pthread_mutex_unlock(&shard->lock);
+            return 0;
+        }
+    }
+    config->nextInSet = shard->buckets[bucket];
+    shard->buckets[bucket] = config;
+    if (++shard->count > shard->numBuckets) {
+        // double the buckets, the chains are split by the next bit of the hash
+        size_t numBuckets = shard->numBuckets * 2;
+        struct NdConfig** buckets = (struct NdConfig**)calloc(numBuckets, sizeof(struct NdConfig*));
+        for (size_t i = 0; i < shard->numBuckets; i++) {
+            struct NdConfig* chain = shard->buckets[i];
+            while (chain != NULL) {
+                struct NdConfig* following = chain->nextInSet;
+                size_t moved = chain->hash & (numBuckets - 1);
+                chain->nextInSet = buckets[moved];
+                buckets[moved] = chain;
+                chain = following;
+            }
+        }
+        free(shard->buckets);
+        shard->buckets = buckets;
+        shard->numBuckets = numBuckets;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return 1;
+}
+
+// Function to apply one choice to a configuration - pages are copied only when they are written, and the page
+// list only when a page is written or added
+static struct NdConfig* ndStep(struct NdArena* arena, const struct NdConfig* config, struct Instruction choice, char read) {
+    struct NdConfig* successor = (struct NdConfig*)ndAlloc(arena, sizeof(struct NdConfig));
+    *successor = *config;
+    successor->parent = config;
+    successor->via = choice;
+    successor->read = read;
+    successor->depth++;
+    successor->state = choice.nextState;
+
+    long head = config->head;
+    if (choice.write != read) {
+        long index = head / ND_PAGE_SIZE;
+        const struct NdPage* page = config->pages[index];
+        struct NdPage* written = (struct NdPage*)ndAlloc(arena, sizeof(struct NdPage));
+        memcpy(written->cells, page->cells, ND_PAGE_SIZE);
+        written->cells[head % ND_PAGE_SIZE] = choice.write;
+        hashPage(written);
+        long offset = index - config->origin / ND_PAGE_SIZE;
+        successor->tapeHash ^= pageShare(page, offset) ^ pageShare(written, offset);
+        successor->pages = (struct NdPage**)ndAlloc(arena, config->numPages * sizeof(struct NdPage*));
+        memcpy(successor->pages, config->pages, config->numPages * sizeof(struct NdPage*));
+        successor->pages[index] = written;
+    }
+
+    if (choice.move == MOVE_LEFT && head == 0) {
+        // add a blank page in front, shifting every index by a page
+        struct NdPage** pages = (struct NdPage**)ndAlloc(arena, (successor->numPages + 1) * sizeof(struct NdPage*));
+        pages[0] = &blankPage;
+        memcpy(pages + 1, successor->pages, successor->numPages * sizeof(struct NdPage*));
+        successor->pages = pages;
+        successor->numPages++;
+        successor->origin += ND_PAGE_SIZE;
+        successor->left += ND_PAGE_SIZE;
+        successor->right += ND_PAGE_SIZE;
+        head += ND_PAGE_SIZE;
+    } else if (choice.move == MOVE_RIGHT && head == successor->numPages * ND_PAGE_SIZE - 1) {
+        struct NdPage** pages = (struct NdPage**)ndAlloc(arena, (successor->numPages + 1) * sizeof(struct NdPage*));
+        memcpy(pages, successor->pages, successor->numPages * sizeof(struct NdPage*));
+        pages[successor->numPages] = &blankPage;
+        successor->pages = pages;
+        successor->numPages++;
+    }
+    head += choice.move;
+    successor->head = head;
+    if (head < successor->left) {
+        successor->left = head;
+    }
+    if (head > successor->right) {
+        successor->right = head;
+    }
+    hashConfig(successor);
+    return successor;
+}
+
+// Function to expand one configuration of the current level into every configuration its choices lead to
+static void ndExpand(struct NdWorker* worker, const struct NdConfig* config) {
+    struct NdSearch* search = worker->search;
+    const struct NdTable* table = search->table;
+    char read = config->pages[config->head / ND_PAGE_SIZE]->cells[config->head % ND_PAGE_SIZE];
+    long entry = (long)config->state * table->alphabetSize + table->symbolIndex[(unsigned char)read];
+    for (int k = table->first[entry]; k < table->first[entry + 1]; k++) {
+        struct Instruction choice = table->choices[k];
+        if (choice.move == MOVE_HALT) {
+            continue;   // the branch writes, then halts without reaching the end state
+        }
+
+        // a configuration seen before gives its memory straight back, unless it needed a new block
+        char* block = worker->arena.block;
+        size_t used = worker->arena.used;
+        struct NdConfig* successor = ndStep(&worker->arena, config, choice, read);
+        if (!insertConfig(search, successor)) {
+            if (worker->arena.block == block) {
+                worker->arena.used = used;
+            }
+            continue;
+        }
+
+        if (__atomic_add_fetch(&search->numConfigs, 1, __ATOMIC_RELAXED) >= search->maxConfigs) {
+            __atomic_store_n(&search->stop, 1, __ATOMIC_RELAXED);
+        }
+        if (successor->state == search->endState) {
+            const struct NdConfig* none = NULL;
+            __atomic_compare_exchange_n(&search->accepted, &none, successor, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            __atomic_store_n(&search->stop, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (worker->numNext == worker->nextCapacity) {
+            worker->nextCapacity = worker->nextCapacity * 2 + 64;
+            worker->next = (struct NdConfig**)realloc(worker->next, worker->nextCapacity * sizeof(struct NdConfig*));
+        }
+        worker->next[worker->numNext++] = successor;
+    }
+}
+
+// Function to move on to the next level, run by worker 0 while the others wait - gathers the new configurations
+// and decides whether the search is over
+static void ndNextLevel(struct NdSearch* search) {
+    long size = 0;
+    for (int i = 0; i < search->numWorkers; i++) {
+        size += search->workers[i].numNext;
+    }
+    search->frontier = (struct NdConfig**)realloc(search->frontier, (size + 1) * sizeof(struct NdConfig*));
+    search->frontierSize = 0;
+    for (int i = 0; i < search->numWorkers; i++) {
+        struct NdWorker* worker = &search->workers[i];
+        memcpy(search->frontier + search->frontierSize, worker->next, worker->numNext * sizeof(struct NdConfig*));
+        search->frontierSize += worker->numNext;
+        worker->numNext = 0;
+    }
+    search->depth++;
+
+    if (search->accepted != NULL) {
+        search->verdict = ND_ACCEPTED;
+    } else if (search->numConfigs >= search->maxConfigs) {
+        search->verdict = ND_CONFIG_LIMIT;
+    } else if (search->frontierSize == 0) {
+        search->verdict = ND_REJECTED;
+    } else if (search->depth >= search->maxSteps) {
+        search->verdict = ND_STEP_LIMIT;
+    } else if (search->maxSeconds > 0 && now() - search->start >= search->maxSeconds) {
+        search->verdict = ND_TIME_LIMIT;
+    } else {
+        splitJobs(search->ranges, search->numWorkers, (unsigned)search->frontierSize);
+        return;
+    }
+    search->done = 1;
+}
+
+static void* ndWorker(void* argument) {
+    struct NdWorker* worker = (struct NdWorker*)argument;
+    struct NdSearch* search = worker->search;
+    while (1) {
+        barrierWait(&search->barrier);
+        if (search->done) {
+            break;
+        }
+        unsigned job;
+        do {
+            while (!__atomic_load_n(&search->stop, __ATOMIC_RELAXED) && popJob(&search->ranges[worker->id], &job)) {
+                ndExpand(worker, search->frontier[job]);
+            }
+        } while (!__atomic_load_n(&search->stop, __ATOMIC_RELAXED)
+                 && stealJobs(search->ranges, search->numWorkers, worker->id));
+        barrierWait(&search->barrier);
+        if (worker->id == 0) {
+            ndNextLevel(search);
+        }
+    }
+    return NULL;
+}
+
+// Function to print the verdict of the explorer, with the path and final tape of an accepting branch
+static void printNdResult(const struct NdSearch* search) {
+    printf("Nondeterministic run %s after %lld steps, %lld configurations explored\n",
+           ndVerdicts[search->verdict], search->depth, search->numConfigs);
+    const struct NdConfig* accepted = search->accepted;
+    if (accepted == NULL) {
+        return;
+    }
+
+    // the path is followed back from the accepting configuration, so it is printed from the end of the array
+    const struct NdConfig** path = (const struct NdConfig**)malloc((accepted->depth + 1) * sizeof(struct NdConfig*));
+    long long length = 0;
+    for (const struct NdConfig* config = accepted; config->parent != NULL; config = config->parent) {
+        path[length++] = config;
+    }
+    printf("Accepting path:\n");
+    for (long long i = length - 1; i >= 0; i--) {
+        const struct NdConfig* config = path[i];
+        printf("  Step %lld: (%d,%c)->(%c,%c,%d)\n", length - i, config->parent->state, config->read,
+               config->via.write, config->via.move == MOVE_LEFT ? 'L' : 'R', config->state);
+    }
+    free(path);
+
+    printf("Final tape contents: ");
+    for (long i = accepted->left; i <= accepted->right; i++) {
+        putchar(accepted->pages[i / ND_PAGE_SIZE]->cells[i % ND_PAGE_SIZE]);
+    }
+    printf("\n");
+}
+
+// Explore every branch of a nondeterministic machine on numThreads threads (one per core for 0)
+// The step budget bounds the depth of the search and the configuration budget its memory
+static int exploreTM(struct TuringMachine* tm, int numThreads, long long maxConfigs) {
+    struct NdSearch search;
+    memset(&search, 0, sizeof(search));
+    search.table = tm->nondet;
+    search.endState = tm->endState;
+    search.maxSteps = tm->maxSteps > 0 ? tm->maxSteps : LLONG_MAX;
+    search.maxSeconds = tm->maxSeconds;
+    search.maxConfigs = maxConfigs > 0 ? maxConfigs : LLONG_MAX;
+    search.start = now();
+    for (int i = 0; i < ND_SHARDS; i++) {
+        pthread_mutex_init(&search.shards[i].lock, NULL);
+        search.shards[i].numBuckets = 1024;
+        search.shards[i].buckets = (struct NdConfig**)calloc(1024, sizeof(struct NdConfig*));
+        if (search.shards[i].buckets == NULL) {
+            printf("Out of memory for configurations. \n");
+            return 1;
+        }
+    }
+    memset(blankPage.cells, BLANK, ND_PAGE_SIZE);
+    blankPage.hash = 0;
+
+    if (numThreads <= 0) {
+        numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    search.numWorkers = numThreads;
+    search.workers = (struct NdWorker*)calloc(numThreads, sizeof(struct NdWorker));
+    if (search.workers == NULL || posix_memalign((void**)&search.ranges, 64, numThreads * sizeof(struct WorkRange)) != 0) {
+        printf("Out of memory for explorer workers. \n");
+        return 1;
+    }
+    pthread_mutex_init(&search.barrier.lock, NULL);
+    pthread_cond_init(&search.barrier.changed, NULL);
+    search.barrier.count = numThreads;
+    for (int i = 0; i < numThreads; i++) {
+        search.workers[i].search = &search;
+        search.workers[i].id = i;
+    }
+
+    // the start configuration holds the tape as loaded, with the 'A' cell at the start of the first page
+    const struct Tape* tape = &tm->tape;
+    long length = tape->right - tape->origin + 1;
+    struct NdArena* arena = &search.workers[0].arena;
+    struct NdConfig* start = (struct NdConfig*)ndAlloc(arena, sizeof(struct NdConfig));
+    memset(start, 0, sizeof(struct NdConfig));
+    start->numPages = length / ND_PAGE_SIZE + 1;
+    start->pages = (struct NdPage**)ndAlloc(arena, start->numPages * sizeof(struct NdPage*));
+    for (long i = 0; i < start->numPages; i++) {
+        struct NdPage* page = (struct NdPage*)ndAlloc(arena, sizeof(struct NdPage));
+        memset(page->cells, BLANK, ND_PAGE_SIZE);
+        long count = length - i * ND_PAGE_SIZE < ND_PAGE_SIZE ? length - i * ND_PAGE_SIZE : ND_PAGE_SIZE;
+        memcpy(page->cells, tape->cells + tape->origin + i * ND_PAGE_SIZE, count);
+        hashPage(page);
+        start->pages[i] = page;
+        start->tapeHash ^= pageShare(page, i);
+    }
+    start->right = length - 1;
+    start->state = tm->startState;
+    hashConfig(start);
+    insertConfig(&search, start);
+    search.numConfigs = 1;
+    search.frontier = (struct NdConfig**)malloc(sizeof(struct NdConfig*));
+    if (search.frontier == NULL) {
+        printf("Out of memory for configurations. \n");
+        exit(1);
+    }
+    search.frontier[0] = start;
+    search.frontierSize = 1;
+    if (start->state == search.endState) {
+        search.accepted = start;
+        search.verdict = ND_ACCEPTED;
+        search.done = 1;
+    } else {
+        splitJobs(search.ranges, numThreads, 1);
+    }
+
+    for (int i = 1; i < numThreads; i++) {
+        pthread_create(&search.workers[i].thread, NULL, ndWorker, &search.workers[i]);
+    }
+    ndWorker(&search.workers[0]);
+    for (int i = 1; i < numThreads; i++) {
+        pthread_join(search.workers[i].thread, NULL);
+    }
+
+    printNdResult(&search);
+
+    for (int i = 0; i < numThreads; i++) {
+        ndFreeArena(&search.workers[i].arena);
+        free(search.workers[i].next);
+    }
+    for (int i = 0; i < ND_SHARDS; i++) {
+        pthread_mutex_destroy(&search.shards[i].lock);
+        free(search.shards[i].buckets);
+    }
+    pthread_mutex_destroy(&search.barrier.lock);
+    pthread_cond_destroy(&search.barrier.changed);
+    free(search.frontier);
+    free(search.ranges);
+    free(search.workers);
+    return 0;
+}
+
+// Evaluation server - Project1 --serve <socket> keeps machines loaded and runs them for the clients of a Unix
+// domain socket. A client sends requests, each a ServeRequest header followed by its payload, and gets one
+// answer per request, a ServeResponse header followed by its payload. Answers may come in a different order
+// than their requests, so each one carries the tag of its request
+// One thread does all reading and accepting with epoll; a pool of workers loads and runs the machines and
+// writes the answers. Machines are cached by the hash of their file content and run on the workers' tape
+// arenas, like batch jobs
+// Frames are written in the byte order of the machine the server runs on
+#define SERVE_LOAD 1                    // payload: machine file or image - answer: the id of the machine
+#define SERVE_RUN 2                     // payload: tape content after the 'A' cell - answer: the result of the run
+#define SERVE_STATS 3                   // no payload - answer: statistics of the server, as lines of text
+#define SERVE_TAPE 1                    // flag of a run: answer with the final tape
+#define SERVE_TRIM 2                    // flag of a run: leave the blank cells at both ends of that tape out
+#define SERVE_MAX_PAYLOAD (1u << 30)    // a longer request closes the connection
+#define SERVE_BUCKETS 4096              // buckets of the machine cache
+#define SERVE_EVENTS 256                // epoll events handled per wait
+#define SERVE_READ_SIZE 65536           // bytes read from a connection at a time
+
+struct ServeRequest {
+    uint32_t length;            // payload bytes after the header
+    uint16_t type;              // one of the SERVE_ request types
+    uint16_t flags;             // SERVE_TAPE and SERVE_TRIM for a run
+    uint64_t tag;               // chosen by the client, sent back with the answer
+    uint64_t machine;           // run: id of the machine, as answered to its load
+    int64_t maxSteps;           // run: step budget, 0 for the server's own
+};
+
+struct ServeResponse {
+    uint32_t length;            // payload bytes after the header: final tape, statistics or error message
+    uint16_t type;              // type of the request answered
+    uint16_t status;            // TM_OK or one of the TM_ERROR_ codes
+    uint64_t tag;               // tag of the request answered
+    uint64_t machine;           // id of the machine loaded or run
+    int64_t steps;
+    int64_t head;               // positions are relative to the 'A' cell
+    int64_t leftmost;
+    int64_t rightmost;
+    int32_t reason;             // one of the RUN_ codes
+    int32_t finalState;
+    uint64_t nanoseconds;       // time spent running
+};
+
+#ifdef HAVE_SERVE
+// Machine in the cache - machines stay until the server stops, so workers run them without holding a lock
+struct ServeMachine {
+    uint64_t id;
+    struct TuringMachine tm;
+    struct ServeMachine* next;      // next machine in the same bucket
+};
+
+// Client connection - the reader and every request in flight hold a reference to it
+struct ServeConnection {
+    int fd;
+    pthread_mutex_t lock;           // guards the output and the fields after it
+    char* output;                   // answers not written yet
+    size_t outputSize;
+    size_t outputCapacity;
+    int refs;
+    int closed;                     // the reader has let go of the connection, answers are dropped
+    int failed;                     // a write failed, answers are dropped until the reader closes it
+    int waiting;                    // EPOLLOUT is armed for the rest of the output
+    char* input;                    // bytes read but not parsed yet - the reader's only
+    size_t inputSize;
+    size_t inputCapacity;
+    struct ServeConnection* prev;   // list of open connections - the reader's only
+    struct ServeConnection* next;
+};
+
+// Request waiting for a worker
+struct ServeJob {
+    struct ServeJob* next;
+    struct ServeConnection* connection;
+    struct ServeRequest request;
+    char payload[];
+};
+
+struct Server {
+    int epoll;
+    pthread_mutex_t queueLock;
+    pthread_cond_t queueReady;
+    struct ServeJob* first;         // queue of requests, oldest first
+    struct ServeJob* last;
+    int stopping;
+    pthread_rwlock_t machinesLock;
+    struct ServeMachine* buckets[SERVE_BUCKETS];
+    long numMachines;
+    struct ServeConnection* connections;
+    const struct Options* options;
+    double start;
+    long long requests;             // statistics, updated atomically
+    long long runs;
+    long long steps;
+    long long errors;
+    long long accepted;
+    long long open;
+    struct ResultCache* cache;      // results of the runs of every machine, NULL for none
+};
+
+struct ServeWorker {
+    pthread_t thread;
+    struct Server* server;
+    struct Tape arena;              // tape buffer reused by every run this worker does
+};
+
+static volatile sig_atomic_t serveStop = 0;
+
+static void stopServing(int signal) {
+    (void)signal;
+    serveStop = 1;
+}
+
+static struct ServeMachine* findMachine(struct Server* server, uint64_t id) {
+    pthread_rwlock_rdlock(&server->machinesLock);
+    struct ServeMachine* machine = server->buckets[id % SERVE_BUCKETS];
+    while (machine != NULL && machine->id != id) {
+        machine = machine->next;
+    }
+    pthread_rwlock_unlock(&server->machinesLock);
+    return machine;
+}
+
+static void releaseConnection(struct Server* server, struct ServeConnection* connection) {
+    pthread_mutex_lock(&connection->lock);
+    int last = --connection->refs == 0;
+    pthread_mutex_unlock(&connection->lock);
+    if (last) {
+        close(connection->fd);
+        pthread_mutex_destroy(&connection->lock);
+        free(connection->output);
+        free(connection->input);
+        free(connection);
+        __atomic_sub_fetch(&server->open, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Function to write as much of a connection's output as the socket takes, with its lock held
+// EPOLLOUT is armed while some output is left, so the reader writes the rest once the client catches up
+static void flushConnection(struct Server* server, struct ServeConnection* connection) {
+    size_t written = 0;
+    while (written < connection->outputSize) {
+        ssize_t count = send(connection->fd, connection->output + written, connection->outputSize - written,
+                             MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                connection->failed = 1;
+                written = connection->outputSize;
+            }
+            break;
+        }
+        written += (size_t)count;
+    }
+    memmove(connection->output, connection->output + written, connection->outputSize - written);
+    connection->outputSize -= written;
+
+    int waiting = connection->outputSize > 0;
+    if (waiting != connection->waiting) {
+        struct epoll_event event;
+        event.events = waiting ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.ptr = connection;
+        epoll_ctl(server->epoll, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->waiting = waiting;
+    }
+}
+
+// Function to send the answer to a request and let go of its connection
+static void answerRequest(struct Server* server, struct ServeConnection* connection, struct ServeResponse* response,
+                          const char* payload, size_t length) {
+    response->length = (uint32_t)length;
+    if (response->status != TM_OK) {
+        __atomic_add_fetch(&server->errors, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_lock(&connection->lock);
+    if (!connection->closed && !connection->failed) {
+        size_t needed = connection->outputSize + sizeof(struct ServeResponse) + length;
+        if (needed > connection->outputCapacity) {
+            size_t capacity = connection->outputCapacity > 0 ? connection->outputCapacity : 4096;
+            while (capacity < needed) {
+                capacity *= 2;
+            }
+            char* output = (char*)realloc(connection->output, capacity);
+            if (output == NULL) {
+                connection->failed = 1;
+            } else {
+                connection->output = output;
+                connection->outputCapacity = capacity;
+            }
+        }
+        if (!connection->failed) {
+            memcpy(connection->output + connection->outputSize, response, sizeof(struct ServeResponse));
+            if (length > 0) {
+                memcpy(connection->output + connection->outputSize + sizeof(struct ServeResponse), payload, length);
+            }
+            connection->outputSize = needed;
+            flushConnection(server, connection);
+        }
+    }
+    pthread_mutex_unlock(&connection->lock);
+    releaseConnection(server, connection);
+}
+
+// Function to load a machine into the cache, or find it there when the same file was loaded before
+static void serveLoad(struct Server* server, struct ServeJob* job, struct ServeResponse* response,
+                      char* message, size_t messageSize) {
+    const struct Options* options = server->options;
+    uint64_t id = hashBytes(job->payload, job->request.length, HASH_SEED);
+    if (findMachine(server, id) != NULL) {
+        response->machine = id;
+        return;
+    }
+
+    struct ServeMachine* machine = (struct ServeMachine*)calloc(1, sizeof(struct ServeMachine));
+    if (machine == NULL) {
+        response->status = (uint16_t)loadError(message, messageSize, TM_ERROR_MEMORY, "Out of memory for machine.", NULL);
+        return;
+    }
+    // clients are not trusted - an image is checksummed in full and its whole table is checked before the machine
+    // gets into the cache, so no request can make a worker run a table that points outside itself
+    int error = bufferMachine(job->payload, job->request.length, "machine", &machine->tm, message, messageSize);
+    if (error == TM_OK && machine->tm.multi != NULL) {
+        cleanUp(&machine->tm);
+        error = loadError(message, messageSize, TM_ERROR_UNSUPPORTED, "Multi-tape machines are not served.", NULL);
+    }
+    if (error != TM_OK) {
+        free(machine);
+        response->status = (uint16_t)error;
+        return;
+    }
+    machine->id = id;
+    if (options->optimize) {
+        optimizeTM(&machine->tm);
+    }
+    machine->tm.maxSeconds = options->maxSeconds;
+    machine->tm.detectLoops = options->detectLoops;
+    if (server->cache != NULL) {
+        attachCache(&machine->tm, server->cache);
+    }
+    selectEngine(&machine->tm, options->engine);
+
+    // another worker may have loaded the same file meanwhile - the first one stays
+    pthread_rwlock_wrlock(&server->machinesLock);
+    struct ServeMachine** bucket = &server->buckets[id % SERVE_BUCKETS];
+    struct ServeMachine* loaded = *bucket;
+    while (loaded != NULL && loaded->id != id) {
+        loaded = loaded->next;
+    }
+    if (loaded == NULL) {
+        machine->next = *bucket;
+        *bucket = machine;
+        server->numMachines++;
+    }
+    pthread_rwlock_unlock(&server->machinesLock);
+    if (loaded != NULL) {
+        cleanUp(&machine->tm);
+        free(machine);
+    }
+    response->machine = id;
+}
+
+// Function to run a cached machine on the worker's arena - returns the final tape to answer with, if any
+static const char* serveRun(struct ServeWorker* worker, struct ServeJob* job, struct ServeResponse* response,
+                            size_t* length, char* message, size_t messageSize) {
+    struct Server* server = worker->server;
+    const struct ServeRequest* request = &job->request;
+    *length = 0;
+    response->machine = request->machine;
+    struct ServeMachine* machine = findMachine(server, request->machine);
+    if (machine == NULL) {
+        response->status = (uint16_t)loadError(message, messageSize, TM_ERROR_ARGUMENT, "Unknown machine.", NULL);
+        return message;
+    }
+
+    // the transition table is shared read-only, only the tape belongs to this run
+    struct TuringMachine tm = machine->tm;
+    tm.tape = worker->arena;
+    if (fillTape(&tm.tape, job->payload, (long)request->length) != 0) {
+        worker->arena = tm.tape;
+        response->status = (uint16_t)loadError(message, messageSize, TM_ERROR_MEMORY, "Out of memory for tape.", NULL);
+        return message;
+    }
+    tm.maxSteps = request->maxSteps > 0 ? request->maxSteps : server->options->maxSteps;
+    double start = now();
+    executeTM(&tm);
+    response->nanoseconds = (uint64_t)((now() - start) * 1e9);
+    worker->arena = tm.tape;
+    if (tm.result.reason == RUN_OUT_OF_MEMORY) {
+        response->status = (uint16_t)loadError(message, messageSize, TM_ERROR_MEMORY, "Out of memory for tape.", NULL);
+        return message;
+    }
+
+    response->reason = tm.result.reason;
+    response->finalState = tm.result.finalState;
+    response->steps = tm.result.steps;
+    response->head = tm.result.head;
+    response->leftmost = tm.result.leftmost;
+    response->rightmost = tm.result.rightmost;
+    __atomic_add_fetch(&server->runs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&server->steps, tm.result.steps, __ATOMIC_RELAXED);
+    if (!(request->flags & SERVE_TAPE)) {
+        return NULL;
+    }
+    long first, last;
+    tapeBounds(&worker->arena, request->flags & SERVE_TRIM ? OUTPUT_TRIM : 0, &first, &last);
+    *length = last >= first ? (size_t)(last - first + 1) : 0;
+    return worker->arena.cells + first;
+}
+
+static void* serveWorker(void* argument) {
+    struct ServeWorker* worker = (struct ServeWorker*)argument;
+    struct Server* server = worker->server;
+    char message[LOAD_MESSAGE_SIZE];
+    while (1) {
+        pthread_mutex_lock(&server->queueLock);
+        while (server->first == NULL && !server->stopping) {
+            pthread_cond_wait(&server->queueReady, &server->queueLock);
+        }
+        struct ServeJob* job = server->first;
+        if (job != NULL) {
+            server->first = job->next;
+            if (server->first == NULL) {
+                server->last = NULL;
+            }
+        }
+        pthread_mutex_unlock(&server->queueLock);
+        if (job == NULL) {
+            break;
+        }
+
+        struct ServeResponse response;
+        memset(&response, 0, sizeof(response));
+        response.type = job->request.type;
+        response.tag = job->request.tag;
+        const char* payload = NULL;
+        size_t length = 0;
+        if (job->request.type == SERVE_LOAD) {
+            serveLoad(server, job, &response, message, sizeof(message));
+            if (response.status != TM_OK) {
+                payload = message;
+                length = strlen(message);
+            }
+        } else if (job->request.type == SERVE_RUN) {
+            payload = serveRun(worker, job, &response, &length, message, sizeof(message));
+            if (response.status != TM_OK) {
+                length = strlen(message);
+            }
+        } else if (job->request.type == SERVE_STATS) {
+            long long hits = 0, misses = 0;
+            if (server->cache != NULL) {
+                pthread_mutex_lock(&server->cache->lock);
+                hits = server->cache->hits;
+                misses = server->cache->misses;
+                pthread_mutex_unlock(&server->cache->lock);
+            }
+            snprintf(message, sizeof(message),
+                     "machines %ld\nrequests %lld\nruns %lld\nsteps %lld\nerrors %lld\nconnections %lld\nopen %lld\n"
+                     "hits %lld\nmisses %lld\nseconds %.3f\n", server->numMachines,
+                     __atomic_load_n(&server->requests, __ATOMIC_RELAXED), __atomic_load_n(&server->runs, __ATOMIC_RELAXED),
+                     __atomic_load_n(&server->steps, __ATOMIC_RELAXED), __atomic_load_n(&server->errors, __ATOMIC_RELAXED),
+                     __atomic_load_n(&server->accepted, __ATOMIC_RELAXED), __atomic_load_n(&server->open, __ATOMIC_RELAXED),
+                     hits, misses, now() - server->start);
+            payload = message;
+            length = strlen(message);
+        } else {
+            response.status = (uint16_t)loadError(message, sizeof(message), TM_ERROR_ARGUMENT, "Unknown request.", NULL);
+            payload = message;
+            length = strlen(message);
+        }
+        answerRequest(server, job->connection, &response, payload, length);
+        free(job);
+    }
+    return NULL;
+}
+
+static void acceptConnections(struct Server* server, int listener) {
+    while (1) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN once every pending connection is accepted; anything else is retried on the next event
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        struct ServeConnection* connection = (struct ServeConnection*)calloc(1, sizeof(struct ServeConnection));
+        if (connection == NULL) {
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->refs = 1;
+        pthread_mutex_init(&connection->lock, NULL);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = connection;
+        if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            pthread_mutex_destroy(&connection->lock);
+            free(connection);
+            continue;
+        }
+        connection->next = server->connections;
+        if (server->connections != NULL) {
+            server->connections->prev = connection;
+        }
+        server->connections = connection;
+        __atomic_add_fetch(&server->accepted, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&server->open, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Function to stop reading a connection - it is closed once the last answer in flight has let go of it
+static void closeConnection(struct Server* server, struct ServeConnection* connection) {
+    epoll_ctl(server->epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+    if (connection->prev != NULL) {
+        connection->prev->next = connection->next;
+    } else {
+        server->connections = connection->next;
+    }
+    if (connection->next != NULL) {
+        connection->next->prev = connection->prev;
+    }
+    pthread_mutex_lock(&connection->lock);
+    connection->closed = 1;
+    pthread_mutex_unlock(&connection->lock);
+    releaseConnection(server, connection);
+}
+
+// Function to read what a connection has sent and queue every complete request - returns -1 once the connection
+// is to be closed: the client hung up, or sent a request that is too long
+static int readConnection(struct Server* server, struct ServeConnection* connection) {
+    if (connection->inputCapacity - connection->inputSize < SERVE_READ_SIZE) {
+        size_t capacity = connection->inputCapacity > 0 ? connection->inputCapacity * 2 : SERVE_READ_SIZE * 2;
+        char* input = (char*)realloc(connection->input, capacity);
+        if (input == NULL) {
+            return -1;
+        }
+        connection->input = input;
+        connection->inputCapacity = capacity;
+    }
+    ssize_t count = recv(connection->fd, connection->input + connection->inputSize,
+                         connection->inputCapacity - connection->inputSize, 0);
+    if (count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        return -1;
+    }
+    if (count < 0) {
+        return 0;
+    }
+    connection->inputSize += (size_t)count;
+
+    // queue the complete requests all at once
+    struct ServeJob* first = NULL;
+    struct ServeJob* last = NULL;
+    int numJobs = 0;
+    size_t offset = 0;
+    int status = 0;
+    while (connection->inputSize - offset >= sizeof(struct ServeRequest)) {
+        struct ServeRequest request;
+        memcpy(&request, connection->input + offset, sizeof(request));
+        if (request.length > SERVE_MAX_PAYLOAD) {
+            status = -1;
+            break;
+        }
+        if (connection->inputSize - offset < sizeof(request) + request.length) {
+            break;
+        }
+        struct ServeJob* job = (struct ServeJob*)malloc(sizeof(struct ServeJob) + request.length);
+        if (job == NULL) {
+            status = -1;
+            break;
+        }
+        job->next = NULL;
+        job->connection = connection;
+        job->request = request;
+        memcpy(job->payload, connection->input + offset + sizeof(request), request.length);
+        if (last != NULL) {
+            last->next = job;
+        } else {
+            first = job;
+        }
+        last = job;
+        numJobs++;
+        offset += sizeof(request) + request.length;
+    }
+    memmove(connection->input, connection->input + offset, connection->inputSize - offset);
+    connection->inputSize -= offset;
+
+    if (numJobs > 0) {
+        pthread_mutex_lock(&connection->lock);
+        connection->refs += numJobs;
+        pthread_mutex_unlock(&connection->lock);
+        __atomic_add_fetch(&server->requests, numJobs, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&server->queueLock);
+        if (server->last != NULL) {
+            server->last->next = first;
+        } else {
+            server->first = first;
+        }
+        server->last = last;
+        pthread_mutex_unlock(&server->queueLock);
+        if (numJobs > 1) {
+            pthread_cond_broadcast(&server->queueReady);
+        } else {
+            pthread_cond_signal(&server->queueReady);
+        }
+    }
+    return status;
+}
+#endif
+
+// Server mode - answer the requests of clients on a Unix domain socket until SIGINT or SIGTERM
+static int runServer(const struct Options* options) {
+#ifndef HAVE_SERVE
+    (void)options;
+    printf("The server needs epoll, which this platform does not have. \n");
+    return 1;
+#else
+    const char* socketName = options->serveName;
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketName) >= sizeof(address.sun_path)) {
+        printf("Socket path %s is too long. \n", socketName);
+        return 1;
+    }
+    strcpy(address.sun_path, socketName);
+
+    // a socket left behind by an earlier server is replaced, any other file is not
+    struct stat status;
+    if (lstat(socketName, &status) == 0 && S_ISSOCK(status.st_mode)) {
+        unlink(socketName);
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(listener, SOMAXCONN) != 0) {
+        printf("Cannot listen on %s: %s \n", socketName, strerror(errno));
+        if (listener >= 0) {
+            close(listener);
+        }
+        return 1;
+    }
+
+    struct Server* server = (struct Server*)calloc(1, sizeof(struct Server));
+    server->options = options;
+    server->start = now();
+    server->cache = openOptionsCache(options);
+    pthread_mutex_init(&server->queueLock, NULL);
+    pthread_cond_init(&server->queueReady, NULL);
+    pthread_rwlock_init(&server->machinesLock, NULL);
+    server->epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;      // the listener is the only descriptor without a connection
+    epoll_ctl(server->epoll, EPOLL_CTL_ADD, listener, &event);
+
+    // the stop signals are only let through while waiting for events, so none is missed between two waits
+    sigset_t stopSignals, waitMask;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &waitMask);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServing;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // one worker per core by default, started with the stop signals blocked so only this thread takes them
+    int numThreads = options->numThreads > 0 ? options->numThreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    struct ServeWorker* workers = (struct ServeWorker*)calloc(numThreads, sizeof(struct ServeWorker));
+    for (int i = 0; i < numThreads; i++) {
+        workers[i].server = server;
+        pthread_create(&workers[i].thread, NULL, serveWorker, &workers[i]);
+    }
+    printf("Serving on %s with %d threads\n", socketName, numThreads);
+    fflush(stdout);
+
+    struct epoll_event events[SERVE_EVENTS];
+    while (!serveStop) {
+        int numEvents = epoll_pwait(server->epoll, events, SERVE_EVENTS, -1, &waitMask);
+        for (int i = 0; i < numEvents; i++) {
+            struct ServeConnection* connection = (struct ServeConnection*)events[i].data.ptr;
+            if (connection == NULL) {
+                acceptConnections(server, listener);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                pthread_mutex_lock(&connection->lock);
+                flushConnection(server, connection);
+                pthread_mutex_unlock(&connection->lock);
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && readConnection(server, connection) != 0) {
+                closeConnection(server, connection);
+            }
+        }
+    }
+
+    // the workers answer the requests already queued before they stop
+    pthread_mutex_lock(&server->queueLock);
+    server->stopping = 1;
+    pthread_cond_broadcast(&server->queueReady);
+    pthread_mutex_unlock(&server->queueLock);
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].arena.cells);
+    }
+    while (server->connections != NULL) {
+        closeConnection(server, server->connections);
+    }
+    printf("Served %lld requests, %lld runs of %ld machines\n", server->requests, server->runs, server->numMachines);
+
+    for (int b = 0; b < SERVE_BUCKETS; b++) {
+        while (server->buckets[b] != NULL) {
+            struct ServeMachine* machine = server->buckets[b];
+            server->buckets[b] = machine->next;
+            cleanUp(&machine->tm);
+            free(machine);
+        }
+    }
+    if (server->cache != NULL) {
+        closeResultCache(server->cache);
+    }
+    close(server->epoll);
+    close(listener);
+    unlink(socketName);
+    pthread_rwlock_destroy(&server->machinesLock);
+    pthread_cond_destroy(&server->queueReady);
+    pthread_mutex_destroy(&server->queueLock);
+    free(workers);
+    free(server);
+    pthread_sigmask(SIG_SETMASK, &waitMask, NULL);
+    return 0;
+#endif
+}
+
+static const char* engineNames[] = { "interpreter", "threaded", "jit" };
+
+// Function to read the command line into options - returns 0 when it is not valid
+static int parseOptions(int argc, char** argv, struct Options* options) {
+    memset(options, 0, sizeof(struct Options));
+    options->engine = ENGINE_INTERPRETER;
+    for (int i = 1; i < argc; i++) {
+        int hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--batch") == 0 && hasValue) {
+            options->manifestName = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && hasValue) {
+            options->serveName = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && hasValue) {
+            options->numThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-steps") == 0 && hasValue) {
+            options->maxSteps = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--max-seconds") == 0 && hasValue) {
+            options->maxSeconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--engine") == 0 && hasValue) {
+            i++;
+            options->engine = -1;
+            for (int engine = 0; engine < (int)(sizeof(engineNames) / sizeof(engineNames[0])); engine++) {
+                if (strcmp(argv[i], engineNames[engine]) == 0) {
+                    options->engine = engine;
+                }
+            }
+            if (options->engine < 0) {
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--compile") == 0 && hasValue) {
+            options->imageName = argv[++i];
+        } else if (strcmp(argv[i], "--verify-image") == 0) {
+            options->verifyImages = 1;
+        } else if (strcmp(argv[i], "--output") == 0 && hasValue) {
+            options->outputName = argv[++i];
+        } else if (strcmp(argv[i], "--trim") == 0) {
+            options->outputFlags |= OUTPUT_TRIM;
+        } else if (strcmp(argv[i], "--raw") == 0) {
+            options->outputFlags |= OUTPUT_RAW;
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && hasValue) {
+            options->checkpointName = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && hasValue) {
+            options->checkpointInterval = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--resume") == 0 && hasValue) {
+            options->resumeName = argv[++i];
+        } else if (strcmp(argv[i], "--sparse-tape") == 0) {
+            options->sparseTape = 1;
+        } else if (strcmp(argv[i], "--detect-loops") == 0) {
+            options->detectLoops = 1;
+        } else if (strcmp(argv[i], "--optimize") == 0) {
+            options->optimize = 1;
+        } else if (strcmp(argv[i], "--macro") == 0 && hasValue) {
+            options->macroBlock = atoi(argv[++i]);
+            if (options->macroBlock < 1 || options->macroBlock > MAX_MACRO_BLOCK) {
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--nondeterministic") == 0) {
+            options->nondeterministic = 1;
+        } else if (strcmp(argv[i], "--max-configurations") == 0 && hasValue) {
+            options->maxConfigurations = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--profile") == 0 && hasValue) {
+            options->profileName = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && hasValue) {
+            options->traceName = argv[++i];
+        } else if (strcmp(argv[i], "--trace-every") == 0 && hasValue) {
+            options->traceEvery = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--print-trace") == 0 && hasValue) {
+            options->printTraceName = argv[++i];
+        } else if (strcmp(argv[i], "--expect") == 0 && hasValue) {
+            options->expectName = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0 && hasValue) {
+            options->cacheEntries = atol(argv[++i]);
+            if (options->cacheEntries < 1) {
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--cache-store") == 0 && hasValue) {
+            options->cacheStoreName = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            options->showStats = 1;
+        } else if (argv[i][0] != '-') {
+            options->machineName = argv[i];
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    struct Options options;
+    if (!parseOptions(argc, argv, &options)) {
+        printf("Usage: %s [options] [machine file]\n"
+               "       %s --batch <manifest> [--threads <n>] [options]\n"
+               "       %s --serve <socket> [--threads <n>] [options]\n"
+               "       %s --compile <image> [machine file]\n"
+               "Options: --engine interpreter|threaded|jit  --max-steps <n>  --max-seconds <s>  --detect-loops  --stats\n"
+               "         --optimize  --macro <block size>  --cache <results>  --cache-store <file>\n"
+               "         --sparse-tape  --profile <report>  --trace <file> [--trace-every <n>]  --print-trace <file>\n"
+               "         --output <file>  --trim  --raw  --verify-image  --expect <tape file>\n"
+               "         --checkpoint <file> [--checkpoint-every <steps>]  --resume <checkpoint>\n"
+               "         --nondeterministic [--threads <n>] [--max-configurations <n>]\n", argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    // Batch mode: Project1 --batch <manifest> [--threads <n>]
+    if (options.manifestName != NULL) {
+        if (options.nondeterministic) {
+            printf("Nondeterministic machines run one at a time. \n");
+            return 1;
+        }
+        return runBatch(&options);
+    }
+
+    // Server mode: Project1 --serve <socket> [--threads <n>]
+    if (options.serveName != NULL) {
+        if (options.nondeterministic) {
+            printf("Nondeterministic machines run one at a time. \n");
+            return 1;
+        }
+        return runServer(&options);
+    }
+
+    // Print a trace written by a profiled run
+    if (options.printTraceName != NULL) {
+        return printTrace(options.printTraceName);
+    }
+
+    char fileName[100];
+    const char* machineName = options.machineName;
+
+    if (machineName == NULL) {
+        printf("Enter filename: ");
+        scanf("%99s", fileName);
+        machineName = fileName;
+    }
+
+    int loadFlags = (options.verifyImages ? LOAD_VERIFY : 0) | (options.nondeterministic ? LOAD_ALL_RULES : 0);
+
+    // Compile mode: write the machine as a precompiled image instead of running it
+    if (options.imageName != NULL) {
+        struct TuringMachine tm = loadTM(machineName, loadFlags);
+        int status = compileImage(&tm, options.imageName);
+        cleanUp(&tm);
+        return status;
+    }
+
+    double loadStart = now();
+    struct TuringMachine tm = options.resumeName != NULL ? loadTM(machineName, loadFlags)
+                                                         : createTM(machineName, loadFlags);
+    // the table is optimized before resuming, so a checkpoint of an optimized run resumes on the same table
+    struct OptimizeStats optimized;
+    if (options.optimize) {
+        optimized = optimizeTM(&tm);
+    }
+    if (options.resumeName != NULL) {
+        // Resume: the run continues from the checkpoint's configuration instead of the machine's own tape
+        resumeTM(&tm, options.resumeName);
+        printf("Resumed at step %lld in state %d, tape contents: ", tm.startSteps, originalState(&tm, tm.startState));
+        printTape(&tm.tape);
+    }
+    tm.maxSteps = options.maxSteps;
+    tm.maxSeconds = options.maxSeconds;
+    tm.detectLoops = options.detectLoops;
+    tm.checkpointName = options.checkpointName;
+    tm.checkpointInterval = options.checkpointInterval;
+    if (tm.checkpointName != NULL && (tm.multi != NULL || tm.nondet != NULL || options.sparseTape)) {
+        printf("Checkpoints of multi-tape and nondeterministic machines and of sparse tapes are not supported. \n");
+        cleanUp(&tm);
+        return 1;
+    }
+
+    // Profile: the run takes the instrumented interpreter instead of the engines
+    if (options.profileName != NULL || options.traceName != NULL) {
+        if (tm.multi != NULL || tm.nondet != NULL || options.sparseTape || options.detectLoops) {
+            printf("Profiles of multi-tape and nondeterministic machines, sparse tapes and runs with loop detection "
+                   "are not supported. \n");
+            cleanUp(&tm);
+            return 1;
+        }
+        int error;
+        tm.profile = startProfile(&tm, options.profileName, options.traceName, options.traceEvery, &error);
+        if (tm.profile == NULL && error == TM_ERROR_MEMORY) {
+            printf("Out of memory for the profile. \n");
+            cleanUp(&tm);
+            return 1;
+        }
+        if (tm.profile == NULL) {
+            printf("Cannot write trace file %s. \n", options.traceName);
+            cleanUp(&tm);
+            return 1;
+        }
+    }
+
+    // Macro machine: the run crosses a whole block of cells per memoized step
+    if (options.macroBlock > 0) {
+        if (tm.multi != NULL || tm.nondet != NULL || options.sparseTape || options.detectLoops || tm.profile != NULL) {
+            printf("Macro machine runs of multi-tape and nondeterministic machines, on sparse tapes, with loop "
+                   "detection or with profiles are not supported. \n");
+            cleanUp(&tm);
+            return 1;
+        }
+        tm.macro = makeMacroMachine(options.macroBlock);
+        if (tm.macro == NULL) {
+            printf("Out of memory for macro steps. \n");
+            cleanUp(&tm);
+            return 1;
+        }
+    }
+
+    // Sparse tape: the machine's tape moves to a page table, the dense buffer goes
+    if (options.sparseTape && tm.multi == NULL && tm.nondet == NULL) {
+        tm.sparse = makeSparseTape(&tm.tape);
+        if (tm.sparse == NULL) {
+            printf("Out of memory for tape. \n");
+            cleanUp(&tm);
+            return 1;
+        }
+        free(tm.tape.cells);
+        memset(&tm.tape, 0, sizeof(tm.tape));
+    }
+
+    // Nondeterministic mode: search every branch for one that reaches the end state
+    if (options.nondeterministic) {
+        if (tm.nondet == NULL) {
+            printf("Nondeterministic mode needs a machine file, not an image. \n");
+            cleanUp(&tm);
+            return 1;
+        }
+        int status = exploreTM(&tm, options.numThreads, options.maxConfigurations);
+        cleanUp(&tm);
+        return status;
+    }
+    // Result cache: a run the cache store already holds is not run again
+    struct ResultCache* cache = openOptionsCache(&options);
+    if (cache != NULL) {
+        attachCache(&tm, cache);
+    }
+    selectEngine(&tm, options.engine);
+    double loadSeconds = now() - loadStart;
+    double runStart = now();
+
+    if (options.outputName == NULL && options.outputFlags == 0) {
+        runTM(&tm);
+    } else {
+        // Final tape with output options, to standard output or straight to a file
+        executeOrQuit(&tm);
+        int status;
+        if (options.outputName != NULL) {
+            int fd = open(options.outputName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            status = fd >= 0 ? writeFinalTape(&tm, fd, options.outputFlags) : -1;
+            if (fd >= 0 && close(fd) != 0) {
+                status = -1;
+            }
+        } else {
+            if (!(options.outputFlags & OUTPUT_RAW)) {
+                printf("Final tape contents: ");
+            }
+            fflush(stdout);
+            status = writeFinalTape(&tm, STDOUT_FILENO, options.outputFlags);
+        }
+        if (status != 0) {
+            printf("Cannot write the final tape. \n");
+            if (cache != NULL) {
+                closeResultCache(cache);
+            }
+            cleanUp(&tm);
+            return 1;
+        }
+    }
+    if (options.showStats) {
+        double runSeconds = now() - runStart;
+        printResult(&tm.result);
+        printf("Time: load %.6f s, run %.6f s\n", loadSeconds, runSeconds);
+        if (tm.sparse != NULL) {
+            printf("Sparse tape: %ld pages of %ld cells kept, %ld at most\n",
+                   tm.sparse->numPages, SPARSE_PAGE_SIZE, tm.sparse->peakPages);
+        }
+        if (tm.macro != NULL) {
+            printf("Macro machine: blocks of %d cells, %lld macro steps, %lld of them computed, %ld kept\n",
+                   tm.macro->blockSize, tm.macro->macroSteps, tm.macro->computed, tm.macro->count);
+        }
+        if (tm.originalStates != NULL) {
+            printf("Optimized table: %d states to %d, %d unreachable, %d merged\n", optimized.states,
+                   tm.transitions.numStates, optimized.unreachable, optimized.merged);
+        }
+        if (cache != NULL) {
+            printf("Result cache: %s, %ld results kept, %lld hits, %lld misses\n",
+                   cache->hits > 0 ? "hit" : cacheableRun(&tm) ? "miss" : "not cacheable", cache->count,
+                   cache->hits, cache->misses);
+        }
+    }
+    if (cache != NULL) {
+        closeResultCache(cache);
+    }
+    // Expected tape: the exit status tells whether the final tape matches it
+    int status = 0;
+    if (options.expectName != NULL) {
+        status = expectTape(&tm, options.expectName, options.outputFlags & OUTPUT_TRIM);
+    }
+    if (tm.profile != NULL && finishProfile(&tm) != 0) {
+        cleanUp(&tm);
+        return 1;
+    }
+
+    cleanUp(&tm);
+
+    return status;
+}
+#endif
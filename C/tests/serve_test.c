@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "tm.h"
+
+// Protocol test of Project1 --serve: starts a server, loads every machine of the corpus over its socket, runs
+// each one on the input tape of its file and checks the final tape that comes back against tests/expected,
+// then checks the answers to a malformed machine, an unknown machine and a statistics request
+
+#ifndef TM_TEST_BINARY
+#define TM_TEST_BINARY "./Project1"
+#endif
+#ifndef TM_TEST_CORPUS
+#define TM_TEST_CORPUS "bench/corpus"
+#endif
+#ifndef TM_TEST_EXPECTED
+#define TM_TEST_EXPECTED "tests/expected"
+#endif
+
+#define MAX_MACHINES 256
+#define NAME_LENGTH 128
+#define CONNECT_TRIES 500       // 10 ms apart - the server needs a moment to create its socket
+
+// Request and answer headers, see the server section of README.md
+#define SERVE_LOAD 1
+#define SERVE_RUN 2
+#define SERVE_STATS 3
+#define SERVE_TAPE 1
+#define SERVE_TRIM 2
+
+struct ServeRequest {
+    uint32_t length;
+    uint16_t type;
+    uint16_t flags;
+    uint64_t tag;
+    uint64_t machine;
+    int64_t maxSteps;
+};
+
+struct ServeResponse {
+    uint32_t length;
+    uint16_t type;
+    uint16_t status;
+    uint64_t tag;
+    uint64_t machine;
+    int64_t steps;
+    int64_t head;
+    int64_t leftmost;
+    int64_t rightmost;
+    int32_t reason;
+    int32_t finalState;
+    uint64_t nanoseconds;
+};
+
+static pid_t server = -1;
+static char socketName[108];
+
+// Function to stop the test - the server goes down with it
+static void fail(const char* message, const char* name) {
+    printf("%s %s\n", message, name);
+    if (server > 0) {
+        kill(server, SIGKILL);
+        waitpid(server, NULL, 0);
+    }
+    unlink(socketName);
+    exit(1);
+}
+
+// Function to read a whole file - returns its size, the content is NUL terminated
+static long readFile(const char* path, char** content) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fail("Cannot open", path);
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    *content = (char*)malloc(size + 1);
+    if (*content == NULL || fread(*content, 1, size, file) != (size_t)size) {
+        fail("Cannot read", path);
+    }
+    (*content)[size] = '\0';
+    fclose(file);
+    return size;
+}
+
+static void sendAll(int fd, const void* bytes, size_t count) {
+    while (count > 0) {
+        ssize_t written = write(fd, bytes, count);
+        if (written <= 0) {
+            fail("Cannot write to", socketName);
+        }
+        bytes = (const char*)bytes + written;
+        count -= written;
+    }
+}
+
+static void readAll(int fd, void* bytes, size_t count) {
+    while (count > 0) {
+        ssize_t got = read(fd, bytes, count);
+        if (got <= 0) {
+            fail("Connection closed by", socketName);
+        }
+        bytes = (char*)bytes + got;
+        count -= got;
+    }
+}
+
+// Function to send one request and wait for its answer - the payload of the answer is NUL terminated
+static char* request(int fd, uint16_t type, uint16_t flags, uint64_t tag, uint64_t machine, const char* payload,
+                     uint32_t length, struct ServeResponse* response) {
+    struct ServeRequest header = { length, type, flags, tag, machine, 0 };
+    sendAll(fd, &header, sizeof(header));
+    sendAll(fd, payload, length);
+    readAll(fd, response, sizeof(*response));
+    if (response->type != type || response->tag != tag) {
+        fail("Answer does not match its request on", socketName);
+    }
+    char* answer = (char*)malloc(response->length + 1);
+    if (answer == NULL) {
+        fail("Out of memory for the answer from", socketName);
+    }
+    readAll(fd, answer, response->length);
+    answer[response->length] = '\0';
+    return answer;
+}
+
+// Function to start the server and connect to it
+static int startServer(void) {
+    snprintf(socketName, sizeof(socketName), "/tmp/tm_serve_test_%d.sock", (int)getpid());
+    server = fork();
+    if (server < 0) {
+        fail("Cannot start", TM_TEST_BINARY);
+    }
+    if (server == 0) {
+        execl(TM_TEST_BINARY, TM_TEST_BINARY, "--serve", socketName, "--threads", "2", (char*)NULL);
+        _exit(127);
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketName);
+    for (int i = 0; i < CONNECT_TRIES; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+            return fd;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        usleep(10000);
+    }
+    fail("Cannot connect to", socketName);
+    return -1;
+}
+
+// Function to load one machine of the corpus, run it on the input tape of its file and check its final tape
+static void checkMachine(int fd, const char* name, uint64_t tag) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", TM_TEST_CORPUS, name);
+    char* machine;
+    long size = readFile(path, &machine);
+    struct ServeResponse response;
+    char* answer = request(fd, SERVE_LOAD, 0, tag, 0, machine, (uint32_t)size, &response);
+    if (response.status != TM_OK) {
+        fail(answer, name);
+    }
+    free(answer);
+
+    // the input tape is the first line of the file, the server puts the 'A' cell in front of it
+    uint32_t inputLength = (uint32_t)strcspn(machine, "\r\n");
+    answer = request(fd, SERVE_RUN, SERVE_TAPE | SERVE_TRIM, tag + 1, response.machine, machine, inputLength,
+                     &response);
+    if (response.status != TM_OK || response.reason != TM_HALTED) {
+        fail("Run did not halt:", name);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", TM_TEST_EXPECTED, name);
+    char* expected;
+    long length = readFile(path, &expected);
+    while (length > 0 && (expected[length - 1] == '\n' || expected[length - 1] == '\r')) {
+        length--;
+    }
+    if ((long)response.length != length || memcmp(answer, expected, length) != 0) {
+        fail("Final tape differs from the expected tape of", name);
+    }
+    printf("%-24s %12lld steps, final tape matches\n", name, (long long)response.steps);
+    free(expected);
+    free(answer);
+    free(machine);
+}
+
+static int compareNames(const void* a, const void* b) {
+    return strcmp((const char*)a, (const char*)b);
+}
+
+int main(void) {
+    static char names[MAX_MACHINES][NAME_LENGTH];
+    int numMachines = 0;
+    DIR* dir = opendir(TM_TEST_CORPUS);
+    if (dir == NULL) {
+        fail("Cannot open corpus", TM_TEST_CORPUS);
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && numMachines < MAX_MACHINES) {
+        size_t length = strlen(entry->d_name);
+        if (length > 4 && length < NAME_LENGTH && strcmp(entry->d_name + length - 4, ".txt") == 0) {
+            strcpy(names[numMachines++], entry->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(names, numMachines, NAME_LENGTH, compareNames);
+
+    int fd = startServer();
+    for (int m = 0; m < numMachines; m++) {
+        checkMachine(fd, names[m], 2 * (uint64_t)m);
+    }
+
+    // errors are answered on the same connection, which stays usable
+    struct ServeResponse response;
+    const char* malformed = "not a machine\n";
+    free(request(fd, SERVE_LOAD, 0, 1000, 0, malformed, (uint32_t)strlen(malformed), &response));
+    if (response.status != TM_ERROR_PARSE) {
+        fail("Malformed machine was not refused by", socketName);
+    }
+    free(request(fd, SERVE_RUN, 0, 1001, 12345, "", 0, &response));
+    if (response.status != TM_ERROR_ARGUMENT) {
+        fail("Unknown machine was not refused by", socketName);
+    }
+    char* statistics = request(fd, SERVE_STATS, 0, 1002, 0, "", 0, &response);
+    if (response.status != TM_OK || strstr(statistics, "runs") == NULL) {
+        fail("No statistics from", socketName);
+    }
+    free(statistics);
+    close(fd);
+
+    // the server stops cleanly on SIGTERM and removes its socket
+    int status;
+    kill(server, SIGTERM);
+    if (waitpid(server, &status, 0) != server || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        server = -1;
+        fail("Server did not stop cleanly:", socketName);
+    }
+    unlink(socketName);
+    printf("%d machines served\n", numMachines);
+    return 0;
+}
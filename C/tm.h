@@ -0,0 +1,108 @@
+// Turing machine library - loads a machine once, from a file or from memory, and runs it on any number of tapes
+// Built from project1.c as libtm, static and shared; see README.md
+#ifndef TM_H
+#define TM_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define TM_API __attribute__((visibility("default")))
+#else
+#define TM_API
+#endif
+
+// Error codes - every function that can fail returns one of them
+#define TM_OK 0
+#define TM_ERROR_FILE 1             // the machine file cannot be opened or read
+#define TM_ERROR_PARSE 2            // malformed machine, the message says where
+#define TM_ERROR_IMAGE 3            // invalid or corrupt machine image
+#define TM_ERROR_MEMORY 4           // out of memory
+#define TM_ERROR_UNSUPPORTED 5      // the machine cannot run on the engine asked for
+#define TM_ERROR_ARGUMENT 6         // argument out of range
+
+// Reasons a run stops
+#define TM_HALTED 0                 // reached the end state
+#define TM_UNDEFINED 1              // no rule for the current state and symbol
+#define TM_NO_MOVE 2                // rule with a direction other than L or R
+#define TM_STEP_LIMIT 3             // step budget used up
+#define TM_TIME_LIMIT 4             // time budget used up
+
+// Execution engines, all give identical results
+#define TM_ENGINE_INTERPRETER 0
+#define TM_ENGINE_THREADED 1
+#define TM_ENGINE_JIT 2             // x86-64 only, tmSetEngine fails with TM_ERROR_UNSUPPORTED elsewhere
+
+// Flags of tmTape
+#define TM_TAPE_TRIM 1              // leave out the blank cells at both ends
+
+// Result of tmCompareTape for arguments that do not name a tape to compare
+#define TM_COMPARE_INVALID -2
+
+// Result of a run - positions are cell offsets from the 'A' cell
+struct TmResult {
+    int reason;             // one of the reasons above
+    int finalState;         // state the machine stopped in
+    long long steps;        // steps executed
+    long head;              // final head position
+    long leftmost;          // leftmost cell visited
+    long rightmost;         // rightmost cell visited
+    long cellsTouched;      // number of cells visited
+};
+
+// Loaded machine, together with the tapes it runs on - used by one thread at a time
+struct TmMachine;
+
+// Load a machine file or precompiled image, in the format of Project1
+// On failure *machine is NULL and, when message is not NULL, it receives a description of the error
+TM_API int tmLoadFile(const char* fileName, struct TmMachine** machine, char* message, size_t messageSize);
+
+// Load a machine, or a precompiled image, from size bytes of memory - name is used in error messages
+// The data is not needed any more once the function returns
+TM_API int tmLoadBuffer(const char* data, size_t size, const char* name, struct TmMachine** machine,
+                        char* message, size_t messageSize);
+
+TM_API void tmFree(struct TmMachine* machine);
+
+// Pick the engine of the following runs, compiling the machine for it the first time - TM_ERROR_MEMORY when
+// there is no memory for the compiled code, the machine keeps its previous engine then
+TM_API int tmSetEngine(struct TmMachine* machine, int engine);
+
+// Set the step and time budget of the following runs, 0 for none
+TM_API int tmSetLimits(struct TmMachine* machine, long long maxSteps, double maxSeconds);
+
+// Put content after the 'A' cell of the first tape, and the other tapes of a k-tape machine back to the
+// machine's own - the tape buffers are reused, so a loaded machine runs input after input without allocating
+TM_API int tmSetTape(struct TmMachine* machine, const char* content, size_t length);
+
+// Put every tape back to the machine's own tapes, as loaded
+TM_API int tmResetTape(struct TmMachine* machine);
+
+// Run the machine from its start state with the head on the 'A' cell, on the tapes as they are
+// The final tapes are left for tmTape and a following run starts on them, unless the tapes are set again
+// Returns TM_ERROR_MEMORY, without a result, when a tape cannot grow - the tapes keep the cells reached so far
+TM_API int tmRun(struct TmMachine* machine, struct TmResult* result);
+
+// Cells of a tape, the first one being 0, from the leftmost to the rightmost visited cell
+// The cells are not terminated, and stay valid until the tape is next set or run
+TM_API const char* tmTape(const struct TmMachine* machine, int tape, int flags, size_t* length);
+
+// Compare the cells tmTape gives with length bytes of expected - returns -1 when they are the same, otherwise
+// the offset of the first cell that differs, the shorter length when one is a prefix of the other
+// Returns TM_COMPARE_INVALID when the machine has no such tape, or expected is NULL with a length
+TM_API long tmCompareTape(const struct TmMachine* machine, int tape, int flags, const char* expected, size_t length);
+
+// Number of tapes of the machine
+TM_API int tmNumTapes(const struct TmMachine* machine);
+
+// Description of an error code
+TM_API const char* tmErrorString(int error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif